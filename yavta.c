@@ -18,27 +18,64 @@
  */
 
 #define __STDC_FORMAT_MACROS
+#define _GNU_SOURCE
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <sched.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include <linux/videodev2.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING
+#endif
+#endif
+#if __has_include(<linux/dma-heap.h>)
+#include <linux/dma-heap.h>
+#define HAVE_DMA_HEAP
+#endif
+#if __has_include(<linux/udmabuf.h>)
+#include <linux/udmabuf.h>
+#define HAVE_UDMABUF
+#endif
+#if __has_include(<linux/dma-buf.h>)
+#include <linux/dma-buf.h>
+#define HAVE_DMA_BUF_SYNC
+#endif
+#endif
+
 #include "interface/mmal/mmal.h"
 #include "interface/mmal/mmal_buffer.h"
 #include "interface/mmal/util/mmal_connection.h"
@@ -51,11 +88,142 @@
 #define V4L2_BUF_FLAG_ERROR	0x0040
 #endif
 
+#ifndef DMA_BUF_SYNC_START
+#define DMA_BUF_SYNC_START	(0 << 2)
+#define DMA_BUF_SYNC_END	(1 << 2)
+#endif
+
 #define ARRAY_SIZE(a)	(sizeof(a)/sizeof((a)[0]))
 
 int debug = 1;
 #define print(...) do { if (debug) printf(__VA_ARGS__); }  while (0)
 
+#ifdef ALLOC_CHECK
+/*
+ * Debug builds interpose the glibc allocator to count heap allocations made
+ * while streaming, the capture path must not allocate in steady state. Setup
+ * work done while streaming, such as growing the buffer pool, is exempted by
+ * the thread performing it.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_bool alloc_counting;
+static atomic_uint alloc_count;
+static __thread unsigned int alloc_paused;
+
+static void alloc_account(void)
+{
+	if (atomic_load_explicit(&alloc_counting, memory_order_relaxed) &&
+	    !alloc_paused)
+		atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+}
+
+void *malloc(size_t size)
+{
+	alloc_account();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_account();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_account();
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	alloc_account();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	alloc_account();
+	return __libc_memalign(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+	alloc_account();
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+	alloc_account();
+	return __libc_pvalloc(size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	int saved_errno = errno;
+	void *ptr;
+	int ret;
+
+	if (!alignment || alignment % sizeof(void *) ||
+	    (alignment & (alignment - 1)))
+		return EINVAL;
+
+	alloc_account();
+	ptr = __libc_memalign(alignment, size);
+	if (ptr == NULL) {
+		ret = errno;
+		errno = saved_errno;
+		return ret;
+	}
+
+	*memptr = ptr;
+	return 0;
+}
+
+void free(void *ptr)
+{
+	if (ptr)
+		alloc_account();
+	__libc_free(ptr);
+}
+
+static void alloc_check_start(void)
+{
+	atomic_store(&alloc_count, 0);
+	atomic_store(&alloc_counting, true);
+}
+
+/* Stop counting and return the number of allocations and frees counted. */
+static unsigned int alloc_check_stop(void)
+{
+	atomic_store(&alloc_counting, false);
+	return atomic_load(&alloc_count);
+}
+
+static void alloc_check_pause(void)
+{
+	alloc_paused++;
+}
+
+static void alloc_check_resume(void)
+{
+	alloc_paused--;
+}
+#else
+static inline void alloc_check_start(void) { }
+static inline unsigned int alloc_check_stop(void) { return 0; }
+static inline void alloc_check_pause(void) { }
+static inline void alloc_check_resume(void) { }
+#endif
+
 enum buffer_fill_mode
 {
 	BUFFER_FILL_NONE = 0,
@@ -63,15 +231,125 @@ enum buffer_fill_mode
 	BUFFER_FILL_PADDING = 1 << 1,
 };
 
+/*
+ * Buffer ownership. Buffers move from FREE to QUEUED when queued to the driver,
+ * to DEQUEUED when dequeued by the capture thread, to PIPELINE when picked by
+ * the processing thread and to WRITING while being saved, and back to FREE
+ * when the last processing stage releases them.
+ */
+enum buffer_state
+{
+	BUFFER_STATE_FREE = 0,
+	BUFFER_STATE_QUEUED,
+	BUFFER_STATE_DEQUEUED,
+	BUFFER_STATE_PIPELINE,
+	BUFFER_STATE_WRITING,
+	BUFFER_STATE_COUNT,
+};
+
+#define BUFFER_STATE_MASK(state)	(1U << BUFFER_STATE_##state)
+#define BUFFER_STATES_HELD		(BUFFER_STATE_MASK(DEQUEUED) | \
+					 BUFFER_STATE_MASK(PIPELINE) | \
+					 BUFFER_STATE_MASK(WRITING))
+
+enum stats_format
+{
+	STATS_FORMAT_NONE = 0,
+	STATS_FORMAT_JSON,
+	STATS_FORMAT_CSV,
+};
+
+enum staging_mode
+{
+	STAGING_NONE = 0,
+	STAGING_AUTO,
+	STAGING_ALWAYS,
+};
+
+enum record_mode
+{
+	RECORD_NONE = 0,
+	RECORD_APPEND,
+	RECORD_RING,
+};
+
 struct buffer
 {
 	unsigned int idx;
 	unsigned int padding[VIDEO_MAX_PLANES];
 	unsigned int size[VIDEO_MAX_PLANES];
 	void *mem[VIDEO_MAX_PLANES];
+	unsigned int mem_offset[VIDEO_MAX_PLANES];
+	void *staging[VIDEO_MAX_PLANES];
+	unsigned int pattern_gen;	/* Generation of the pattern held, 0 if none */
+	unsigned int clip_frame;	/* Clip frame held plus one, 0 if none */
 	MMAL_BUFFER_HEADER_T *mmal;
+	int dmabuf[VIDEO_MAX_PLANES];
 	int dma_fd;
 	unsigned int vcsm_handle;
+	bool requeue;
+	atomic_uint refs;
+	atomic_uint state;
+};
+
+/* Cumulative ioctl execution time, updated from any thread */
+struct ioctl_time
+{
+	atomic_ullong ns;
+	atomic_ullong max_ns;
+	atomic_uint count;
+};
+
+/* Memory carved into USERPTR buffers */
+struct userptr_pool
+{
+	void *map;
+	size_t map_size;
+	void *mem;
+	size_t size;
+	size_t used;
+};
+
+/* Procedural test pattern, see test_pattern_init() */
+struct pattern_format;
+
+struct pattern_pixel
+{
+	uint8_t rgb[3];
+	uint8_t y, u, v;
+};
+
+struct pattern_plane
+{
+	unsigned int index;		/* Memory plane */
+	unsigned int offset;
+	unsigned int stride;
+	unsigned int bytes;		/* Packed bytes per line */
+	unsigned int hsub, vsub;
+};
+
+struct test_pattern
+{
+	const struct pattern_format *format;
+	unsigned int width;
+	unsigned int height;
+	unsigned int num_planes;
+	struct pattern_plane planes[3];
+	unsigned int block;		/* Frame code block size in pixels */
+	unsigned int band;		/* First line of the moving gradient */
+	unsigned int sequence;
+	struct pattern_pixel *row;
+	uint8_t *line;
+};
+
+/* Raw clip file mapped for output playback */
+struct clip
+{
+	const uint8_t *map;
+	size_t map_size;
+	size_t frame_size;
+	unsigned int nframes;
+	unsigned int position;
 };
 
 struct device
@@ -83,6 +361,35 @@ struct device
 	enum v4l2_memory memtype;
 	unsigned int nbufs;
 	struct buffer *buffers;
+	unsigned int userptr_offset;
+	unsigned int userptr_padding;
+	bool hugepages;
+	struct userptr_pool pool;
+	bool prefault;
+
+	/* Cached copies of the frames for CPU processing */
+	enum staging_mode staging_mode;
+	bool staging;
+
+	/*
+	 * Cache maintenance hints, skipping cache operations for payloads that
+	 * the CPU doesn't read or write.
+	 */
+	bool cache_hints;
+	bool cpu_reads;
+	bool cpu_writes;
+	struct ioctl_time qbuf_time;
+	struct ioctl_time dqbuf_time;
+	struct ioctl_time sync_time;
+
+	/* Buffer pool growth, max_bufs is nbufs when the pool can't grow */
+	unsigned int max_bufs;
+	unsigned long long buffer_budget;
+	unsigned int buffer_watermark;
+
+	/* DMABUF allocator, a DMA heap or udmabuf */
+	const char *dmabuf_source;
+	int dmabuf_fd;
 
 	MMAL_COMPONENT_T *isp;
 	MMAL_COMPONENT_T *render;
@@ -103,10 +410,14 @@ struct device
 
 	unsigned int width;
 	unsigned int height;
+	unsigned int pixelformat;
 	unsigned int fps;
+	struct v4l2_fract frame_period;
 	unsigned int frame_time_usec;
 	uint32_t buffer_output_flags;
 	uint32_t timestamp_type;
+	struct v4l2_fract pace_period;
+	uint64_t output_timestamp_ns;	/* Paced output timestamp, 0 for none */
 	struct timeval starttime;
 	int64_t lastpts;
 
@@ -115,8 +426,31 @@ struct device
 
 	void *pattern[VIDEO_MAX_PLANES];
 	unsigned int patternsize[VIDEO_MAX_PLANES];
+	unsigned int pattern_gen;
+	bool clip_playback;
+	struct clip clip;
+	bool generate;
+	struct test_pattern test_pattern;
+	struct device *loopback;	/* Output side of a loopback pair */
 
 	bool write_data_prefix;
+	unsigned int writer_threads;
+	unsigned int writer_queue;
+	bool io_uring;
+	enum record_mode record_mode;
+	unsigned long long record_size;
+	bool direct;
+	unsigned int direct_align;
+	unsigned int stats_interval;
+	bool print_frames;
+	enum stats_format stats_format;
+	bool stats_intervals;
+	const char *stats_file;
+
+	/* Buffers released by the processing stages, to be requeued */
+	atomic_ullong released;
+	int release_fd;
+	atomic_uint buffer_errors;
 
 
 	VCOS_THREAD_T save_thread;
@@ -126,12 +460,6 @@ struct device
 	FILE *pts_fd;
 };
 
-static void errno_exit(const char *s)
-{
-        fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
-        exit(EXIT_FAILURE);
-}
-
 static bool video_is_mplane(struct device *dev)
 {
 	return dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ||
@@ -150,6 +478,62 @@ static bool video_is_output(struct device *dev)
 	       dev->type == V4L2_BUF_TYPE_VIDEO_OUTPUT;
 }
 
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Signal and reset the eventfds used to wake up threads. A full counter or
+ * an empty non-blocking eventfd still leaves the waiter woken up.
+ */
+static void eventfd_signal(int fd)
+{
+	static const uint64_t one = 1;
+
+	if (write(fd, &one, sizeof one) < 0 && errno != EAGAIN)
+		print("Unable to signal eventfd: %s (%d)\n", strerror(errno), errno);
+}
+
+static void eventfd_clear(int fd)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN &&
+	    errno != EINTR)
+		print("Unable to read eventfd: %s (%d)\n", strerror(errno), errno);
+}
+
+static void ioctl_time_record(struct ioctl_time *time, uint64_t start)
+{
+	uint64_t ns = clock_ns(CLOCK_MONOTONIC) - start;
+	unsigned long long max = atomic_load_explicit(&time->max_ns, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&time->ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&time->count, 1, memory_order_relaxed);
+
+	while (ns > max &&
+	       !atomic_compare_exchange_weak_explicit(&time->max_ns, &max, ns,
+						      memory_order_relaxed,
+						      memory_order_relaxed))
+		;
+}
+
+static void ioctl_time_print(struct ioctl_time *time, const char *name)
+{
+	unsigned int count = atomic_load(&time->count);
+
+	if (!count)
+		return;
+
+	print("%s: avg %.1f us, max %.1f us over %u calls\n", name,
+		atomic_load(&time->ns) / 1000.0 / count,
+		atomic_load(&time->max_ns) / 1000.0, count);
+}
+
 static struct {
 	enum v4l2_buf_type type;
 	bool supported;
@@ -433,6 +817,10 @@ static void video_init(struct device *dev)
 {
 	memset(dev, 0, sizeof *dev);
 	dev->fd = -1;
+	dev->release_fd = -1;
+	dev->dmabuf_fd = -1;
+	dev->stats_interval = 1000;
+	dev->buffer_watermark = 2;
 	dev->memtype = V4L2_MEMORY_MMAP;
 	dev->buffers = NULL;
 	dev->type = (enum v4l2_buf_type)-1;
@@ -524,8 +912,18 @@ static void video_close(struct device *dev)
 
 	for (i = 0; i < dev->num_planes; i++)
 		free(dev->pattern[i]);
+	if (dev->clip.map)
+		munmap((void *)dev->clip.map, dev->clip.map_size);
+	free(dev->test_pattern.row);
+	free(dev->test_pattern.line);
+	if (dev->loopback) {
+		video_close(dev->loopback);
+		free(dev->loopback);
+	}
 
 	free(dev->buffers);
+	if (dev->dmabuf_fd != -1)
+		close(dev->dmabuf_fd);
 	if (dev->opened)
 		close(dev->fd);
 }
@@ -670,6 +1068,7 @@ static int video_get_format(struct device *dev)
 	if (video_is_mplane(dev)) {
 		dev->width = fmt.fmt.pix_mp.width;
 		dev->height = fmt.fmt.pix_mp.height;
+		dev->pixelformat = fmt.fmt.pix_mp.pixelformat;
 		dev->num_planes = fmt.fmt.pix_mp.num_planes;
 
 		print("Video format: %s (%08x) %ux%u field %s, %u planes: \n",
@@ -692,6 +1091,7 @@ static int video_get_format(struct device *dev)
 	} else {
 		dev->width = fmt.fmt.pix.width;
 		dev->height = fmt.fmt.pix.height;
+		dev->pixelformat = fmt.fmt.pix.pixelformat;
 		dev->num_planes = 1;
 
 		dev->plane_fmt[0].bytesperline = fmt.fmt.pix.bytesperline;
@@ -729,6 +1129,132 @@ static int format_bpp(__u32 pixfmt)
 	}
 }
 
+static unsigned int round_up(unsigned int value, unsigned int align)
+{
+	return (value + align - 1) / align * align;
+}
+
+/*
+ * Return the alignment of memory buffers, file offsets and lengths required
+ * for O_DIRECT I/O on the file system holding filename, or 0 if O_DIRECT isn't
+ * supported.
+ *
+ * The kernel reports the alignment for regular files only. Frames appended to
+ * a single file are queried on that file, which is created if needed. Per-frame
+ * files are queried on an unnamed temporary file in their directory.
+ */
+static unsigned int direct_io_alignment(const char *filename)
+{
+	unsigned int align = 0;
+	struct stat st;
+	char *dir;
+	char *p;
+	int fd;
+
+	dir = strdup(filename);
+	if (dir == NULL)
+		return 0;
+
+	p = strrchr(dir, '/');
+	if (p == NULL)
+		strcpy(dir, ".");
+	else if (p == dir)
+		p[1] = '\0';
+	else
+		*p = '\0';
+
+	if (strchr(filename, '#') == NULL)
+		fd = open(filename, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	else
+		fd = open(dir, O_TMPFILE | O_WRONLY, S_IRUSR | S_IWUSR);
+
+	if (fd >= 0) {
+#ifdef STATX_DIOALIGN
+		struct statx stx;
+
+		if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+		    (stx.stx_mask & STATX_DIOALIGN)) {
+			align = stx.stx_dio_offset_align > stx.stx_dio_mem_align
+			      ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+			close(fd);
+			free(dir);
+			return align;
+		}
+#endif
+
+		/* The preferred I/O size is a multiple of the logical block size. */
+		if (fstat(fd, &st) == 0)
+			align = st.st_blksize;
+		close(fd);
+	} else if (stat(dir, &st) == 0) {
+		align = st.st_blksize;
+	}
+
+	free(dir);
+	return align;
+}
+
+/*
+ * Frames appended to an existing file start at its end, which O_DIRECT
+ * requires to be aligned. Pad the file with zeros up to the next aligned
+ * offset.
+ */
+static int direct_io_pad_file(const char *filename, unsigned int align)
+{
+	struct stat st;
+	off_t size;
+	int ret = 0;
+	int fd;
+
+	if (strchr(filename, '#') != NULL)
+		return 0;
+
+	fd = open(filename, O_WRONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto done;
+	}
+
+	size = (st.st_size + align - 1) / align * align;
+	if (size != st.st_size) {
+		print("Padding %s from %lld to %lld bytes for direct I/O\n",
+			filename, (long long)st.st_size, (long long)size);
+		if (ftruncate(fd, size) < 0)
+			ret = -errno;
+	}
+
+done:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Pad a line stride so that full frames are a multiple of the O_DIRECT
+ * alignment, avoiding partial block writes with the smallest possible
+ * padding.
+ */
+static unsigned int direct_io_stride(unsigned int stride, unsigned int height,
+				     unsigned int align)
+{
+	unsigned int a = align;
+	unsigned int b = height;
+
+	if (!height)
+		return round_up(stride, align);
+
+	while (b) {
+		unsigned int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return round_up(stride, align / a);
+}
+
 static int video_set_format(struct device *dev, unsigned int w, unsigned int h,
 			    unsigned int format, unsigned int stride,
 			    unsigned int buffer_size, enum v4l2_field field,
@@ -738,6 +1264,9 @@ static int video_set_format(struct device *dev, unsigned int w, unsigned int h,
 	unsigned int i;
 	int ret;
 
+	if (buffer_size && dev->direct)
+		buffer_size = round_up(buffer_size, dev->direct_align);
+
 	memset(&fmt, 0, sizeof fmt);
 	fmt.type = dev->type;
 
@@ -751,6 +1280,9 @@ static int video_set_format(struct device *dev, unsigned int w, unsigned int h,
 		fmt.fmt.pix_mp.num_planes = info->n_planes;
 		fmt.fmt.pix_mp.flags = flags;
 
+		if (stride && dev->direct)
+			stride = direct_io_stride(stride, h, dev->direct_align);
+
 		for (i = 0; i < fmt.fmt.pix_mp.num_planes; i++) {
 			fmt.fmt.pix_mp.plane_fmt[i].bytesperline = stride;
 			fmt.fmt.pix_mp.plane_fmt[i].sizeimage = buffer_size;
@@ -763,6 +1295,8 @@ static int video_set_format(struct device *dev, unsigned int w, unsigned int h,
 		print("stride is %d\n",stride);
 		if (!stride)
 			stride = ((w+31) &~31)*format_bpp(format);
+		if (dev->direct)
+			stride = direct_io_stride(stride, h, dev->direct_align);
 		print("stride is now %d\n",stride);
 		fmt.fmt.pix.bytesperline = stride;
 		fmt.fmt.pix.sizeimage = buffer_size;
@@ -843,13 +1377,28 @@ static int video_set_framerate(struct device *dev, struct v4l2_fract *time_per_f
 	print("Frame rate set: %u/%u\n",
 		parm.parm.capture.timeperframe.numerator,
 		parm.parm.capture.timeperframe.denominator);
+
+	dev->frame_period = parm.parm.capture.timeperframe;
 	return 0;
 }
 
+static int buffer_import(int dmafd, unsigned int *vcsm_hdl)
+{
+	unsigned int vcsm_handle;
+
+	print("Importing DMABUF %d into VCSM...\n", dmafd);
+	vcsm_handle = vcsm_import_dmabuf(dmafd, "V4L2 buf");
+	if (vcsm_handle)
+		print("...done. vcsm_handle %u\n", vcsm_handle);
+	else
+		print("...done. Failed\n");
+	*vcsm_hdl = vcsm_handle;
+	return vcsm_handle ? 0 : -1;
+}
+
 static int buffer_export(int v4l2fd, enum v4l2_buf_type bt, int index, int *dmafd, unsigned int *vcsm_hdl)
 {
 	struct v4l2_exportbuffer expbuf;
-	unsigned int vcsm_handle;
 
 	memset(&expbuf, 0, sizeof(expbuf));
 	expbuf.type = bt;
@@ -861,45 +1410,63 @@ static int buffer_export(int v4l2fd, enum v4l2_buf_type bt, int index, int *dmaf
 	}
 	*dmafd = expbuf.fd;
 
-	print("Importing DMABUF %d into VCSM...\n", expbuf.fd);
-	vcsm_handle = vcsm_import_dmabuf(expbuf.fd, "V4L2 buf");
-	if (vcsm_handle)
-		print("...done. vcsm_handle %u\n", vcsm_handle);
-	else
-		print("...done. Failed\n");
-	*vcsm_hdl = vcsm_handle;
-	return vcsm_handle ? 0 : -1;
+	return buffer_import(expbuf.fd, vcsm_hdl);
 }
 
+/*
+ * MMAP buffers aren't mapped at allocation time, zero-copy consumers never
+ * dereference them. Record the planes layout for video_buffer_map().
+ */
 static int video_buffer_mmap(struct device *dev, struct buffer *buffer,
 			     struct v4l2_buffer *v4l2buf)
 {
-	unsigned int length;
-	unsigned int offset;
 	unsigned int i;
 
 	for (i = 0; i < dev->num_planes; i++) {
 		if (video_is_mplane(dev)) {
-			length = v4l2buf->m.planes[i].length;
-			offset = v4l2buf->m.planes[i].m.mem_offset;
+			buffer->size[i] = v4l2buf->m.planes[i].length;
+			buffer->mem_offset[i] = v4l2buf->m.planes[i].m.mem_offset;
 		} else {
-			length = v4l2buf->length;
-			offset = v4l2buf->m.offset;
+			buffer->size[i] = v4l2buf->length;
+			buffer->mem_offset[i] = v4l2buf->m.offset;
 		}
 
-		buffer->mem[i] = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED,
-				      dev->fd, offset);
+		buffer->mem[i] = NULL;
+		buffer->padding[i] = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Map an MMAP buffer when a CPU stage first needs it, read-only unless the CPU
+ * writes to the payload. Buffers are only accessed by their current owner, so
+ * this can be called from any thread.
+ */
+static int video_buffer_map(struct device *dev, struct buffer *buffer)
+{
+	int prot = dev->cpu_writes ? PROT_READ | PROT_WRITE : PROT_READ;
+	unsigned int i;
+
+	if (dev->memtype != V4L2_MEMORY_MMAP)
+		return 0;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (buffer->mem[i])
+			continue;
+
+		buffer->mem[i] = mmap(0, buffer->size[i], prot, MAP_SHARED,
+				      dev->fd, buffer->mem_offset[i]);
 		if (buffer->mem[i] == MAP_FAILED) {
+			buffer->mem[i] = NULL;
 			print("Unable to map buffer %u/%u: %s (%d)\n",
 			       buffer->idx, i, strerror(errno), errno);
 			return -1;
 		}
 
-		buffer->size[i] = length;
-		buffer->padding[i] = 0;
-
-		print("Buffer %u/%u mapped at address %p.\n",
-		       buffer->idx, i, buffer->mem[i]);
+		print("Buffer %u/%u mapped at address %p%s.\n",
+		       buffer->idx, i, buffer->mem[i],
+		       prot & PROT_WRITE ? "" : " (read-only)");
 	}
 
 	return 0;
@@ -911,6 +1478,9 @@ static int video_buffer_munmap(struct device *dev, struct buffer *buffer)
 	int ret;
 
 	for (i = 0; i < dev->num_planes; i++) {
+		if (buffer->mem[i] == NULL)
+			continue;
+
 		ret = munmap(buffer->mem[i], buffer->size[i]);
 		if (ret < 0) {
 			print("Unable to unmap buffer %u/%u: %s (%d)\n",
@@ -923,46 +1493,176 @@ static int video_buffer_munmap(struct device *dev, struct buffer *buffer)
 	return 0;
 }
 
-static int video_buffer_alloc_userptr(struct device *dev, struct buffer *buffer,
-				      struct v4l2_buffer *v4l2buf,
-				      unsigned int offset, unsigned int padding)
+static size_t hugepage_size(void)
 {
-	int page_size = getpagesize();
-	unsigned int length;
-	unsigned int i;
-	int ret;
-
-	for (i = 0; i < dev->num_planes; i++) {
-		if (video_is_mplane(dev))
-			length = v4l2buf->m.planes[i].length;
-		else
-			length = v4l2buf->length;
-
-		ret = posix_memalign(&buffer->mem[i], page_size,
-				     length + offset + padding);
-		if (ret < 0) {
-			print("Unable to allocate buffer %u/%u (%d)\n",
-			       buffer->idx, i, ret);
-			return -ENOMEM;
-		}
+	unsigned long size = 0;
+	char line[128];
+	FILE *file;
 
-		buffer->mem[i] += offset;
-		buffer->size[i] = length;
-		buffer->padding[i] = padding;
+	file = fopen("/proc/meminfo", "r");
+	if (file == NULL)
+		return 2 * 1024 * 1024;
 
-		print("Buffer %u/%u allocated at address %p.\n",
-		       buffer->idx, i, buffer->mem[i]);
+	while (fgets(line, sizeof line, file)) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &size) == 1)
+			break;
 	}
 
-	return 0;
+	fclose(file);
+	return size ? size * 1024 : 2 * 1024 * 1024;
 }
 
-static void video_buffer_free_userptr(struct device *dev, struct buffer *buffer)
+/*
+ * Back the USERPTR pool with huge pages to reduce TLB misses when the CPU walks
+ * large frames. Use hugetlbfs pages when some are reserved, and transparent
+ * huge pages on a huge page aligned mapping otherwise.
+ */
+static int userptr_pool_create(struct userptr_pool *pool, size_t size)
+{
+	size_t huge = hugepage_size();
+	void *mem;
+
+	size = (size + huge - 1) / huge * huge;
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED) {
+		pool->map = mem;
+		pool->map_size = size;
+		pool->mem = mem;
+		pool->size = size;
+		pool->used = 0;
+
+		print("USERPTR pool: %zu bytes in %zu kB hugetlb pages\n",
+			size, huge / 1024);
+		return 0;
+	}
+
+	mem = mmap(NULL, size + huge, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		print("Unable to map %zu bytes USERPTR pool: %s (%d)\n",
+			size, strerror(errno), errno);
+		return -errno;
+	}
+
+	pool->map = mem;
+	pool->map_size = size + huge;
+	pool->mem = (void *)(((uintptr_t)mem + huge - 1) & ~(uintptr_t)(huge - 1));
+	pool->size = size;
+	pool->used = 0;
+
+	if (madvise(pool->mem, size, MADV_HUGEPAGE) < 0)
+		print("USERPTR pool: %zu bytes, transparent huge pages unavailable (%s)\n",
+			size, strerror(errno));
+	else
+		print("USERPTR pool: %zu bytes in %zu kB transparent huge pages\n",
+			size, huge / 1024);
+
+	return 0;
+}
+
+static void userptr_pool_destroy(struct userptr_pool *pool)
+{
+	if (pool->map == NULL)
+		return;
+
+	munmap(pool->map, pool->map_size);
+	memset(pool, 0, sizeof *pool);
+}
+
+/* Return NULL when the pool is exhausted. */
+static void *userptr_pool_alloc(struct userptr_pool *pool, size_t size,
+				size_t align)
+{
+	size_t offset = (pool->used + align - 1) / align * align;
+
+	if (pool->mem == NULL || offset + size > pool->size)
+		return NULL;
+
+	pool->used = offset + size;
+	return pool->mem + offset;
+}
+
+static bool userptr_pool_owns(struct userptr_pool *pool, void *mem)
+{
+	return pool->mem && mem >= pool->mem && mem < pool->mem + pool->size;
+}
+
+static int video_buffer_alloc_userptr(struct device *dev, struct buffer *buffer,
+				      struct v4l2_buffer *v4l2buf,
+				      unsigned int offset, unsigned int padding)
+{
+	unsigned int page_size = getpagesize();
+	unsigned int align = dev->direct && dev->direct_align > page_size
+			   ? dev->direct_align : page_size;
+	unsigned int length[VIDEO_MAX_PLANES];
+	size_t footprint = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (video_is_mplane(dev))
+			length[i] = v4l2buf->m.planes[i].length;
+		else
+			length[i] = v4l2buf->length;
+
+		/* O_DIRECT writes full blocks, pad the buffer accordingly. */
+		if (dev->direct)
+			length[i] = round_up(length[i], dev->direct_align);
+
+		footprint += round_up(length[i] + offset + padding, align);
+	}
+
+	/* Clip playback points the buffers straight into the clip mapping. */
+	if (dev->clip_playback && video_is_output(dev)) {
+		for (i = 0; i < dev->num_planes; i++)
+			buffer->size[i] = length[i];
+		return 0;
+	}
+
+	/*
+	 * Size the huge pages pool for the initial buffers. Buffers added when
+	 * the pool grows fall back to normal pages.
+	 */
+	if (dev->hugepages && dev->pool.map == NULL) {
+		ret = userptr_pool_create(&dev->pool, footprint * dev->max_bufs);
+		if (ret < 0)
+			dev->hugepages = false;
+	}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		buffer->mem[i] = dev->hugepages
+			       ? userptr_pool_alloc(&dev->pool, length[i] + offset + padding, align)
+			       : NULL;
+		if (buffer->mem[i] == NULL) {
+			ret = posix_memalign(&buffer->mem[i], align,
+					     length[i] + offset + padding);
+			if (ret) {
+				print("Unable to allocate buffer %u/%u (%d)\n",
+				       buffer->idx, i, ret);
+				return -ENOMEM;
+			}
+		}
+
+		buffer->mem[i] += offset;
+		buffer->size[i] = length[i];
+		buffer->padding[i] = padding;
+
+		print("Buffer %u/%u allocated at address %p.\n",
+		       buffer->idx, i, buffer->mem[i]);
+	}
+
+	return 0;
+}
+
+static void video_buffer_free_userptr(struct device *dev, struct buffer *buffer)
 {
 	unsigned int i;
 
 	for (i = 0; i < dev->num_planes; i++) {
-		free(buffer->mem[i]);
+		if (!userptr_pool_owns(&dev->pool, buffer->mem[i]))
+			free(buffer->mem[i]);
 		buffer->mem[i] = NULL;
 	}
 }
@@ -981,6 +1681,164 @@ static void video_buffer_fill_userptr(struct device *dev, struct buffer *buffer,
 		v4l2buf->m.planes[i].m.userptr = (unsigned long)buffer->mem[i];
 }
 
+/*
+ * Open the DMABUF allocator, either /dev/udmabuf or a DMA heap device node.
+ */
+static int dmabuf_open(struct device *dev)
+{
+	const char *name = !strcmp(dev->dmabuf_source, "udmabuf")
+			 ? "/dev/udmabuf" : dev->dmabuf_source;
+
+	if (dev->dmabuf_fd != -1)
+		return 0;
+
+	dev->dmabuf_fd = open(name, O_RDWR | O_CLOEXEC);
+	if (dev->dmabuf_fd < 0) {
+		print("Unable to open DMABUF allocator %s: %s (%d).\n", name,
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	print("Allocating DMABUFs from %s\n", name);
+	return 0;
+}
+
+/*
+ * Allocate a DMABUF of size bytes and return its file descriptor. udmabuf
+ * wraps the pages of a memfd, which must be sealed against shrinking, and
+ * keeps a reference to them, so the memfd can be closed right away.
+ */
+static int dmabuf_alloc(struct device *dev, size_t size)
+{
+	if (!strcmp(dev->dmabuf_source, "udmabuf")) {
+#ifdef HAVE_UDMABUF
+		struct udmabuf_create create;
+		int memfd;
+		int ret;
+
+		memfd = memfd_create("yavta", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (memfd < 0)
+			return -errno;
+
+		if (ftruncate(memfd, size) < 0 ||
+		    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+			ret = -errno;
+			close(memfd);
+			return ret;
+		}
+
+		memset(&create, 0, sizeof create);
+		create.memfd = memfd;
+		create.flags = UDMABUF_FLAGS_CLOEXEC;
+		create.offset = 0;
+		create.size = size;
+
+		ret = ioctl(dev->dmabuf_fd, UDMABUF_CREATE, &create);
+		if (ret < 0)
+			ret = -errno;
+		close(memfd);
+		return ret;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+#ifdef HAVE_DMA_HEAP
+	struct dma_heap_allocation_data data;
+
+	memset(&data, 0, sizeof data);
+	data.len = size;
+	data.fd_flags = O_RDWR | O_CLOEXEC;
+
+	if (ioctl(dev->dmabuf_fd, DMA_HEAP_IOCTL_ALLOC, &data) < 0)
+		return -errno;
+
+	return data.fd;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int video_buffer_alloc_dmabuf(struct device *dev, struct buffer *buffer,
+				     struct v4l2_buffer *v4l2buf)
+{
+	unsigned int page_size = getpagesize();
+	unsigned int length;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		buffer->dmabuf[i] = -1;
+		buffer->mem[i] = NULL;
+	}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (video_is_mplane(dev))
+			length = v4l2buf->m.planes[i].length;
+		else
+			length = v4l2buf->length;
+
+		length = round_up(length, page_size);
+
+		fd = dmabuf_alloc(dev, length);
+		if (fd < 0) {
+			print("Unable to allocate DMABUF %u/%u: %s (%d)\n",
+			       buffer->idx, i, strerror(-fd), -fd);
+			return fd;
+		}
+
+		buffer->dmabuf[i] = fd;
+		buffer->mem[i] = mmap(0, length, PROT_READ | PROT_WRITE,
+				      MAP_SHARED, fd, 0);
+		if (buffer->mem[i] == MAP_FAILED) {
+			buffer->mem[i] = NULL;
+			print("Unable to map DMABUF %u/%u: %s (%d)\n",
+			       buffer->idx, i, strerror(errno), errno);
+			return -errno;
+		}
+
+		buffer->size[i] = length;
+		buffer->padding[i] = 0;
+
+		print("Buffer %u/%u allocated as DMABUF %d mapped at address %p.\n",
+		       buffer->idx, i, fd, buffer->mem[i]);
+	}
+
+	return 0;
+}
+
+static void video_buffer_free_dmabuf(struct device *dev, struct buffer *buffer)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (buffer->mem[i])
+			munmap(buffer->mem[i], buffer->size[i]);
+		if (buffer->dmabuf[i] != -1)
+			close(buffer->dmabuf[i]);
+
+		buffer->mem[i] = NULL;
+		buffer->dmabuf[i] = -1;
+	}
+}
+
+static void video_buffer_fill_dmabuf(struct device *dev, struct buffer *buffer,
+				     struct v4l2_buffer *v4l2buf)
+{
+	unsigned int i;
+
+	if (!video_is_mplane(dev)) {
+		v4l2buf->m.fd = buffer->dmabuf[0];
+		v4l2buf->length = buffer->size[0];
+		return;
+	}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		v4l2buf->m.planes[i].m.fd = buffer->dmabuf[i];
+		v4l2buf->m.planes[i].length = buffer->size[i];
+	}
+}
+
 static void get_ts_flags(uint32_t flags, const char **ts_type, const char **ts_source)
 {
 	switch (flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) {
@@ -1008,6 +1866,107 @@ static void get_ts_flags(uint32_t flags, const char **ts_type, const char **ts_s
 	}
 }
 
+static int video_buffer_alloc_staging(struct device *dev, struct buffer *buffer)
+{
+	unsigned int align = 64;
+	unsigned int i;
+
+	/* Frames are written from the staging buffers, padded for O_DIRECT. */
+	if (dev->direct && dev->direct_align > align)
+		align = dev->direct_align;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (posix_memalign(&buffer->staging[i], align,
+				   round_up(buffer->size[i], align))) {
+			buffer->staging[i] = NULL;
+			print("Unable to allocate staging buffer %u/%u\n",
+			       buffer->idx, i);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* Buffer indices must fit in the released buffers bitmap. */
+#define BUFFERS_GROW_MAX	64
+
+/* Query buffer index and allocate or map its memory. */
+static int video_buffer_setup(struct device *dev, struct buffer *buffer,
+			      unsigned int index, struct v4l2_buffer *buf,
+			      struct v4l2_plane *planes)
+{
+	const char *ts_type, *ts_source;
+	unsigned int i;
+	int ret;
+
+	memset(buf, 0, sizeof *buf);
+	memset(planes, 0, VIDEO_MAX_PLANES * sizeof planes[0]);
+
+	buf->index = index;
+	buf->type = dev->type;
+	buf->memory = dev->memtype;
+	buf->length = VIDEO_MAX_PLANES;
+	buf->m.planes = planes;
+
+	ret = ioctl(dev->fd, VIDIOC_QUERYBUF, buf);
+	if (ret < 0) {
+		print("Unable to query buffer %u: %s (%d).\n", index,
+			strerror(errno), errno);
+		return ret;
+	}
+	get_ts_flags(buf->flags, &ts_type, &ts_source);
+	print("length: %u offset: %u timestamp type/source: %s/%s\n",
+	       buf->length, buf->m.offset, ts_type, ts_source);
+
+	buffer->idx = index;
+	for (i = 0; i < VIDEO_MAX_PLANES; i++)
+		buffer->dmabuf[i] = -1;
+
+	switch (dev->memtype) {
+	case V4L2_MEMORY_MMAP:
+		ret = video_buffer_mmap(dev, buffer, buf);
+		if (ret < 0 || !dev->cache_hints)
+			break;
+
+		/* Export the planes to bracket CPU access with DMA_BUF_IOCTL_SYNC. */
+		for (i = 0; i < dev->num_planes; i++) {
+			struct v4l2_exportbuffer expbuf;
+
+			memset(&expbuf, 0, sizeof expbuf);
+			expbuf.type = dev->type;
+			expbuf.index = index;
+			expbuf.plane = i;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+			if (ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+				print("Unable to export buffer %u/%u for cache maintenance: %s (%d)\n",
+					index, i, strerror(errno), errno);
+				break;
+			}
+			buffer->dmabuf[i] = expbuf.fd;
+		}
+		break;
+
+	case V4L2_MEMORY_USERPTR:
+		ret = video_buffer_alloc_userptr(dev, buffer, buf,
+						 dev->userptr_offset,
+						 dev->userptr_padding);
+		break;
+
+	case V4L2_MEMORY_DMABUF:
+		ret = video_buffer_alloc_dmabuf(dev, buffer, buf);
+		break;
+
+	default:
+		break;
+	}
+
+	if (ret >= 0 && dev->staging)
+		ret = video_buffer_alloc_staging(dev, buffer);
+
+	return ret;
+}
+
 static int video_alloc_buffers(struct device *dev, int nbufs,
 	unsigned int offset, unsigned int padding)
 {
@@ -1015,13 +1974,25 @@ static int video_alloc_buffers(struct device *dev, int nbufs,
 	struct v4l2_requestbuffers rb;
 	struct v4l2_buffer buf;
 	struct buffer *buffers;
+	unsigned int capacity;
 	unsigned int i;
 	int ret;
 
+	dev->userptr_offset = offset;
+	dev->userptr_padding = padding;
+
+	if (dev->memtype == V4L2_MEMORY_DMABUF) {
+		ret = dmabuf_open(dev);
+		if (ret < 0)
+			return ret;
+	}
+
 	memset(&rb, 0, sizeof rb);
 	rb.count = nbufs;
 	rb.type = dev->type;
 	rb.memory = dev->memtype;
+	if (dev->cache_hints)
+		rb.flags = V4L2_MEMORY_FLAG_NON_COHERENT;
 
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
 	if (ret < 0) {
@@ -1032,52 +2003,43 @@ static int video_alloc_buffers(struct device *dev, int nbufs,
 
 	print("%u buffers requested, V4L2 returned %u bufs.\n", nbufs, rb.count);
 
-	buffers = malloc(rb.count * sizeof buffers[0]);
+	if (dev->cache_hints)
+		print("Cache hints %s, %s memory, CPU %s payload\n",
+			rb.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS
+			? "supported" : "not supported by the driver",
+			rb.flags & V4L2_MEMORY_FLAG_NON_COHERENT
+			? "non-coherent" : "coherent",
+			dev->cpu_reads ? (dev->cpu_writes ? "reads and writes" : "reads")
+			: (dev->cpu_writes ? "writes" : "doesn't access"));
+
+	dev->max_bufs = rb.count;
+
+	/*
+	 * The buffers array is shared with the processing threads and can't be
+	 * reallocated, reserve room for the pool to grow.
+	 */
+	capacity = dev->buffer_budget && rb.count < BUFFERS_GROW_MAX
+		 ? BUFFERS_GROW_MAX : rb.count;
+
+	buffers = calloc(capacity, sizeof buffers[0]);
 	if (buffers == NULL)
 		return -ENOMEM;
 
 	/* Map the buffers. */
 	for (i = 0; i < rb.count; ++i) {
-		const char *ts_type, *ts_source;
-
-		memset(&buf, 0, sizeof buf);
-		memset(planes, 0, sizeof planes);
-
-		buf.index = i;
-		buf.type = dev->type;
-		buf.memory = dev->memtype;
-		buf.length = VIDEO_MAX_PLANES;
-		buf.m.planes = planes;
-
-		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
-		if (ret < 0) {
-			print("Unable to query buffer %u: %s (%d).\n", i,
-				strerror(errno), errno);
+		ret = video_buffer_setup(dev, &buffers[i], i, &buf, planes);
+		if (ret < 0)
 			return ret;
-		}
-		get_ts_flags(buf.flags, &ts_type, &ts_source);
-		print("length: %u offset: %u timestamp type/source: %s/%s\n",
-		       buf.length, buf.m.offset, ts_type, ts_source);
-
-		buffers[i].idx = i;
-
-		switch (dev->memtype) {
-		case V4L2_MEMORY_MMAP:
-			ret = video_buffer_mmap(dev, &buffers[i], &buf);
-			break;
-
-		case V4L2_MEMORY_USERPTR:
-			ret = video_buffer_alloc_userptr(dev, &buffers[i], &buf, offset, padding);
-			break;
 
-		default:
-			break;
+		/* Imported DMABUFs don't need to be exported back from V4L2. */
+		if (dev->memtype == V4L2_MEMORY_DMABUF) {
+			buffers[i].dma_fd = buffers[i].dmabuf[0];
+			ret = buffer_import(buffers[i].dma_fd, &buffers[i].vcsm_handle);
+		} else {
+			ret = buffer_export(dev->fd, dev->type, i, &buffers[i].dma_fd, &buffers[i].vcsm_handle);
 		}
 
-		if (ret < 0)
-			return ret;
-
-		if (!buffer_export(dev->fd, dev->type, i, &buffers[i].dma_fd, &buffers[i].vcsm_handle))
+		if (!ret)
 		{
 			dev->can_zero_copy = MMAL_TRUE;
 			print("Exported buffer %d to dmabuf %d, vcsm handle %u\n", i, buffers[i].dma_fd, buffers[i].vcsm_handle);
@@ -1101,20 +2063,95 @@ static int video_alloc_buffers(struct device *dev, int nbufs,
 
 			if (dev->can_zero_copy)
 				mmal_buf->data = (uint8_t*)vcsm_vc_hdl_from_hdl(buffers[i].vcsm_handle);
+			else if (video_buffer_map(dev, &buffers[i]) < 0)
+				return -1;
 			else
 				mmal_buf->data = buffers[i].mem[0];
 			mmal_buf->alloc_size = buf.length;
 			buffers[i].mmal = mmal_buf;
 			print("Linking V4L2 buffer index %d ptr %p to MMAL header %p. mmal->data 0x%X\n",
 				i, &buffers[i], mmal_buf, (uint32_t)mmal_buf->data);
-			/* Put buffer back in the pool */
-			mmal_buffer_header_release(mmal_buf);
+			/*
+			 * The header stays with the buffer instead of going back to
+			 * the pool, it's sent along with the buffer and returned by
+			 * isp_ip_cb().
+			 */
 		}
 	}
 
+	/* MMAL copies the payload with the CPU when it can't import the buffers. */
+	if (dev->mmal_pool && !dev->can_zero_copy)
+		dev->cpu_reads = true;
+
 	dev->timestamp_type = buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
 	dev->buffers = buffers;
 	dev->nbufs = rb.count;
+
+	if (dev->buffer_budget && dev->mmal_pool) {
+		print("Buffer pool growth isn't supported with MMAL.\n");
+	} else if (dev->buffer_budget) {
+		unsigned long long frame_size = 0;
+
+		for (i = 0; i < dev->num_planes; i++)
+			frame_size += buffers[0].size[i];
+
+		if (frame_size && dev->buffer_budget / frame_size > rb.count)
+			dev->max_bufs = dev->buffer_budget / frame_size < capacity
+				      ? dev->buffer_budget / frame_size : capacity;
+
+		print("Buffer pool can grow to %u buffers (%llu bytes budget).\n",
+			dev->max_bufs, dev->buffer_budget);
+	}
+
+	return 0;
+}
+
+static int video_buffer_free(struct device *dev, struct buffer *buffer)
+{
+	unsigned int i;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		free(buffer->staging[i]);
+		buffer->staging[i] = NULL;
+	}
+
+	switch (dev->memtype) {
+	case V4L2_MEMORY_MMAP:
+		if (buffer->vcsm_handle)
+		{
+			print("Releasing vcsm handle %u\n", buffer->vcsm_handle);
+			vcsm_free(buffer->vcsm_handle);
+			buffer->vcsm_handle = 0;
+		}
+		if (buffer->dma_fd)
+		{
+			print("Closing dma_buf %d\n", buffer->dma_fd);
+			close(buffer->dma_fd);
+			buffer->dma_fd = 0;
+		}
+		for (i = 0; i < dev->num_planes; i++) {
+			if (buffer->dmabuf[i] != -1)
+				close(buffer->dmabuf[i]);
+			buffer->dmabuf[i] = -1;
+		}
+		return video_buffer_munmap(dev, buffer);
+	case V4L2_MEMORY_USERPTR:
+		video_buffer_free_userptr(dev, buffer);
+		break;
+	case V4L2_MEMORY_DMABUF:
+		if (buffer->vcsm_handle)
+		{
+			print("Releasing vcsm handle %u\n", buffer->vcsm_handle);
+			vcsm_free(buffer->vcsm_handle);
+			buffer->vcsm_handle = 0;
+		}
+		video_buffer_free_dmabuf(dev, buffer);
+		buffer->dma_fd = 0;
+		break;
+	default:
+		break;
+	}
+
 	return 0;
 }
 
@@ -1128,28 +2165,9 @@ static int video_free_buffers(struct device *dev)
 		return 0;
 
 	for (i = 0; i < dev->nbufs; ++i) {
-		switch (dev->memtype) {
-		case V4L2_MEMORY_MMAP:
-			if (dev->buffers[i].vcsm_handle)
-			{
-				print("Releasing vcsm handle %u\n", dev->buffers[i].vcsm_handle);
-				vcsm_free(dev->buffers[i].vcsm_handle);
-			}
-			if (dev->buffers[i].dma_fd)
-			{
-				print("Closing dma_buf %d\n", dev->buffers[i].dma_fd);
-				close(dev->buffers[i].dma_fd);
-			}
-			ret = video_buffer_munmap(dev, &dev->buffers[i]);
-			if (ret < 0)
-				return ret;
-			break;
-		case V4L2_MEMORY_USERPTR:
-			video_buffer_free_userptr(dev, &dev->buffers[i]);
-			break;
-		default:
-			break;
-		}
+		ret = video_buffer_free(dev, &dev->buffers[i]);
+		if (ret < 0)
+			return ret;
 	}
 
 	memset(&rb, 0, sizeof rb);
@@ -1166,1462 +2184,6605 @@ static int video_free_buffers(struct device *dev)
 
 	print("%u buffers released.\n", dev->nbufs);
 
+	userptr_pool_destroy(&dev->pool);
+
 	free(dev->buffers);
 	dev->nbufs = 0;
+	dev->max_bufs = 0;
 	dev->buffers = NULL;
 
 	return 0;
 }
 
-static int video_queue_buffer(struct device *dev, int index, enum buffer_fill_mode fill)
+static const char * const buffer_state_names[BUFFER_STATE_COUNT] = {
+	[BUFFER_STATE_FREE] = "free",
+	[BUFFER_STATE_QUEUED] = "queued",
+	[BUFFER_STATE_DEQUEUED] = "dequeued",
+	[BUFFER_STATE_PIPELINE] = "pipeline",
+	[BUFFER_STATE_WRITING] = "writing",
+};
+
+/*
+ * Move a buffer to state to if it's in one of the from states. This can be
+ * called from any thread. Invalid transitions, caused by a buffer being queued
+ * twice or released by a stage that doesn't own it, are counted and reported.
+ */
+static bool video_buffer_transition(struct device *dev, struct buffer *buffer,
+				    unsigned int from, enum buffer_state to)
+{
+	unsigned int state = atomic_load_explicit(&buffer->state, memory_order_relaxed);
+
+	do {
+		if (!(from & (1U << state))) {
+			atomic_fetch_add_explicit(&dev->buffer_errors, 1,
+						  memory_order_relaxed);
+			fprintf(stderr, "Buffer %u: invalid transition from %s to %s\n",
+				buffer->idx, buffer_state_names[state],
+				buffer_state_names[to]);
+			return false;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&buffer->state, &state, to,
+							memory_order_acq_rel,
+							memory_order_relaxed));
+
+	return true;
+}
+
+/* Count the buffers in each state. */
+static void video_buffer_states(struct device *dev,
+				unsigned int counts[BUFFER_STATE_COUNT])
 {
-	struct v4l2_buffer buf;
-	struct v4l2_plane planes[VIDEO_MAX_PLANES];
-	int ret;
 	unsigned int i;
 
-	memset(&buf, 0, sizeof buf);
-	memset(&planes, 0, sizeof planes);
+	memset(counts, 0, BUFFER_STATE_COUNT * sizeof counts[0]);
 
-	buf.index = index;
-	buf.type = dev->type;
-	buf.memory = dev->memtype;
+	for (i = 0; i < dev->nbufs; i++)
+		counts[atomic_load_explicit(&dev->buffers[i].state,
+					    memory_order_relaxed)]++;
+}
 
-	if (video_is_output(dev)) {
-		buf.flags = dev->buffer_output_flags;
-		if (dev->timestamp_type == V4L2_BUF_FLAG_TIMESTAMP_COPY) {
-			struct timespec ts;
+/* Return the buffers that were queued to the driver to FREE after STREAMOFF. */
+static void video_buffers_reclaim(struct device *dev)
+{
+	unsigned int i;
 
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			buf.timestamp.tv_sec = ts.tv_sec;
-			buf.timestamp.tv_usec = ts.tv_nsec / 1000;
-		}
-	}
+	for (i = 0; i < dev->nbufs; i++) {
+		unsigned int state = BUFFER_STATE_QUEUED;
 
-	if (video_is_mplane(dev)) {
-		buf.m.planes = planes;
-		buf.length = dev->num_planes;
+		atomic_compare_exchange_strong(&dev->buffers[i].state, &state,
+					       BUFFER_STATE_FREE);
 	}
+}
 
-	if (dev->memtype == V4L2_MEMORY_USERPTR) {
-		if (video_is_mplane(dev)) {
-			for (i = 0; i < dev->num_planes; i++) {
-				buf.m.planes[i].m.userptr = (unsigned long)
-					dev->buffers[index].mem[i];
-				buf.m.planes[i].length =
-					dev->buffers[index].size[i];
-			}
-		} else {
-			buf.m.userptr = (unsigned long)dev->buffers[index].mem[0];
-			buf.length = dev->buffers[index].size[0];
-		}
-	}
+/*
+ * Check that all buffers are back to FREE once streaming has stopped, and
+ * report the buffers leaked by a processing stage and the invalid transitions.
+ * Return the number of problems found.
+ */
+static unsigned int video_buffer_audit(struct device *dev)
+{
+	unsigned int errors = atomic_load(&dev->buffer_errors);
+	unsigned int leaked = 0;
+	unsigned int i;
 
-	for (i = 0; i < dev->num_planes; i++) {
-		if (video_is_output(dev)) {
-			if (video_is_mplane(dev))
-				buf.m.planes[i].bytesused = dev->patternsize[i];
-			else
-				buf.bytesused = dev->patternsize[i];
+	for (i = 0; i < dev->nbufs; i++) {
+		unsigned int state = atomic_load(&dev->buffers[i].state);
 
-			memcpy(dev->buffers[buf.index].mem[i], dev->pattern[i],
-			       dev->patternsize[i]);
-		} else {
-			if (fill & BUFFER_FILL_FRAME)
-				memset(dev->buffers[buf.index].mem[i], 0x55,
-				       dev->buffers[index].size[i]);
-			if (fill & BUFFER_FILL_PADDING)
-				memset(dev->buffers[buf.index].mem[i] +
-					dev->buffers[index].size[i],
-				       0x55, dev->buffers[index].padding[i]);
-		}
+		if (state == BUFFER_STATE_FREE)
+			continue;
+
+		print("Buffer audit: buffer %u leaked in state %s (%u references)\n",
+			i, buffer_state_names[state],
+			atomic_load(&dev->buffers[i].refs));
+		leaked++;
 	}
 
-	ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
-	if (ret < 0)
-		print("Unable to queue buffer: %s (%d).\n",
-			strerror(errno), errno);
+	print("Buffer audit: %u buffers, %u leaked, %u invalid transitions\n",
+		dev->nbufs, leaked, errors);
 
-	return ret;
+	return leaked + errors;
 }
 
-static int video_enable(struct device *dev, int enable)
+/*
+ * Return true if CPU access to all planes of the buffer can be bracketed with
+ * DMA_BUF_IOCTL_SYNC, in which case the cache maintenance at QBUF and DQBUF
+ * time is skipped altogether.
+ */
+static bool video_buffer_can_sync(struct device *dev, struct buffer *buffer)
 {
-	int type = dev->type;
-	int ret;
+#ifdef HAVE_DMA_BUF_SYNC
+	unsigned int i;
 
-	ret = ioctl(dev->fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
-	if (ret < 0) {
-		print("Unable to %s streaming: %s (%d).\n",
-			enable ? "start" : "stop", strerror(errno), errno);
-		return ret;
+	if (!dev->cache_hints)
+		return false;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (buffer->dmabuf[i] == -1)
+			return false;
 	}
 
-	return 0;
+	return true;
+#else
+	(void)dev;
+	(void)buffer;
+
+	return false;
+#endif
 }
 
-static void video_query_menu(struct device *dev, struct v4l2_queryctrl *query,
-			     unsigned int value)
+/*
+ * Bracket CPU access to the payload with DMA_BUF_IOCTL_SYNC when the cache
+ * hints skip the cache maintenance at QBUF and DQBUF time. flags are the
+ * DMA_BUF_SYNC_* flags without the access direction, which is derived from the
+ * CPU accesses of the current configuration.
+ */
+static void video_buffer_sync(struct device *dev, struct buffer *buffer,
+			      uint64_t flags)
 {
-	struct v4l2_querymenu menu;
-	int ret;
+#ifdef HAVE_DMA_BUF_SYNC
+	struct dma_buf_sync sync;
+	uint64_t start;
+	unsigned int i;
 
-	for (menu.index = query->minimum;
-	     menu.index <= (unsigned)query->maximum; menu.index++) {
-		menu.id = query->id;
-		ret = ioctl(dev->fd, VIDIOC_QUERYMENU, &menu);
-		if (ret < 0)
+	if (!dev->cache_hints)
+		return;
+
+	sync.flags = flags | (dev->cpu_reads ? DMA_BUF_SYNC_READ : 0)
+		   | (dev->cpu_writes ? DMA_BUF_SYNC_WRITE : 0);
+
+	for (i = 0; i < dev->num_planes; i++) {
+		if (buffer->dmabuf[i] == -1)
 			continue;
 
-		if (query->type == V4L2_CTRL_TYPE_MENU)
-			print("  %u: %.32s%s\n", menu.index, menu.name,
-			       menu.index == value ? " (*)" : "");
-		else
-			print("  %u: %lld%s\n", menu.index, menu.value,
-			       menu.index == value ? " (*)" : "");
-	};
+		start = clock_ns(CLOCK_MONOTONIC);
+		ioctl(buffer->dmabuf[i], DMA_BUF_IOCTL_SYNC, &sync);
+		ioctl_time_record(&dev->sync_time, start);
+	}
+#else
+	(void)dev;
+	(void)buffer;
+	(void)flags;
+#endif
 }
 
-static int video_print_control(struct device *dev, unsigned int id, bool full)
+/*
+ * Store to memory the CPU won't read back. Non-temporal stores write full
+ * lines to memory without reading them into the cache first, and leave the
+ * cache to the rest of the pipeline.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void stream_store_sse2(void *dst, const void *src, size_t size)
 {
-	struct v4l2_ext_control ctrl;
-	struct v4l2_queryctrl query;
-	char sval[24];
-	char *current = sval;
-	int ret;
-
-	ret = query_control(dev, id, &query);
-	if (ret < 0)
-		return ret;
+	const __m128i *s = src;
+	__m128i *d = dst;
+	size_t n;
+
+	for (n = size / 64; n; n--) {
+		__m128i v0 = _mm_loadu_si128(s);
+		__m128i v1 = _mm_loadu_si128(s + 1);
+		__m128i v2 = _mm_loadu_si128(s + 2);
+		__m128i v3 = _mm_loadu_si128(s + 3);
+
+		_mm_stream_si128(d, v0);
+		_mm_stream_si128(d + 1, v1);
+		_mm_stream_si128(d + 2, v2);
+		_mm_stream_si128(d + 3, v3);
+		s += 4;
+		d += 4;
+	}
 
-	if (query.flags & V4L2_CTRL_FLAG_DISABLED)
-		return query.id;
+	_mm_sfence();
+	memcpy(d, s, size % 64);
+}
+#endif
 
-	if (query.type == V4L2_CTRL_TYPE_CTRL_CLASS) {
-		print("--- %s (class 0x%08x) ---\n", query.name, query.id);
-		return query.id;
+static void stream_store(void *dst, const void *src, size_t size)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (!((uintptr_t)dst & 15)) {
+		stream_store_sse2(dst, src, size);
+		return;
 	}
+#endif
+	memcpy(dst, src, size);
+}
 
-	ret = get_control(dev, &query, &ctrl);
-	if (ret < 0)
-		strcpy(sval, "n/a");
-	else if (query.type == V4L2_CTRL_TYPE_INTEGER64)
-		sprintf(sval, "%lld", ctrl.value64);
-	else if (query.type == V4L2_CTRL_TYPE_STRING)
-		current = ctrl.string;
-	else
-		sprintf(sval, "%d", ctrl.value);
+enum pattern_class {
+	PATTERN_YUV_PACKED,		/* order: Y0, U, Y1 and V byte offsets */
+	PATTERN_YUV_SEMI_PLANAR,	/* order[0]: U byte offset in the CbCr pair */
+	PATTERN_YUV_PLANAR,		/* order[0]: 1 if the V plane comes first */
+	PATTERN_GREY,
+	PATTERN_BAYER,			/* order: R (0), G (1) or B (2) per 2x2 site */
+	PATTERN_RGB,			/* order: R, G, B and alpha byte offsets */
+	PATTERN_RGB_BITS,		/* order: R, G, B and alpha field widths */
+};
 
-	if (full)
-		print("control 0x%08x `%s' min %d max %d step %d default %d current %s.\n",
-			query.id, query.name, query.minimum, query.maximum,
-			query.step, query.default_value, current);
-	else
-		print("control 0x%08x current %s.\n", query.id, current);
+struct pattern_format
+{
+	unsigned int fourcc;
+	enum pattern_class cls;
+	unsigned char bpp;		/* Bits per pixel of the first plane */
+	unsigned char depth;		/* Grey and Bayer sample depth */
+	bool packed;			/* MIPI CSI-2 packed samples */
+	bool big_endian;
+	unsigned char hsub, vsub;	/* Chroma subsampling */
+	unsigned char order[4];
+};
 
-	if (query.type == V4L2_CTRL_TYPE_STRING)
-		free(ctrl.string);
+static const struct pattern_format pattern_formats[] = {
+	{ V4L2_PIX_FMT_RGB332, PATTERN_RGB_BITS, 8, 0, false, false, 1, 1, { 3, 3, 2, 0 } },
+	{ V4L2_PIX_FMT_RGB444, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 4, 4, 4, 4 } },
+	{ V4L2_PIX_FMT_ARGB444, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 4, 4, 4, 4 } },
+	{ V4L2_PIX_FMT_XRGB444, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 4, 4, 4, 4 } },
+	{ V4L2_PIX_FMT_RGB555, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 5, 5, 5, 1 } },
+	{ V4L2_PIX_FMT_ARGB555, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 5, 5, 5, 1 } },
+	{ V4L2_PIX_FMT_XRGB555, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 5, 5, 5, 1 } },
+	{ V4L2_PIX_FMT_RGB565, PATTERN_RGB_BITS, 16, 0, false, false, 1, 1, { 5, 6, 5, 0 } },
+	{ V4L2_PIX_FMT_RGB555X, PATTERN_RGB_BITS, 16, 0, false, true, 1, 1, { 5, 5, 5, 1 } },
+	{ V4L2_PIX_FMT_RGB565X, PATTERN_RGB_BITS, 16, 0, false, true, 1, 1, { 5, 6, 5, 0 } },
+	{ V4L2_PIX_FMT_BGR24, PATTERN_RGB, 24, 0, false, false, 1, 1, { 2, 1, 0, 0 } },
+	{ V4L2_PIX_FMT_RGB24, PATTERN_RGB, 24, 0, false, false, 1, 1, { 0, 1, 2, 0 } },
+	{ V4L2_PIX_FMT_BGR32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 2, 1, 0, 3 } },
+	{ V4L2_PIX_FMT_ABGR32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 2, 1, 0, 3 } },
+	{ V4L2_PIX_FMT_XBGR32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 2, 1, 0, 3 } },
+	{ V4L2_PIX_FMT_RGB32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 1, 2, 3, 0 } },
+	{ V4L2_PIX_FMT_ARGB32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 1, 2, 3, 0 } },
+	{ V4L2_PIX_FMT_XRGB32, PATTERN_RGB, 32, 0, false, false, 1, 1, { 1, 2, 3, 0 } },
+	{ V4L2_PIX_FMT_GREY, PATTERN_GREY, 8, 8, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y10, PATTERN_GREY, 16, 10, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y12, PATTERN_GREY, 16, 12, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y16, PATTERN_GREY, 16, 16, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y10P, PATTERN_GREY, 10, 10, true, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y12P, PATTERN_GREY, 12, 12, true, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_Y14P, PATTERN_GREY, 14, 14, true, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_UYVY, PATTERN_YUV_PACKED, 16, 0, false, false, 2, 1, { 1, 0, 3, 2 } },
+	{ V4L2_PIX_FMT_VYUY, PATTERN_YUV_PACKED, 16, 0, false, false, 2, 1, { 1, 2, 3, 0 } },
+	{ V4L2_PIX_FMT_YUYV, PATTERN_YUV_PACKED, 16, 0, false, false, 2, 1, { 0, 1, 2, 3 } },
+	{ V4L2_PIX_FMT_YVYU, PATTERN_YUV_PACKED, 16, 0, false, false, 2, 1, { 0, 3, 2, 1 } },
+	{ V4L2_PIX_FMT_NV12, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 2, { 0 } },
+	{ V4L2_PIX_FMT_NV12M, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 2, { 0 } },
+	{ V4L2_PIX_FMT_NV21, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 2, { 1 } },
+	{ V4L2_PIX_FMT_NV21M, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 2, { 1 } },
+	{ V4L2_PIX_FMT_NV16, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 1, { 0 } },
+	{ V4L2_PIX_FMT_NV16M, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 1, { 0 } },
+	{ V4L2_PIX_FMT_NV61, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 1, { 1 } },
+	{ V4L2_PIX_FMT_NV61M, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 2, 1, { 1 } },
+	{ V4L2_PIX_FMT_NV24, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_NV42, PATTERN_YUV_SEMI_PLANAR, 8, 0, false, false, 1, 1, { 1 } },
+	{ V4L2_PIX_FMT_YUV420M, PATTERN_YUV_PLANAR, 8, 0, false, false, 2, 2, { 0 } },
+	{ V4L2_PIX_FMT_YUV422M, PATTERN_YUV_PLANAR, 8, 0, false, false, 2, 1, { 0 } },
+	{ V4L2_PIX_FMT_YUV444M, PATTERN_YUV_PLANAR, 8, 0, false, false, 1, 1, { 0 } },
+	{ V4L2_PIX_FMT_YVU420M, PATTERN_YUV_PLANAR, 8, 0, false, false, 2, 2, { 1 } },
+	{ V4L2_PIX_FMT_YVU422M, PATTERN_YUV_PLANAR, 8, 0, false, false, 2, 1, { 1 } },
+	{ V4L2_PIX_FMT_YVU444M, PATTERN_YUV_PLANAR, 8, 0, false, false, 1, 1, { 1 } },
+	{ V4L2_PIX_FMT_SBGGR8, PATTERN_BAYER, 8, 8, false, false, 1, 1, { 2, 1, 1, 0 } },
+	{ V4L2_PIX_FMT_SGBRG8, PATTERN_BAYER, 8, 8, false, false, 1, 1, { 1, 2, 0, 1 } },
+	{ V4L2_PIX_FMT_SGRBG8, PATTERN_BAYER, 8, 8, false, false, 1, 1, { 1, 0, 2, 1 } },
+	{ V4L2_PIX_FMT_SRGGB8, PATTERN_BAYER, 8, 8, false, false, 1, 1, { 0, 1, 1, 2 } },
+	{ V4L2_PIX_FMT_SBGGR10, PATTERN_BAYER, 16, 10, false, false, 1, 1, { 2, 1, 1, 0 } },
+	{ V4L2_PIX_FMT_SGBRG10, PATTERN_BAYER, 16, 10, false, false, 1, 1, { 1, 2, 0, 1 } },
+	{ V4L2_PIX_FMT_SGRBG10, PATTERN_BAYER, 16, 10, false, false, 1, 1, { 1, 0, 2, 1 } },
+	{ V4L2_PIX_FMT_SRGGB10, PATTERN_BAYER, 16, 10, false, false, 1, 1, { 0, 1, 1, 2 } },
+	{ V4L2_PIX_FMT_SBGGR10P, PATTERN_BAYER, 10, 10, true, false, 1, 1, { 2, 1, 1, 0 } },
+	{ V4L2_PIX_FMT_SGBRG10P, PATTERN_BAYER, 10, 10, true, false, 1, 1, { 1, 2, 0, 1 } },
+	{ V4L2_PIX_FMT_SGRBG10P, PATTERN_BAYER, 10, 10, true, false, 1, 1, { 1, 0, 2, 1 } },
+	{ V4L2_PIX_FMT_SRGGB10P, PATTERN_BAYER, 10, 10, true, false, 1, 1, { 0, 1, 1, 2 } },
+	{ V4L2_PIX_FMT_SBGGR12, PATTERN_BAYER, 16, 12, false, false, 1, 1, { 2, 1, 1, 0 } },
+	{ V4L2_PIX_FMT_SGBRG12, PATTERN_BAYER, 16, 12, false, false, 1, 1, { 1, 2, 0, 1 } },
+	{ V4L2_PIX_FMT_SGRBG12, PATTERN_BAYER, 16, 12, false, false, 1, 1, { 1, 0, 2, 1 } },
+	{ V4L2_PIX_FMT_SRGGB12, PATTERN_BAYER, 16, 12, false, false, 1, 1, { 0, 1, 1, 2 } },
+	{ V4L2_PIX_FMT_SBGGR12P, PATTERN_BAYER, 12, 12, true, false, 1, 1, { 2, 1, 1, 0 } },
+	{ V4L2_PIX_FMT_SGBRG12P, PATTERN_BAYER, 12, 12, true, false, 1, 1, { 1, 2, 0, 1 } },
+	{ V4L2_PIX_FMT_SGRBG12P, PATTERN_BAYER, 12, 12, true, false, 1, 1, { 1, 0, 2, 1 } },
+	{ V4L2_PIX_FMT_SRGGB12P, PATTERN_BAYER, 12, 12, true, false, 1, 1, { 0, 1, 1, 2 } },
+};
 
-	if (!full)
-		return query.id;
+/* 75% colour bars */
+static const uint8_t pattern_bars[8][3] = {
+	{ 191, 191, 191 }, { 191, 191, 0 }, { 0, 191, 191 }, { 0, 191, 0 },
+	{ 191, 0, 191 }, { 191, 0, 0 }, { 0, 0, 191 }, { 0, 0, 0 },
+};
 
-	if (query.type == V4L2_CTRL_TYPE_MENU ||
-	    query.type == V4L2_CTRL_TYPE_INTEGER_MENU)
-		video_query_menu(dev, &query, ctrl.value);
+/*
+ * The frame code is a 32x4 grid of black and white blocks in the top left
+ * corner, one 32-bit word per row, MSB first.
+ */
+#define PATTERN_CODE_MAGIC	0x59415654	/* "YAVT" */
+#define PATTERN_CODE_BITS	32
+#define PATTERN_CODE_WORDS	4
 
-	return query.id;
-}
+/* Horizontal gradient speed in pixels per frame */
+#define PATTERN_GRADIENT_SPEED	8
 
-static void video_list_controls(struct device *dev)
+/* BT.601 limited range conversion. */
+static void pattern_pixel_set(struct pattern_pixel *px, uint8_t r, uint8_t g,
+			      uint8_t b)
 {
-	unsigned int nctrls = 0;
-	unsigned int id;
-	int ret;
-
-#ifndef V4L2_CTRL_FLAG_NEXT_CTRL
-	unsigned int i;
+	px->rgb[0] = r;
+	px->rgb[1] = g;
+	px->rgb[2] = b;
+	px->y = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+	px->u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+	px->v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
 
-	for (i = V4L2_CID_BASE; i <= V4L2_CID_LASTP1; ++i) {
-		id = i;
-#else
-	id = 0;
-	while (1) {
-		id |= V4L2_CTRL_FLAG_NEXT_CTRL;
-#endif
+/* CSI-2 packing groups 4 samples in 5 or 7 bytes, or 2 samples in 3 bytes. */
+static unsigned int pattern_packing_group(const struct pattern_format *format)
+{
+	return format->depth == 12 ? 2 : 4;
+}
 
-		ret = video_print_control(dev, id, true);
-		if (ret < 0)
-			break;
+/*
+ * Store an 8-bit grey or Bayer sample at its format depth. CSI-2 packing
+ * stores the 8 MSBs of each sample first and the LSBs, all zero here, after
+ * each group.
+ */
+static void pattern_put_sample(const struct pattern_format *format,
+			       uint8_t *line, unsigned int x, uint8_t value)
+{
+	unsigned int group;
+	unsigned int size;
+	uint16_t sample;
+	uint8_t *p;
+
+	if (format->packed) {
+		group = pattern_packing_group(format);
+		size = group * format->depth / 8;
+		p = line + x / group * size;
+		p[x % group] = value;
+		if (x % group == group - 1)
+			memset(p + group, 0, size - group);
+		return;
+	}
 
-		id = ret;
-		nctrls++;
+	if (format->depth == 8) {
+		line[x] = value;
+		return;
 	}
 
-	if (nctrls)
-		print("%u control%s found.\n", nctrls, nctrls > 1 ? "s" : "");
-	else
-		print("No control found.\n");
+	sample = value << (format->depth - 8);
+	line[x * 2] = sample & 0xff;
+	line[x * 2 + 1] = sample >> 8;
 }
 
-static void video_enum_frame_intervals(struct device *dev, __u32 pixelformat,
-	unsigned int width, unsigned int height)
+/* Pack the canonical row to one line of a pattern plane. */
+static void test_pattern_pack(const struct test_pattern *tp, unsigned int plane,
+			      unsigned int line, uint8_t *dst)
 {
-	struct v4l2_frmivalenum ival;
-	unsigned int i;
-	int ret;
+	const struct pattern_format *format = tp->format;
+	const unsigned char *order = format->order;
+	const struct pattern_pixel *px = tp->row;
+	unsigned int width = tp->width;
+	unsigned int value;
+	unsigned int x;
+
+	switch (format->cls) {
+	case PATTERN_YUV_PACKED:
+		for (x = 0; x < width; x += 2, dst += 4) {
+			dst[order[0]] = px[x].y;
+			dst[order[1]] = px[x].u;
+			dst[order[2]] = px[x + 1].y;
+			dst[order[3]] = px[x].v;
+		}
+		break;
 
-	for (i = 0; ; ++i) {
-		memset(&ival, 0, sizeof ival);
-		ival.index = i;
-		ival.pixel_format = pixelformat;
-		ival.width = width;
-		ival.height = height;
-		ret = ioctl(dev->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival);
-		if (ret < 0)
+	case PATTERN_YUV_SEMI_PLANAR:
+		if (plane == 0) {
+			for (x = 0; x < width; x++)
+				dst[x] = px[x].y;
 			break;
+		}
 
-		if (i != ival.index)
-			print("Warning: driver returned wrong ival index "
-				"%u.\n", ival.index);
-		if (pixelformat != ival.pixel_format)
-			print("Warning: driver returned wrong ival pixel "
-				"format %08x.\n", ival.pixel_format);
-		if (width != ival.width)
-			print("Warning: driver returned wrong ival width "
-				"%u.\n", ival.width);
-		if (height != ival.height)
-			print("Warning: driver returned wrong ival height "
-				"%u.\n", ival.height);
-
-		if (i != 0)
-			print(", ");
+		for (x = 0; x < width; x += format->hsub, dst += 2) {
+			dst[order[0]] = px[x].u;
+			dst[!order[0]] = px[x].v;
+		}
+		break;
 
-		switch (ival.type) {
-		case V4L2_FRMIVAL_TYPE_DISCRETE:
-			print("%u/%u",
-				ival.discrete.numerator,
-				ival.discrete.denominator);
+	case PATTERN_YUV_PLANAR:
+		if (plane == 0) {
+			for (x = 0; x < width; x++)
+				dst[x] = px[x].y;
 			break;
+		}
 
-		case V4L2_FRMIVAL_TYPE_CONTINUOUS:
-			print("%u/%u - %u/%u",
-				ival.stepwise.min.numerator,
-				ival.stepwise.min.denominator,
-				ival.stepwise.max.numerator,
-				ival.stepwise.max.denominator);
-			return;
+		for (x = 0; x < width; x += format->hsub)
+			*dst++ = (plane == 1) != order[0] ? px[x].u : px[x].v;
+		break;
 
-		case V4L2_FRMIVAL_TYPE_STEPWISE:
-			print("%u/%u - %u/%u (by %u/%u)",
-				ival.stepwise.min.numerator,
-				ival.stepwise.min.denominator,
-				ival.stepwise.max.numerator,
-				ival.stepwise.max.denominator,
-				ival.stepwise.step.numerator,
-				ival.stepwise.step.denominator);
-			return;
-
-		default:
-			break;
-		}
-	}
-}
-
-static void video_enum_frame_sizes(struct device *dev, __u32 pixelformat)
-{
-	struct v4l2_frmsizeenum frame;
-	unsigned int i;
-	int ret;
-
-	for (i = 0; ; ++i) {
-		memset(&frame, 0, sizeof frame);
-		frame.index = i;
-		frame.pixel_format = pixelformat;
-		ret = ioctl(dev->fd, VIDIOC_ENUM_FRAMESIZES, &frame);
-		if (ret < 0)
-			break;
-
-		if (i != frame.index)
-			print("Warning: driver returned wrong frame index "
-				"%u.\n", frame.index);
-		if (pixelformat != frame.pixel_format)
-			print("Warning: driver returned wrong frame pixel "
-				"format %08x.\n", frame.pixel_format);
+	case PATTERN_GREY:
+		for (x = 0; x < width; x++)
+			pattern_put_sample(format, dst, x, px[x].y);
+		break;
 
-		switch (frame.type) {
-		case V4L2_FRMSIZE_TYPE_DISCRETE:
-			print("\tFrame size: %ux%u (", frame.discrete.width,
-				frame.discrete.height);
-			video_enum_frame_intervals(dev, frame.pixel_format,
-				frame.discrete.width, frame.discrete.height);
-			print(")\n");
-			break;
+	case PATTERN_BAYER:
+		order += (line & 1) * 2;
+		for (x = 0; x < width; x++)
+			pattern_put_sample(format, dst, x, px[x].rgb[order[x & 1]]);
+		break;
 
-		case V4L2_FRMSIZE_TYPE_CONTINUOUS:
-			print("\tFrame size: %ux%u - %ux%u (",
-				frame.stepwise.min_width,
-				frame.stepwise.min_height,
-				frame.stepwise.max_width,
-				frame.stepwise.max_height);
-			video_enum_frame_intervals(dev, frame.pixel_format,
-				frame.stepwise.max_width,
-				frame.stepwise.max_height);
-			print(")\n");
-			break;
+	case PATTERN_RGB:
+		for (x = 0; x < width; x++, dst += format->bpp / 8) {
+			dst[order[0]] = px[x].rgb[0];
+			dst[order[1]] = px[x].rgb[1];
+			dst[order[2]] = px[x].rgb[2];
+			if (format->bpp == 32)
+				dst[order[3]] = 0xff;
+		}
+		break;
 
-		case V4L2_FRMSIZE_TYPE_STEPWISE:
-			print("\tFrame size: %ux%u - %ux%u (by %ux%u) (\n",
-				frame.stepwise.min_width,
-				frame.stepwise.min_height,
-				frame.stepwise.max_width,
-				frame.stepwise.max_height,
-				frame.stepwise.step_width,
-				frame.stepwise.step_height);
-			video_enum_frame_intervals(dev, frame.pixel_format,
-				frame.stepwise.max_width,
-				frame.stepwise.max_height);
-			print(")\n");
-			break;
+	case PATTERN_RGB_BITS:
+		for (x = 0; x < width; x++) {
+			value = (0xff >> (8 - order[3])) << (order[0] + order[1] + order[2])
+			      | (px[x].rgb[0] >> (8 - order[0])) << (order[1] + order[2])
+			      | (px[x].rgb[1] >> (8 - order[1])) << order[2]
+			      | px[x].rgb[2] >> (8 - order[2]);
 
-		default:
-			break;
+			if (format->bpp == 8) {
+				*dst++ = value;
+			} else {
+				dst[format->big_endian] = value & 0xff;
+				dst[!format->big_endian] = value >> 8;
+				dst += 2;
+			}
 		}
+		break;
 	}
 }
 
-static void video_enum_formats(struct device *dev, enum v4l2_buf_type type)
+/*
+ * Pack the canonical row and store it to the frame lines [first, last),
+ * limited to the first pixels of each line.
+ */
+static void test_pattern_store(struct test_pattern *tp, struct buffer *buffer,
+			       unsigned int first, unsigned int last,
+			       unsigned int pixels)
 {
-	struct v4l2_fmtdesc fmt;
+	bool bayer = tp->format->cls == PATTERN_BAYER;
 	unsigned int i;
-	int ret;
+	unsigned int y;
 
-	for (i = 0; ; ++i) {
-		memset(&fmt, 0, sizeof fmt);
-		fmt.index = i;
-		fmt.type = type;
-		ret = ioctl(dev->fd, VIDIOC_ENUM_FMT, &fmt);
-		if (ret < 0)
-			break;
+	for (i = 0; i < tp->num_planes; i++) {
+		const struct pattern_plane *plane = &tp->planes[i];
+		uint8_t *base = buffer->mem[plane->index] + plane->offset;
+		size_t size = (size_t)plane->bytes * pixels / tp->width;
 
-		if (i != fmt.index)
-			print("Warning: driver returned wrong format index "
-				"%u.\n", fmt.index);
-		if (type != fmt.type)
-			print("Warning: driver returned wrong format type "
-				"%u.\n", fmt.type);
+		test_pattern_pack(tp, i, 0, tp->line);
+		if (bayer)
+			test_pattern_pack(tp, i, 1, tp->line + plane->bytes);
 
-		print("\tFormat %u: %s (%08x)\n", i,
-			v4l2_format_name(fmt.pixelformat), fmt.pixelformat);
-		print("\tType: %s (%u)\n", v4l2_buf_type_name(fmt.type),
-			fmt.type);
-		print("\tName: %.32s\n", fmt.description);
-		video_enum_frame_sizes(dev, fmt.pixelformat);
-		print("\n");
+		for (y = first / plane->vsub; y < last / plane->vsub; y++)
+			stream_store(base + (size_t)y * plane->stride,
+				     tp->line + (bayer && (y & 1) ? plane->bytes : 0),
+				     size);
 	}
 }
 
-static void video_enum_inputs(struct device *dev)
+/*
+ * Render a frame: colour bars, a gradient scrolling horizontally across the
+ * bottom quarter and the frame code. Every line of a region is identical, a
+ * single line is packed per region and replicated. The bars don't change
+ * between frames and are only stored when the buffer doesn't hold them yet.
+ */
+static void test_pattern_render(struct test_pattern *tp, struct buffer *buffer,
+				bool full, uint64_t timestamp)
 {
-	struct v4l2_input input;
+	uint32_t code[PATTERN_CODE_WORDS] = {
+		PATTERN_CODE_MAGIC, tp->sequence, timestamp >> 32, timestamp,
+	};
+	unsigned int width = tp->width;
+	unsigned int shift;
 	unsigned int i;
-	int ret;
-
-	for (i = 0; ; ++i) {
-		memset(&input, 0, sizeof input);
-		input.index = i;
-		ret = ioctl(dev->fd, VIDIOC_ENUMINPUT, &input);
-		if (ret < 0)
-			break;
+	unsigned int x;
 
-		if (i != input.index)
-			print("Warning: driver returned wrong input index "
-				"%u.\n", input.index);
+	if (full) {
+		for (x = 0; x < width; x++) {
+			const uint8_t *bar = pattern_bars[x * 8 / width];
 
-		print("\tInput %u: %s.\n", i, input.name);
+			pattern_pixel_set(&tp->row[x], bar[0], bar[1], bar[2]);
+		}
+		test_pattern_store(tp, buffer, 0, tp->band, width);
 	}
 
-	print("\n");
-}
+	for (i = 0; i < PATTERN_CODE_WORDS; i++) {
+		for (x = 0; x < PATTERN_CODE_BITS * tp->block; x++) {
+			uint8_t v = code[i] & (1U << (31 - x / tp->block)) ? 255 : 0;
 
-static int video_get_input(struct device *dev)
-{
-	__u32 input;
-	int ret;
+			pattern_pixel_set(&tp->row[x], v, v, v);
+		}
+		test_pattern_store(tp, buffer, i * tp->block, (i + 1) * tp->block,
+				   PATTERN_CODE_BITS * tp->block);
+	}
 
-	ret = ioctl(dev->fd, VIDIOC_G_INPUT, &input);
-	if (ret < 0) {
-		print("Unable to get current input: %s (%d).\n",
-			strerror(errno), errno);
-		return ret;
+	shift = tp->sequence * PATTERN_GRADIENT_SPEED % width;
+	for (x = 0; x < width; x++) {
+		uint8_t v = (x + shift) % width * 256 / width;
+
+		pattern_pixel_set(&tp->row[x], v, v, 255 - v);
 	}
+	test_pattern_store(tp, buffer, tp->band, tp->height, width);
 
-	return input;
+	tp->sequence++;
 }
 
-static int video_set_input(struct device *dev, unsigned int input)
+/* Return the 8 MSBs of the luma, grey or green sample of a pixel. */
+static uint8_t test_pattern_sample(const struct test_pattern *tp,
+				   const struct buffer *buffer, unsigned int x,
+				   unsigned int y)
 {
-	__u32 _input = input;
-	int ret;
-
-	ret = ioctl(dev->fd, VIDIOC_S_INPUT, &_input);
-	if (ret < 0)
-		print("Unable to select input %u: %s (%d).\n", input,
-			strerror(errno), errno);
+	const struct pattern_format *format = tp->format;
+	const struct pattern_plane *plane = &tp->planes[0];
+	const uint8_t *line = (const uint8_t *)buffer->mem[plane->index]
+			    + plane->offset + (size_t)y * plane->stride;
+	unsigned int group;
+	unsigned int value;
+
+	switch (format->cls) {
+	case PATTERN_YUV_PACKED:
+		return line[x / 2 * 4 + format->order[x & 1 ? 2 : 0]];
+
+	case PATTERN_YUV_SEMI_PLANAR:
+	case PATTERN_YUV_PLANAR:
+		return line[x];
+
+	case PATTERN_GREY:
+	case PATTERN_BAYER:
+		if (format->packed) {
+			group = pattern_packing_group(format);
+			return line[x / group * (group * format->depth / 8) + x % group];
+		}
+		if (format->depth == 8)
+			return line[x];
+		value = line[x * 2] | line[x * 2 + 1] << 8;
+		return value >> (format->depth - 8);
+
+	case PATTERN_RGB:
+		return line[x * format->bpp / 8 + format->order[1]];
+
+	case PATTERN_RGB_BITS:
+		value = format->bpp == 8 ? line[x]
+		      : line[x * 2 + format->big_endian] |
+			line[x * 2 + !format->big_endian] << 8;
+		value = (value >> format->order[2]) & ((1 << format->order[1]) - 1);
+		return value << (8 - format->order[1]);
+	}
 
-	return ret;
+	return 0;
 }
 
-static int video_set_quality(struct device *dev, unsigned int quality)
+/*
+ * Read the frame code back from a frame, sampling the centre of each block.
+ * Return true if the magic word matches.
+ */
+static bool test_pattern_decode(const struct test_pattern *tp,
+				const struct buffer *buffer,
+				uint32_t code[PATTERN_CODE_WORDS])
 {
-	struct v4l2_jpegcompression jpeg;
-	int ret;
-
-	if (quality == (unsigned int)-1)
-		return 0;
+	unsigned int half = tp->block / 2;
+	unsigned int i;
+	unsigned int j;
 
-	memset(&jpeg, 0, sizeof jpeg);
-	jpeg.quality = quality;
+	for (i = 0; i < PATTERN_CODE_WORDS; i++) {
+		code[i] = 0;
+		for (j = 0; j < PATTERN_CODE_BITS; j++) {
+			uint8_t v = test_pattern_sample(tp, buffer, j * tp->block + half,
+							i * tp->block + half);
 
-	ret = ioctl(dev->fd, VIDIOC_S_JPEGCOMP, &jpeg);
-	if (ret < 0) {
-		print("Unable to set quality to %u: %s (%d).\n", quality,
-			strerror(errno), errno);
-		return ret;
+			code[i] = code[i] << 1 | (v >= 128);
+		}
 	}
 
-	ret = ioctl(dev->fd, VIDIOC_G_JPEGCOMP, &jpeg);
-	if (ret >= 0)
-		print("Quality set to %u\n", jpeg.quality);
-
-	return 0;
+	return code[0] == PATTERN_CODE_MAGIC;
 }
 
-static int video_load_test_pattern(struct device *dev, const char *filename)
+/*
+ * Set up the procedural test pattern for the current format. Return 0 on
+ * success or a negative error code if the format isn't supported.
+ */
+static int test_pattern_init(struct device *dev)
 {
-	unsigned int plane;
-	unsigned int size;
-	int fd = -1;
-	int ret;
+	const struct v4l2_format_info *info = v4l2_format_by_fourcc(dev->pixelformat);
+	struct test_pattern *tp = &dev->test_pattern;
+	const struct pattern_format *format = NULL;
+	unsigned int max_bytes = 0;
+	unsigned int i;
 
-	if (filename != NULL) {
-		fd = open(filename, O_RDONLY);
-		if (fd == -1) {
-			print("Unable to open test pattern file '%s': %s (%d).\n",
-				filename, strerror(errno), errno);
-			return -errno;
+	for (i = 0; i < ARRAY_SIZE(pattern_formats); i++) {
+		if (pattern_formats[i].fourcc == dev->pixelformat) {
+			format = &pattern_formats[i];
+			break;
 		}
 	}
 
-	/* Load or generate the test pattern */
-	for (plane = 0; plane < dev->num_planes; plane++) {
-		size = dev->buffers[0].size[plane];
-		dev->pattern[plane] = malloc(size);
-		if (dev->pattern[plane] == NULL) {
-			ret = -ENOMEM;
-			goto done;
-		}
+	if (!format || !info) {
+		print("Test pattern generation isn't supported for format %s.\n",
+			v4l2_format_name(dev->pixelformat));
+		return -EINVAL;
+	}
 
-		if (filename != NULL) {
-			ret = read(fd, dev->pattern[plane], size);
-			if (ret != (int)size && dev->plane_fmt[plane].bytesperline != 0) {
-				print("Test pattern file size %u doesn't match image size %u\n",
-					ret, size);
-				ret = -EINVAL;
-				goto done;
-			}
-		} else {
-			uint8_t *data = dev->pattern[plane];
-			unsigned int i;
+	tp->format = format;
+	tp->width = dev->width;
+	tp->height = dev->height;
+	tp->num_planes = format->cls == PATTERN_YUV_PLANAR ? 3
+		       : format->cls == PATTERN_YUV_SEMI_PLANAR ? 2 : 1;
+
+	/* Blocks are a multiple of 4 pixels to keep packing groups whole. */
+	tp->block = tp->width / 64 & ~3U;
+	if (tp->block < 4)
+		tp->block = 4;
+	tp->band = tp->height * 3 / 4 & ~3U;
+	if (tp->width % 4 || tp->height % 4 ||
+	    PATTERN_CODE_BITS * tp->block > tp->width ||
+	    PATTERN_CODE_WORDS * tp->block > tp->band) {
+		print("Test pattern generation requires a size multiple of 4, of at least 128x24.\n");
+		return -EINVAL;
+	}
 
-			if (dev->plane_fmt[plane].bytesperline == 0) {
-				print("Compressed format detected for plane %u and no test pattern filename given.\n"
-					"The test pattern can't be generated automatically.\n", plane);
-				ret = -EINVAL;
-				goto done;
-			}
+	for (i = 0; i < tp->num_planes; i++) {
+		struct pattern_plane *plane = &tp->planes[i];
+		unsigned int bpl = dev->plane_fmt[info->n_planes > 1 ? i : 0].bytesperline;
+		unsigned int sizeimage;
 
-			for (i = 0; i < dev->plane_fmt[plane].sizeimage; ++i)
-				*data++ = i;
+		plane->index = info->n_planes > 1 ? i : 0;
+		plane->hsub = i ? format->hsub : 1;
+		plane->vsub = i ? format->vsub : 1;
+
+		if (i == 0)
+			plane->bytes = tp->width * format->bpp / 8;
+		else if (format->cls == PATTERN_YUV_SEMI_PLANAR)
+			plane->bytes = tp->width / plane->hsub * 2;
+		else
+			plane->bytes = tp->width / plane->hsub;
+
+		/* Single plane semi-planar formats store CbCr after the luma. */
+		if (info->n_planes > 1 || i == 0) {
+			plane->offset = 0;
+			plane->stride = bpl;
+		} else {
+			plane->offset = bpl * tp->height;
+			plane->stride = bpl * 2 / plane->hsub;
 		}
 
-		dev->patternsize[plane] = size;
+		sizeimage = dev->plane_fmt[plane->index].sizeimage;
+		if (plane->bytes > plane->stride || plane->offset +
+		    plane->stride * (tp->height / plane->vsub) > sizeimage) {
+			print("Test pattern plane %u doesn't fit the format.\n", i);
+			return -EINVAL;
+		}
+
+		if (plane->bytes > max_bytes)
+			max_bytes = plane->bytes;
 	}
 
-	ret = 0;
+	tp->row = malloc(tp->width * sizeof *tp->row);
+	tp->line = malloc(max_bytes * 2);
+	if (!tp->row || !tp->line)
+		return -ENOMEM;
 
-done:
-	if (fd != -1)
-		close(fd);
+	for (i = 0; i < dev->num_planes; i++)
+		dev->patternsize[i] = dev->plane_fmt[i].sizeimage;
 
-	return ret;
+	/* Buffers hold the static parts of the pattern once written. */
+	dev->pattern_gen++;
+
+	return 0;
 }
 
-static int video_prepare_capture(struct device *dev, int nbufs, unsigned int offset,
-				 const char *filename, enum buffer_fill_mode fill)
+/* Render the test pattern in an output buffer. Return 1 or a negative error code. */
+static int video_buffer_generate(struct device *dev, struct buffer *buffer)
 {
-	unsigned int padding;
+	uint64_t timestamp = dev->output_timestamp_ns;
 	int ret;
 
-	/* Allocate and map buffers. */
-	padding = (fill & BUFFER_FILL_PADDING) ? 4096 : 0;
-	if ((ret = video_alloc_buffers(dev, nbufs, offset, padding)) < 0)
+	if (!timestamp)
+		timestamp = clock_ns(CLOCK_MONOTONIC);
+
+	ret = video_buffer_map(dev, buffer);
+	if (ret < 0)
 		return ret;
 
-	if (video_is_output(dev)) {
-		ret = video_load_test_pattern(dev, filename);
-		if (ret < 0)
-			return ret;
-	}
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_START);
+	test_pattern_render(&dev->test_pattern, buffer,
+			    buffer->pattern_gen != dev->pattern_gen, timestamp);
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_END);
 
-	return 0;
+	buffer->pattern_gen = dev->pattern_gen;
+
+	return 1;
 }
 
-static int video_queue_all_buffers(struct device *dev, enum buffer_fill_mode fill)
+/*
+ * Copy the test pattern to an output buffer unless it holds the current
+ * pattern already. Return 1 if the buffer has been written, 0 if it was up to
+ * date or a negative error code otherwise.
+ */
+static int video_buffer_write_pattern(struct device *dev, struct buffer *buffer)
 {
 	unsigned int i;
 	int ret;
 
-	/* Queue the buffers. */
-	for (i = 0; i < dev->nbufs; ++i) {
-		ret = video_queue_buffer(dev, i, fill);
-		if (ret < 0)
-			return ret;
-	}
+	if (buffer->pattern_gen == dev->pattern_gen)
+		return 0;
 
-	return 0;
+	ret = video_buffer_map(dev, buffer);
+	if (ret < 0)
+		return ret;
+
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_START);
+	for (i = 0; i < dev->num_planes; i++)
+		memcpy(buffer->mem[i], dev->pattern[i], dev->patternsize[i]);
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_END);
+
+	buffer->pattern_gen = dev->pattern_gen;
+
+	return 1;
 }
 
-static void video_verify_buffer(struct device *dev, struct v4l2_buffer *buf)
+/* Number of clip frames read ahead of the play position */
+#define CLIP_PREFETCH_FRAMES	8
+
+/*
+ * Ask the kernel to read a clip frame ahead of its playback. The pages are
+ * fetched asynchronously, neither the copy nor the driver then waits on the
+ * file when the frame is queued.
+ */
+static void clip_prefetch(struct clip *clip, unsigned int frame)
 {
-	struct buffer *buffer = &dev->buffers[buf->index];
-	unsigned int plane;
-	unsigned int i;
+	size_t page_size = getpagesize();
+	size_t start = (size_t)frame * clip->frame_size;
+	size_t offset = start & (page_size - 1);
 
-	for (plane = 0; plane < dev->num_planes; ++plane) {
-		const uint8_t *data = buffer->mem[plane] + buffer->size[plane];
-		unsigned int errors = 0;
-		unsigned int dirty = 0;
+	madvise((void *)(clip->map + start - offset), clip->frame_size + offset,
+		MADV_WILLNEED);
+}
 
-		if (buffer->padding[plane] == 0)
-			continue;
+/*
+ * Attach the next clip frame to an output buffer. USERPTR buffers point into
+ * the clip mapping, other buffers get the frame copied unless they hold it
+ * already. Return 1 if the buffer has been written, 0 if it wasn't or a
+ * negative error code otherwise.
+ */
+static int video_buffer_load_clip(struct device *dev, struct buffer *buffer,
+				  struct v4l2_buffer *buf)
+{
+	struct clip *clip = &dev->clip;
+	unsigned int frame = clip->position;
+	const uint8_t *data = clip->map + (size_t)frame * clip->frame_size;
+	unsigned int i;
+	int ret;
 
-		for (i = 0; i < buffer->padding[plane]; ++i) {
-			if (data[i] != 0x55) {
-				errors++;
-				dirty = i + 1;
+	clip->position = (frame + 1) % clip->nframes;
+	clip_prefetch(clip, (frame + CLIP_PREFETCH_FRAMES) % clip->nframes);
+
+	if (dev->memtype == V4L2_MEMORY_USERPTR) {
+		for (i = 0; i < dev->num_planes; i++) {
+			if (video_is_mplane(dev)) {
+				buf->m.planes[i].m.userptr = (unsigned long)data;
+				buf->m.planes[i].length = dev->patternsize[i];
+			} else {
+				buf->m.userptr = (unsigned long)data;
+				buf->length = dev->patternsize[i];
 			}
+			data += dev->patternsize[i];
 		}
+		return 0;
+	}
 
-		if (errors) {
-			print("Warning: %u bytes overwritten among %u first padding bytes for plane %u\n",
-			       errors, dirty, plane);
+	if (buffer->clip_frame == frame + 1)
+		return 0;
 
-			dirty = (dirty + 15) & ~15;
-			dirty = dirty > 32 ? 32 : dirty;
+	ret = video_buffer_map(dev, buffer);
+	if (ret < 0)
+		return ret;
 
-			for (i = 0; i < dirty; ++i) {
-				print("%02x ", data[i]);
-				if (i % 16 == 15)
-					print("\n");
-			}
-		}
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_START);
+	for (i = 0; i < dev->num_planes; i++) {
+		memcpy(buffer->mem[i], data, dev->patternsize[i]);
+		data += dev->patternsize[i];
 	}
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_END);
+
+	buffer->clip_frame = frame + 1;
+
+	return 1;
 }
 
-static void isp_ip_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static int video_queue_buffer(struct device *dev, int index, enum buffer_fill_mode fill)
 {
-	struct device *dev = (struct device *)port->userdata;
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	bool written = false;
+	bool sync;
+	uint64_t start;
+	int ret;
 	unsigned int i;
-//	print("Buffer %p (->data %p) returned\n", buffer, buffer->data);
-	for (i = 0; i < dev->nbufs; i++) {
-		if (dev->buffers[i].mmal == buffer) {
-//			print("Matches V4L2 buffer index %d / %d\n", i, dev->buffers[i].idx);
-			video_queue_buffer(dev, dev->buffers[i].idx, BUFFER_FILL_NONE);
-			mmal_buffer_header_release(buffer);
-			buffer = NULL;
-			break;
-		}
-	}
-	if (buffer) {
-		print("Failed to find matching V4L2 buffer for mmal buffer %p\n", buffer);
-		mmal_buffer_header_release(buffer);
+
+	if (!video_buffer_transition(dev, &dev->buffers[index],
+				     BUFFER_STATE_MASK(FREE), BUFFER_STATE_QUEUED)) {
+		errno = EBUSY;
+		return -EBUSY;
 	}
-}
 
-static void * save_thread(void *arg)
-{
-	struct device *dev = (struct device *)arg;
-	MMAL_BUFFER_HEADER_T *buffer;
-	MMAL_STATUS_T status;
-	unsigned int bytes_written;
+	memset(&buf, 0, sizeof buf);
+	memset(&planes, 0, sizeof planes);
 
-	while (!dev->thread_quit)
-	{
-		//Being lazy and using a timed wait instead of setting up a
-		//mechanism for skipping this when destroying the thread
-		buffer = mmal_queue_timedwait(dev->save_queue, 500);
-		if (!buffer)
-			continue;
+	buf.index = index;
+	buf.type = dev->type;
+	buf.memory = dev->memtype;
 
-		//print("Buffer %p saving, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-		if (dev->h264_fd)
-		{
-			bytes_written = fwrite(buffer->data, 1, buffer->length, dev->h264_fd);
-			fflush(dev->h264_fd);
+	/*
+	 * Buffers that can't be bracketed with DMA_BUF_IOCTL_SYNC, such as
+	 * USERPTR buffers, rely on the maintenance at QBUF and DQBUF time.
+	 */
+	sync = video_buffer_can_sync(dev, &dev->buffers[index]);
+	if (sync)
+		buf.flags |= V4L2_BUF_FLAG_NO_CACHE_INVALIDATE
+			  |  V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+	else if (dev->cache_hints && !dev->cpu_reads)
+		buf.flags |= V4L2_BUF_FLAG_NO_CACHE_INVALIDATE;
 
-			if (bytes_written != buffer->length)
-			{
-				print("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
+	if (video_is_output(dev)) {
+		buf.flags |= dev->buffer_output_flags;
+		if (dev->output_timestamp_ns) {
+			buf.timestamp.tv_sec = dev->output_timestamp_ns / 1000000000ULL;
+			buf.timestamp.tv_usec = dev->output_timestamp_ns % 1000000000ULL / 1000;
+		} else if (dev->timestamp_type == V4L2_BUF_FLAG_TIMESTAMP_COPY) {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			buf.timestamp.tv_sec = ts.tv_sec;
+			buf.timestamp.tv_usec = ts.tv_nsec / 1000;
+		}
+	}
+
+	if (video_is_mplane(dev)) {
+		buf.m.planes = planes;
+		buf.length = dev->num_planes;
+	}
+
+	if (dev->memtype == V4L2_MEMORY_USERPTR) {
+		if (video_is_mplane(dev)) {
+			for (i = 0; i < dev->num_planes; i++) {
+				buf.m.planes[i].m.userptr = (unsigned long)
+					dev->buffers[index].mem[i];
+				buf.m.planes[i].length =
+					dev->buffers[index].size[i];
 			}
+		} else {
+			buf.m.userptr = (unsigned long)dev->buffers[index].mem[0];
+			buf.length = dev->buffers[index].size[0];
 		}
+	} else if (dev->memtype == V4L2_MEMORY_DMABUF) {
+		video_buffer_fill_dmabuf(dev, &dev->buffers[index], &buf);
+	}
+
+	if (video_is_output(dev)) {
+		/*
+		 * Buffers keep the pattern, it's only copied when it changes.
+		 * Clips advance by one frame per buffer, generated patterns
+		 * are rendered for every frame.
+		 */
+		if (dev->clip.map)
+			ret = video_buffer_load_clip(dev, &dev->buffers[index], &buf);
+		else if (dev->generate)
+			ret = video_buffer_generate(dev, &dev->buffers[index]);
 		else
-		{
-			print("No file to save to\n");
+			ret = video_buffer_write_pattern(dev, &dev->buffers[index]);
+		if (ret < 0) {
+			atomic_store(&dev->buffers[index].state, BUFFER_STATE_FREE);
+			return ret;
 		}
-		if (dev->pts_fd &&
-		    !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
-		    buffer->pts != MMAL_TIME_UNKNOWN)
-			fprintf(dev->pts_fd, "%lld.%03lld\n", buffer->pts/1000, buffer->pts%1000);
+		written = ret;
 
-		buffer->length = 0;
-		status = mmal_port_send_buffer(dev->encoder->output[0], buffer);
-		if(status != MMAL_SUCCESS)
-		{
-			print("mmal_port_send_buffer failed on buffer %p, status %d", buffer, status);
+		for (i = 0; i < dev->num_planes; i++) {
+			if (video_is_mplane(dev))
+				buf.m.planes[i].bytesused = dev->patternsize[i];
+			else
+				buf.bytesused = dev->patternsize[i];
+		}
+	} else if (dev->cpu_writes) {
+		ret = video_buffer_map(dev, &dev->buffers[index]);
+		if (ret < 0) {
+			atomic_store(&dev->buffers[index].state, BUFFER_STATE_FREE);
+			return ret;
+		}
+
+		video_buffer_sync(dev, &dev->buffers[index], DMA_BUF_SYNC_START);
+
+		for (i = 0; i < dev->num_planes; i++) {
+			if (fill & BUFFER_FILL_FRAME)
+				memset(dev->buffers[buf.index].mem[i], 0x55,
+				       dev->buffers[index].size[i]);
+			if (fill & BUFFER_FILL_PADDING)
+				memset(dev->buffers[buf.index].mem[i] +
+					dev->buffers[index].size[i],
+				       0x55, dev->buffers[index].padding[i]);
 		}
+
+		video_buffer_sync(dev, &dev->buffers[index], DMA_BUF_SYNC_END);
+		written = true;
 	}
-	return NULL;
+
+	/* Caches only need to be cleaned after the CPU has written the payload. */
+	if (dev->cache_hints && !sync && !written)
+		buf.flags |= V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
+	ioctl_time_record(&dev->qbuf_time, start);
+	if (ret < 0) {
+		print("Unable to queue buffer: %s (%d).\n",
+			strerror(errno), errno);
+		atomic_store(&dev->buffers[index].state, BUFFER_STATE_FREE);
+	}
+
+	return ret;
 }
 
-static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+/*
+ * Fault in and lock a memory region ahead of streaming, so that the first
+ * frames don't take page faults. Return the number of bytes locked.
+ */
+static size_t memory_prefault(void *mem, size_t size, bool write)
 {
-	struct device *dev = (struct device *)port->userdata;
+	unsigned int page_size = getpagesize();
+	volatile uint8_t *data = mem;
+	int advice = -1;
+	size_t i;
 
-	//print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
+	if (mem == NULL || size == 0)
+		return 0;
 
-	if (port->is_enabled)
-		mmal_queue_put(dev->save_queue, buffer);
-	else
-		mmal_buffer_header_release(buffer);
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+	advice = write ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+#endif
+	if (advice < 0 ||
+	    madvise((void *)((uintptr_t)mem & ~(uintptr_t)(page_size - 1)),
+		    size + ((uintptr_t)mem & (page_size - 1)), advice) < 0) {
+		/* Device mappings can't be populated, touch every page. */
+		for (i = 0; i < size; i += page_size) {
+			if (write)
+				data[i] = data[i];
+			else
+				(void)data[i];
+		}
+		if (write)
+			data[size - 1] = data[size - 1];
+		else
+			(void)data[size - 1];
+	}
+
+	return mlock(mem, size) < 0 ? 0 : size;
 }
 
-static void buffers_to_isp(struct device *dev)
+static size_t video_buffer_prefault(struct device *dev, struct buffer *buffer)
 {
-	MMAL_BUFFER_HEADER_T *buffer;
+	bool write = dev->memtype != V4L2_MEMORY_MMAP || dev->cpu_writes;
+	size_t locked = 0;
+	unsigned int i;
 
-	while ((buffer = mmal_queue_get(dev->isp_output_pool->queue)) != NULL)
-	{
-		mmal_port_send_buffer(dev->isp->output[0], buffer);
+	/* Zero-copy MMAP buffers are never mapped, there's nothing to fault. */
+	if (dev->memtype == V4L2_MEMORY_MMAP && !dev->cpu_reads && !dev->cpu_writes)
+		return 0;
+
+	if (video_buffer_map(dev, buffer) < 0)
+		return 0;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		locked += memory_prefault(buffer->mem[i],
+					  buffer->size[i] + buffer->padding[i], write);
+		locked += memory_prefault(buffer->staging[i], buffer->size[i], true);
 	}
 
+	return locked;
 }
-static void isp_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+
+static void video_prefault(struct device *dev)
 {
-	//print("Buffer %p from isp, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
-	struct device *dev = (struct device*)port->userdata;
+	size_t locked = 0;
+	size_t size = 0;
+	unsigned int i, j;
 
-	if (dev->render)
-	{
-		MMAL_BUFFER_HEADER_T *out = mmal_queue_get(dev->render_pool->queue);
-		if (out)
-		{
-			mmal_buffer_header_replicate(out, buffer);
-			mmal_port_send_buffer(dev->render->input[0], out);
+	for (i = 0; i < dev->nbufs; i++) {
+		locked += video_buffer_prefault(dev, &dev->buffers[i]);
+		for (j = 0; j < dev->num_planes; j++) {
+			if (dev->buffers[i].mem[j])
+				size += dev->buffers[i].size[j] + dev->buffers[i].padding[j];
+			if (dev->buffers[i].staging[j])
+				size += dev->buffers[i].size[j];
 		}
 	}
-	if (dev->encoder)
-	{
-		MMAL_BUFFER_HEADER_T *out = mmal_queue_get(dev->encode_pool->queue);
-		if (out)
-		{
-			mmal_buffer_header_replicate(out, buffer);
-			mmal_port_send_buffer(dev->encoder->input[0], out);
-		}
+
+	for (i = 0; i < dev->num_planes; i++) {
+		locked += memory_prefault(dev->pattern[i], dev->patternsize[i], true);
+		size += dev->pattern[i] ? dev->patternsize[i] : 0;
 	}
-	mmal_buffer_header_release(buffer);
 
-	buffers_to_isp(dev);
+	print("Pre-faulted %zu bytes of buffers and patterns, %zu bytes locked%s\n",
+		size, locked, locked < size ? " (check RLIMIT_MEMLOCK)" : "");
 }
 
-static void render_encoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+/*
+ * Copy out of uncached or write-combined memory. Wide streaming loads fetch a
+ * full write-combining line at a time instead of one uncached access per load.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.1")))
+static void stream_copy_sse41(void *dst, const void *src, size_t size)
 {
-	//print("Buffer %p returned from %s, filled %d, timestamp %llu, flags %04X\n", buffer, port->name, buffer->length, buffer->pts, buffer->flags);
-	//vcos_log_error("File handle: %p", port->userdata);
-	struct device *dev = (struct device*)port->userdata;
+	__m128i *d = dst;
+	__m128i *s = (__m128i *)src;
+	size_t n;
+
+	for (n = size / 64; n; n--) {
+		__m128i v0 = _mm_stream_load_si128(s);
+		__m128i v1 = _mm_stream_load_si128(s + 1);
+		__m128i v2 = _mm_stream_load_si128(s + 2);
+		__m128i v3 = _mm_stream_load_si128(s + 3);
+
+		_mm_store_si128(d, v0);
+		_mm_store_si128(d + 1, v1);
+		_mm_store_si128(d + 2, v2);
+		_mm_store_si128(d + 3, v3);
+		s += 4;
+		d += 4;
+	}
 
-	mmal_buffer_header_release(buffer);
+	memcpy(d, s, size % 64);
+}
+#elif defined(__ARM_NEON)
+static void stream_copy_neon(void *dst, const void *src, size_t size)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t n;
+
+	for (n = size / 64; n; n--) {
+		uint8x16_t v0 = vld1q_u8(s);
+		uint8x16_t v1 = vld1q_u8(s + 16);
+		uint8x16_t v2 = vld1q_u8(s + 32);
+		uint8x16_t v3 = vld1q_u8(s + 48);
+
+		vst1q_u8(d, v0);
+		vst1q_u8(d + 16, v1);
+		vst1q_u8(d + 32, v2);
+		vst1q_u8(d + 48, v3);
+		s += 64;
+		d += 64;
+	}
 
-	buffers_to_isp(dev);
+	memcpy(d, s, size % 64);
 }
+#endif
 
-#define LOG_DEBUG print
+static void stream_copy(void *dst, const void *src, size_t size)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("sse4.1") &&
+	    !(((uintptr_t)dst | (uintptr_t)src) & 15)) {
+		stream_copy_sse41(dst, src, size);
+		return;
+	}
 
-static void dump_port_format(MMAL_ES_FORMAT_T *format)
+	memcpy(dst, src, size);
+#elif defined(__ARM_NEON)
+	stream_copy_neon(dst, src, size);
+#else
+	memcpy(dst, src, size);
+#endif
+}
+
+/* Return the best time in ns of a few copies from src to dst. */
+static uint64_t staging_benchmark(void *dst, const void *src, size_t size,
+				  bool streaming)
 {
-   const char *name_type;
+	uint64_t best = UINT64_MAX;
+	unsigned int i;
 
-   if (!format)
-      return;
+	for (i = 0; i < 4; i++) {
+		uint64_t start = clock_ns(CLOCK_MONOTONIC);
 
-   switch(format->type)
-   {
-   case MMAL_ES_TYPE_AUDIO: name_type = "audio"; break;
-   case MMAL_ES_TYPE_VIDEO: name_type = "video"; break;
-   case MMAL_ES_TYPE_SUBPICTURE: name_type = "subpicture"; break;
-   default: name_type = "unknown"; break;
-   }
+		if (streaming)
+			stream_copy(dst, src, size);
+		else
+			memcpy(dst, src, size);
 
-   LOG_DEBUG("type: %s, fourcc: %4.4s", name_type, (char *)&format->encoding);
-   LOG_DEBUG(" bitrate: %i, framed: %i", format->bitrate,
-            !!(format->flags & MMAL_ES_FORMAT_FLAG_FRAMED));
-   LOG_DEBUG(" extra data: %i, %p", format->extradata_size, format->extradata);
-   switch(format->type)
-   {
-   case MMAL_ES_TYPE_AUDIO:
-      LOG_DEBUG(" samplerate: %i, channels: %i, bps: %i, block align: %i\n",
+		/* Don't let the compiler drop the copy. */
+		__asm__ __volatile__("" : : "r" (dst) : "memory");
+
+		start = clock_ns(CLOCK_MONOTONIC) - start;
+		if (start < best)
+			best = start;
+	}
+
+	return best;
+}
+
+/*
+ * Decide whether frames are copied to cached staging buffers before the CPU
+ * reads them, by benchmarking reads from the first buffer in place against a
+ * streaming copy followed by a read from cached memory.
+ */
+static int video_staging_setup(struct device *dev)
+{
+	struct buffer *buffer = &dev->buffers[0];
+	size_t size = buffer->size[0];
+	uint64_t in_place, streaming, cached;
+	void *staging;
+	void *ref;
+	unsigned int i;
+	int ret;
+
+	if (!dev->cpu_reads) {
+		print("Staging disabled, the CPU doesn't read the frames\n");
+		return 0;
+	}
+
+	ret = video_buffer_map(dev, buffer);
+	if (ret < 0)
+		return ret;
+
+	staging = NULL;
+	ref = NULL;
+	if (posix_memalign(&staging, 64, size) || posix_memalign(&ref, 64, size)) {
+		free(staging);
+		return -ENOMEM;
+	}
+
+	memset(staging, 0, size);
+	memset(ref, 0, size);
+
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_START);
+	in_place = staging_benchmark(staging, buffer->mem[0], size, false);
+	streaming = staging_benchmark(staging, buffer->mem[0], size, true);
+	video_buffer_sync(dev, buffer, DMA_BUF_SYNC_END);
+	cached = staging_benchmark(staging, ref, size, false);
+
+	free(staging);
+	free(ref);
+
+	print("Buffer read benchmark (%zu bytes): in place %.1f MB/s, streaming copy %.1f MB/s, cached %.1f MB/s\n",
+		size, size * 1000000000.0 / (in_place + 1) / (1024 * 1024),
+		size * 1000000000.0 / (streaming + 1) / (1024 * 1024),
+		size * 1000000000.0 / (cached + 1) / (1024 * 1024));
+
+	/* Staging pays off when copying and reading the copy beats reading in place. */
+	dev->staging = dev->staging_mode == STAGING_ALWAYS ||
+		       streaming + cached < in_place;
+	print("Staging %s\n", dev->staging ? "enabled" : "disabled");
+
+	if (!dev->staging)
+		return 0;
+
+	for (i = 0; i < dev->nbufs; i++) {
+		ret = video_buffer_alloc_staging(dev, &dev->buffers[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Add count buffers to the pool with VIDIOC_CREATE_BUFS and queue them. Return
+ * the number of buffers added or a negative error code.
+ */
+static int video_grow_buffers(struct device *dev, unsigned int count,
+			      enum buffer_fill_mode fill)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_create_buffers create;
+	struct v4l2_buffer buf;
+	unsigned int i;
+	int ret;
+
+	if (dev->nbufs + count > dev->max_bufs)
+		count = dev->max_bufs - dev->nbufs;
+	if (count == 0)
+		return 0;
+
+	memset(&create, 0, sizeof create);
+	create.count = count;
+	create.memory = dev->memtype;
+	create.format.type = dev->type;
+	if (dev->cache_hints)
+		create.flags = V4L2_MEMORY_FLAG_NON_COHERENT;
+
+	ret = ioctl(dev->fd, VIDIOC_G_FMT, &create.format);
+	if (ret < 0) {
+		print("Unable to get format: %s (%d).\n", strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = ioctl(dev->fd, VIDIOC_CREATE_BUFS, &create);
+	if (ret < 0) {
+		print("Unable to create buffers: %s (%d).\n", strerror(errno),
+			errno);
+		return -errno;
+	}
+
+	if (create.index != dev->nbufs || create.index + create.count > dev->max_bufs) {
+		print("Unexpected buffers %u-%u created.\n", create.index,
+			create.index + create.count - 1);
+		return -EINVAL;
+	}
+
+	for (i = create.index; i < create.index + create.count; ++i) {
+		ret = video_buffer_setup(dev, &dev->buffers[i], i, &buf, planes);
+		if (ret < 0)
+			return ret;
+
+		if (dev->prefault)
+			video_buffer_prefault(dev, &dev->buffers[i]);
+
+		dev->buffers[i].requeue = true;
+		atomic_init(&dev->buffers[i].refs, 0);
+		dev->nbufs++;
+
+		ret = video_queue_buffer(dev, i, fill);
+		if (ret < 0)
+			return ret;
+	}
+
+	return create.count;
+}
+
+int video_set_dv_timings(struct device *dev);
+
+/* Return true if all buffers can hold a frame in the current format. */
+static bool video_buffers_fit(struct device *dev)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < dev->nbufs; i++) {
+		for (j = 0; j < dev->num_planes; j++) {
+			if (dev->buffers[i].size[j] < dev->plane_fmt[j].sizeimage)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Apply the timings of a new source and adapt the buffers to the resulting
+ * format. Buffers are kept as long as they're large enough. Drivers that
+ * refuse to change timings with buffers allocated require the queue to be
+ * released first, in which case USERPTR and DMABUF memory is still reused
+ * when it fits, but MMAP buffers belong to the driver and are reallocated.
+ * All buffers must be free. Return the number of buffers reallocated.
+ */
+static int video_realloc_buffers(struct device *dev)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	unsigned int num_planes = dev->num_planes;
+	struct v4l2_requestbuffers rb;
+	struct v4l2_buffer buf;
+	unsigned int i;
+	bool fit;
+	int ret;
+
+	if (!video_set_dv_timings(dev) && !video_get_format(dev) &&
+	    dev->num_planes == num_planes && video_buffers_fit(dev))
+		return 0;
+
+	dev->num_planes = num_planes;
+
+	if (dev->memtype == V4L2_MEMORY_MMAP) {
+		for (i = 0; i < dev->nbufs; i++) {
+			ret = video_buffer_free(dev, &dev->buffers[i]);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	memset(&rb, 0, sizeof rb);
+	rb.count = 0;
+	rb.type = dev->type;
+	rb.memory = dev->memtype;
+
+	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
+	if (ret < 0) {
+		print("Unable to release buffers: %s (%d).\n",
+			strerror(errno), errno);
+		return ret;
+	}
+
+	video_set_dv_timings(dev);
+
+	ret = video_get_format(dev);
+	if (ret < 0)
+		return ret;
+
+	if (dev->num_planes != num_planes) {
+		print("Number of planes changed from %u to %u, unable to reuse buffers.\n",
+			num_planes, dev->num_planes);
+		return -EINVAL;
+	}
+
+	memset(&rb, 0, sizeof rb);
+	rb.count = dev->nbufs;
+	rb.type = dev->type;
+	rb.memory = dev->memtype;
+	if (dev->cache_hints)
+		rb.flags = V4L2_MEMORY_FLAG_NON_COHERENT;
+
+	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
+	if (ret < 0) {
+		print("Unable to request buffers: %s (%d).\n", strerror(errno),
+			errno);
+		return ret;
+	}
+
+	/* Buffers added when the pool grew may not fit in a single request. */
+	if (rb.count < dev->nbufs) {
+		print("%u buffers requested, V4L2 returned %u bufs.\n",
+			dev->nbufs, rb.count);
+		if (rb.count == 0)
+			return -ENOMEM;
+
+		for (i = rb.count; i < dev->nbufs; i++)
+			video_buffer_free(dev, &dev->buffers[i]);
+		dev->nbufs = rb.count;
+	}
+
+	fit = video_buffers_fit(dev);
+
+	for (i = 0; i < dev->nbufs; i++) {
+		struct buffer *buffer = &dev->buffers[i];
+
+		if (dev->memtype != V4L2_MEMORY_MMAP) {
+			if (fit)
+				continue;
+			video_buffer_free(dev, buffer);
+		}
+
+		ret = video_buffer_setup(dev, buffer, i, &buf, planes);
+		if (ret < 0)
+			return ret;
+
+		if (dev->prefault)
+			video_buffer_prefault(dev, buffer);
+	}
+
+	return dev->memtype == V4L2_MEMORY_MMAP || !fit ? (int)dev->nbufs : 0;
+}
+
+static int video_enable(struct device *dev, int enable)
+{
+	int type = dev->type;
+	int ret;
+
+	ret = ioctl(dev->fd, enable ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
+	if (ret < 0) {
+		print("Unable to %s streaming: %s (%d).\n",
+			enable ? "start" : "stop", strerror(errno), errno);
+		return ret;
+	}
+
+	return 0;
+}
+
+static void video_query_menu(struct device *dev, struct v4l2_queryctrl *query,
+			     unsigned int value)
+{
+	struct v4l2_querymenu menu;
+	int ret;
+
+	for (menu.index = query->minimum;
+	     menu.index <= (unsigned)query->maximum; menu.index++) {
+		menu.id = query->id;
+		ret = ioctl(dev->fd, VIDIOC_QUERYMENU, &menu);
+		if (ret < 0)
+			continue;
+
+		if (query->type == V4L2_CTRL_TYPE_MENU)
+			print("  %u: %.32s%s\n", menu.index, menu.name,
+			       menu.index == value ? " (*)" : "");
+		else
+			print("  %u: %lld%s\n", menu.index, menu.value,
+			       menu.index == value ? " (*)" : "");
+	};
+}
+
+static int video_print_control(struct device *dev, unsigned int id, bool full)
+{
+	struct v4l2_ext_control ctrl;
+	struct v4l2_queryctrl query;
+	char sval[24];
+	char *current = sval;
+	int ret;
+
+	ret = query_control(dev, id, &query);
+	if (ret < 0)
+		return ret;
+
+	if (query.flags & V4L2_CTRL_FLAG_DISABLED)
+		return query.id;
+
+	if (query.type == V4L2_CTRL_TYPE_CTRL_CLASS) {
+		print("--- %s (class 0x%08x) ---\n", query.name, query.id);
+		return query.id;
+	}
+
+	ret = get_control(dev, &query, &ctrl);
+	if (ret < 0)
+		strcpy(sval, "n/a");
+	else if (query.type == V4L2_CTRL_TYPE_INTEGER64)
+		sprintf(sval, "%lld", ctrl.value64);
+	else if (query.type == V4L2_CTRL_TYPE_STRING)
+		current = ctrl.string;
+	else
+		sprintf(sval, "%d", ctrl.value);
+
+	if (full)
+		print("control 0x%08x `%s' min %d max %d step %d default %d current %s.\n",
+			query.id, query.name, query.minimum, query.maximum,
+			query.step, query.default_value, current);
+	else
+		print("control 0x%08x current %s.\n", query.id, current);
+
+	if (query.type == V4L2_CTRL_TYPE_STRING)
+		free(ctrl.string);
+
+	if (!full)
+		return query.id;
+
+	if (query.type == V4L2_CTRL_TYPE_MENU ||
+	    query.type == V4L2_CTRL_TYPE_INTEGER_MENU)
+		video_query_menu(dev, &query, ctrl.value);
+
+	return query.id;
+}
+
+static void video_list_controls(struct device *dev)
+{
+	unsigned int nctrls = 0;
+	unsigned int id;
+	int ret;
+
+#ifndef V4L2_CTRL_FLAG_NEXT_CTRL
+	unsigned int i;
+
+	for (i = V4L2_CID_BASE; i <= V4L2_CID_LASTP1; ++i) {
+		id = i;
+#else
+	id = 0;
+	while (1) {
+		id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+#endif
+
+		ret = video_print_control(dev, id, true);
+		if (ret < 0)
+			break;
+
+		id = ret;
+		nctrls++;
+	}
+
+	if (nctrls)
+		print("%u control%s found.\n", nctrls, nctrls > 1 ? "s" : "");
+	else
+		print("No control found.\n");
+}
+
+static void video_enum_frame_intervals(struct device *dev, __u32 pixelformat,
+	unsigned int width, unsigned int height)
+{
+	struct v4l2_frmivalenum ival;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; ; ++i) {
+		memset(&ival, 0, sizeof ival);
+		ival.index = i;
+		ival.pixel_format = pixelformat;
+		ival.width = width;
+		ival.height = height;
+		ret = ioctl(dev->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival);
+		if (ret < 0)
+			break;
+
+		if (i != ival.index)
+			print("Warning: driver returned wrong ival index "
+				"%u.\n", ival.index);
+		if (pixelformat != ival.pixel_format)
+			print("Warning: driver returned wrong ival pixel "
+				"format %08x.\n", ival.pixel_format);
+		if (width != ival.width)
+			print("Warning: driver returned wrong ival width "
+				"%u.\n", ival.width);
+		if (height != ival.height)
+			print("Warning: driver returned wrong ival height "
+				"%u.\n", ival.height);
+
+		if (i != 0)
+			print(", ");
+
+		switch (ival.type) {
+		case V4L2_FRMIVAL_TYPE_DISCRETE:
+			print("%u/%u",
+				ival.discrete.numerator,
+				ival.discrete.denominator);
+			break;
+
+		case V4L2_FRMIVAL_TYPE_CONTINUOUS:
+			print("%u/%u - %u/%u",
+				ival.stepwise.min.numerator,
+				ival.stepwise.min.denominator,
+				ival.stepwise.max.numerator,
+				ival.stepwise.max.denominator);
+			return;
+
+		case V4L2_FRMIVAL_TYPE_STEPWISE:
+			print("%u/%u - %u/%u (by %u/%u)",
+				ival.stepwise.min.numerator,
+				ival.stepwise.min.denominator,
+				ival.stepwise.max.numerator,
+				ival.stepwise.max.denominator,
+				ival.stepwise.step.numerator,
+				ival.stepwise.step.denominator);
+			return;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void video_enum_frame_sizes(struct device *dev, __u32 pixelformat)
+{
+	struct v4l2_frmsizeenum frame;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; ; ++i) {
+		memset(&frame, 0, sizeof frame);
+		frame.index = i;
+		frame.pixel_format = pixelformat;
+		ret = ioctl(dev->fd, VIDIOC_ENUM_FRAMESIZES, &frame);
+		if (ret < 0)
+			break;
+
+		if (i != frame.index)
+			print("Warning: driver returned wrong frame index "
+				"%u.\n", frame.index);
+		if (pixelformat != frame.pixel_format)
+			print("Warning: driver returned wrong frame pixel "
+				"format %08x.\n", frame.pixel_format);
+
+		switch (frame.type) {
+		case V4L2_FRMSIZE_TYPE_DISCRETE:
+			print("\tFrame size: %ux%u (", frame.discrete.width,
+				frame.discrete.height);
+			video_enum_frame_intervals(dev, frame.pixel_format,
+				frame.discrete.width, frame.discrete.height);
+			print(")\n");
+			break;
+
+		case V4L2_FRMSIZE_TYPE_CONTINUOUS:
+			print("\tFrame size: %ux%u - %ux%u (",
+				frame.stepwise.min_width,
+				frame.stepwise.min_height,
+				frame.stepwise.max_width,
+				frame.stepwise.max_height);
+			video_enum_frame_intervals(dev, frame.pixel_format,
+				frame.stepwise.max_width,
+				frame.stepwise.max_height);
+			print(")\n");
+			break;
+
+		case V4L2_FRMSIZE_TYPE_STEPWISE:
+			print("\tFrame size: %ux%u - %ux%u (by %ux%u) (\n",
+				frame.stepwise.min_width,
+				frame.stepwise.min_height,
+				frame.stepwise.max_width,
+				frame.stepwise.max_height,
+				frame.stepwise.step_width,
+				frame.stepwise.step_height);
+			video_enum_frame_intervals(dev, frame.pixel_format,
+				frame.stepwise.max_width,
+				frame.stepwise.max_height);
+			print(")\n");
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void video_enum_formats(struct device *dev, enum v4l2_buf_type type)
+{
+	struct v4l2_fmtdesc fmt;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; ; ++i) {
+		memset(&fmt, 0, sizeof fmt);
+		fmt.index = i;
+		fmt.type = type;
+		ret = ioctl(dev->fd, VIDIOC_ENUM_FMT, &fmt);
+		if (ret < 0)
+			break;
+
+		if (i != fmt.index)
+			print("Warning: driver returned wrong format index "
+				"%u.\n", fmt.index);
+		if (type != fmt.type)
+			print("Warning: driver returned wrong format type "
+				"%u.\n", fmt.type);
+
+		print("\tFormat %u: %s (%08x)\n", i,
+			v4l2_format_name(fmt.pixelformat), fmt.pixelformat);
+		print("\tType: %s (%u)\n", v4l2_buf_type_name(fmt.type),
+			fmt.type);
+		print("\tName: %.32s\n", fmt.description);
+		video_enum_frame_sizes(dev, fmt.pixelformat);
+		print("\n");
+	}
+}
+
+static void video_enum_inputs(struct device *dev)
+{
+	struct v4l2_input input;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; ; ++i) {
+		memset(&input, 0, sizeof input);
+		input.index = i;
+		ret = ioctl(dev->fd, VIDIOC_ENUMINPUT, &input);
+		if (ret < 0)
+			break;
+
+		if (i != input.index)
+			print("Warning: driver returned wrong input index "
+				"%u.\n", input.index);
+
+		print("\tInput %u: %s.\n", i, input.name);
+	}
+
+	print("\n");
+}
+
+static int video_get_input(struct device *dev)
+{
+	__u32 input;
+	int ret;
+
+	ret = ioctl(dev->fd, VIDIOC_G_INPUT, &input);
+	if (ret < 0) {
+		print("Unable to get current input: %s (%d).\n",
+			strerror(errno), errno);
+		return ret;
+	}
+
+	return input;
+}
+
+static int video_set_input(struct device *dev, unsigned int input)
+{
+	__u32 _input = input;
+	int ret;
+
+	ret = ioctl(dev->fd, VIDIOC_S_INPUT, &_input);
+	if (ret < 0)
+		print("Unable to select input %u: %s (%d).\n", input,
+			strerror(errno), errno);
+
+	return ret;
+}
+
+static int video_set_quality(struct device *dev, unsigned int quality)
+{
+	struct v4l2_jpegcompression jpeg;
+	int ret;
+
+	if (quality == (unsigned int)-1)
+		return 0;
+
+	memset(&jpeg, 0, sizeof jpeg);
+	jpeg.quality = quality;
+
+	ret = ioctl(dev->fd, VIDIOC_S_JPEGCOMP, &jpeg);
+	if (ret < 0) {
+		print("Unable to set quality to %u: %s (%d).\n", quality,
+			strerror(errno), errno);
+		return ret;
+	}
+
+	ret = ioctl(dev->fd, VIDIOC_G_JPEGCOMP, &jpeg);
+	if (ret >= 0)
+		print("Quality set to %u\n", jpeg.quality);
+
+	return 0;
+}
+
+/*
+ * Map a raw clip of consecutive frames for playback. The file is never read,
+ * frames are paged in from the mapping, prefetched ahead of the play position.
+ */
+static int video_load_clip(struct device *dev, const char *filename)
+{
+	struct clip *clip = &dev->clip;
+	struct stat st;
+	unsigned int plane;
+	unsigned int i;
+	void *map;
+	int fd;
+
+	clip->frame_size = 0;
+	for (plane = 0; plane < dev->num_planes; plane++) {
+		if (dev->plane_fmt[plane].bytesperline == 0) {
+			print("Clip playback requires an uncompressed format.\n");
+			return -EINVAL;
+		}
+
+		dev->patternsize[plane] = dev->plane_fmt[plane].sizeimage;
+		clip->frame_size += dev->patternsize[plane];
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		print("Unable to open clip file '%s': %s (%d).\n",
+			filename, strerror(errno), errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		print("Unable to stat clip file '%s': %s (%d).\n",
+			filename, strerror(errno), errno);
+		close(fd);
+		return -errno;
+	}
+
+	clip->nframes = st.st_size / clip->frame_size;
+	if (clip->nframes == 0) {
+		print("Clip file size %llu is smaller than a frame (%zu bytes)\n",
+			(unsigned long long)st.st_size, clip->frame_size);
+		close(fd);
+		return -EINVAL;
+	}
+
+	clip->map_size = (size_t)clip->nframes * clip->frame_size;
+	map = mmap(NULL, clip->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		print("Unable to map clip file '%s': %s (%d).\n",
+			filename, strerror(errno), errno);
+		return -errno;
+	}
+
+	clip->map = map;
+	clip->position = 0;
+	madvise(map, clip->map_size, MADV_SEQUENTIAL);
+	for (i = 0; i < CLIP_PREFETCH_FRAMES && i < clip->nframes; i++)
+		clip_prefetch(clip, i);
+
+	print("Playing clip '%s': %u frames of %zu bytes%s\n", filename,
+		clip->nframes, clip->frame_size,
+		dev->memtype == V4L2_MEMORY_USERPTR ? " (zero-copy)" : "");
+
+	return 0;
+}
+
+static int video_load_test_pattern(struct device *dev, const char *filename)
+{
+	unsigned int plane;
+	unsigned int size;
+	int fd = -1;
+	int ret;
+
+	if (filename != NULL) {
+		fd = open(filename, O_RDONLY);
+		if (fd == -1) {
+			print("Unable to open test pattern file '%s': %s (%d).\n",
+				filename, strerror(errno), errno);
+			return -errno;
+		}
+	}
+
+	/* Load or generate the test pattern */
+	for (plane = 0; plane < dev->num_planes; plane++) {
+		size = dev->buffers[0].size[plane];
+		dev->pattern[plane] = malloc(size);
+		if (dev->pattern[plane] == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+
+		if (filename != NULL) {
+			ret = read(fd, dev->pattern[plane], size);
+			if (ret != (int)size && dev->plane_fmt[plane].bytesperline != 0) {
+				print("Test pattern file size %u doesn't match image size %u\n",
+					ret, size);
+				ret = -EINVAL;
+				goto done;
+			}
+		} else {
+			uint8_t *data = dev->pattern[plane];
+			unsigned int i;
+
+			if (dev->plane_fmt[plane].bytesperline == 0) {
+				print("Compressed format detected for plane %u and no test pattern filename given.\n"
+					"The test pattern can't be generated automatically.\n", plane);
+				ret = -EINVAL;
+				goto done;
+			}
+
+			for (i = 0; i < dev->plane_fmt[plane].sizeimage; ++i)
+				*data++ = i;
+		}
+
+		dev->patternsize[plane] = size;
+	}
+
+	dev->pattern_gen++;
+	ret = 0;
+
+done:
+	if (fd != -1)
+		close(fd);
+
+	return ret;
+}
+
+static int video_prepare_capture(struct device *dev, int nbufs, unsigned int offset,
+				 const char *filename, enum buffer_fill_mode fill)
+{
+	unsigned int padding;
+	unsigned int i;
+	int ret;
+
+	/* Allocate and map buffers. */
+	padding = (fill & BUFFER_FILL_PADDING) ? 4096 : 0;
+	if ((ret = video_alloc_buffers(dev, nbufs, offset, padding)) < 0)
+		return ret;
+
+	if (video_is_output(dev) && dev->clip_playback) {
+		ret = video_load_clip(dev, filename);
+		if (ret < 0)
+			return ret;
+	} else if (video_is_output(dev) && dev->generate) {
+		ret = test_pattern_init(dev);
+		if (ret < 0)
+			return ret;
+
+		print("Generating test pattern for %s: bars, moving gradient and %ux%u frame code of %u pixel blocks\n",
+			v4l2_format_name(dev->pixelformat), PATTERN_CODE_BITS,
+			PATTERN_CODE_WORDS, dev->test_pattern.block);
+	} else if (video_is_output(dev)) {
+		ret = video_load_test_pattern(dev, filename);
+		if (ret < 0)
+			return ret;
+
+		for (i = 0; i < dev->nbufs; i++) {
+			ret = video_buffer_write_pattern(dev, &dev->buffers[i]);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	if (video_is_capture(dev) && dev->staging_mode != STAGING_NONE) {
+		ret = video_staging_setup(dev);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (dev->prefault)
+		video_prefault(dev);
+
+	return 0;
+}
+
+static int video_queue_all_buffers(struct device *dev, enum buffer_fill_mode fill)
+{
+	unsigned int i;
+	int ret;
+
+	/* Queue the buffers. */
+	for (i = 0; i < dev->nbufs; ++i) {
+		ret = video_queue_buffer(dev, i, fill);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Open and prepare the output side of a loopback pair. The output device
+ * streams the generated test pattern in the capture format, and the capture
+ * side decodes the frame code of the frames it receives.
+ */
+static int video_loopback_open(struct device *dev, const char *devname,
+			       unsigned int nbufs)
+{
+	unsigned int capabilities;
+	struct device *out;
+	int ret;
+
+	out = malloc(sizeof *out);
+	if (out == NULL)
+		return -ENOMEM;
+
+	video_init(out);
+	dev->loopback = out;
+
+	ret = video_open(out, devname);
+	if (ret < 0)
+		return ret;
+
+	video_querycap(out, &capabilities);
+	if (capabilities & V4L2_CAP_VIDEO_OUTPUT_MPLANE) {
+		video_set_buf_type(out, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	} else if (capabilities & V4L2_CAP_VIDEO_OUTPUT) {
+		video_set_buf_type(out, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+	} else {
+		print("Loopback device %s isn't an output device.\n", devname);
+		return -EINVAL;
+	}
+
+	out->cpu_writes = true;
+	out->generate = true;
+
+	ret = video_set_format(out, dev->width, dev->height, dev->pixelformat,
+			       0, 0, V4L2_FIELD_ANY, 0);
+	if (ret < 0)
+		return ret;
+
+	ret = video_get_format(out);
+	if (ret < 0)
+		return ret;
+
+	if (out->width != dev->width || out->height != dev->height ||
+	    out->pixelformat != dev->pixelformat) {
+		print("Loopback output format %s %ux%u doesn't match the capture format.\n",
+			v4l2_format_name(out->pixelformat), out->width, out->height);
+		return -EINVAL;
+	}
+
+	/* The capture side reads the frame code with the same layout. */
+	ret = test_pattern_init(dev);
+	if (ret < 0)
+		return ret;
+
+	ret = video_prepare_capture(out, nbufs, 0, NULL, BUFFER_FILL_NONE);
+	if (ret < 0)
+		return ret;
+
+	return video_queue_all_buffers(out, BUFFER_FILL_NONE);
+}
+
+/*
+ * Hand a dequeued buffer back to the capture thread for requeuing. This can be
+ * called from any thread.
+ */
+static void video_buffer_release(struct device *dev, unsigned int index)
+{
+	unsigned long long pending;
+
+	video_buffer_transition(dev, &dev->buffers[index], BUFFER_STATES_HELD,
+				BUFFER_STATE_FREE);
+
+	pending = atomic_fetch_or_explicit(&dev->released, 1ULL << index,
+					   memory_order_release);
+
+	/* The capture thread hasn't collected the previous release yet. */
+	if (pending || dev->release_fd < 0)
+		return;
+
+	eventfd_signal(dev->release_fd);
+}
+
+/*
+ * Dequeued buffers are reference-counted, each processing stage holding a
+ * reference until it's done with the buffer. The buffer is released when the
+ * last reference is dropped.
+ */
+static void video_buffer_get(struct buffer *buffer)
+{
+	atomic_fetch_add_explicit(&buffer->refs, 1, memory_order_relaxed);
+}
+
+static void video_buffer_put(struct device *dev, struct buffer *buffer)
+{
+	if (atomic_fetch_sub_explicit(&buffer->refs, 1, memory_order_acq_rel) != 1)
+		return;
+
+	/* Ends the CPU access started in video_process_buffer(). */
+	if (dev->cpu_reads)
+		video_buffer_sync(dev, buffer, DMA_BUF_SYNC_END);
+
+	video_buffer_release(dev, buffer->idx);
+}
+
+static void video_verify_buffer(struct device *dev, struct v4l2_buffer *buf)
+{
+	struct buffer *buffer = &dev->buffers[buf->index];
+	unsigned int plane;
+	unsigned int i;
+
+	for (plane = 0; plane < dev->num_planes; ++plane) {
+		const uint8_t *data = buffer->mem[plane] + buffer->size[plane];
+		unsigned int errors = 0;
+		unsigned int dirty = 0;
+
+		if (buffer->padding[plane] == 0)
+			continue;
+
+		for (i = 0; i < buffer->padding[plane]; ++i) {
+			if (data[i] != 0x55) {
+				errors++;
+				dirty = i + 1;
+			}
+		}
+
+		if (errors) {
+			print("Warning: %u bytes overwritten among %u first padding bytes for plane %u\n",
+			       errors, dirty, plane);
+
+			dirty = (dirty + 15) & ~15;
+			dirty = dirty > 32 ? 32 : dirty;
+
+			for (i = 0; i < dirty; ++i) {
+				print("%02x ", data[i]);
+				if (i % 16 == 15)
+					print("\n");
+			}
+		}
+	}
+}
+
+static void isp_ip_cb(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct device *dev = (struct device *)port->userdata;
+	struct buffer *v4l2_buf = buffer->user_data;
+//	print("Buffer %p (->data %p) returned\n", buffer, buffer->data);
+	if (!v4l2_buf || v4l2_buf->mmal != buffer) {
+		print("Failed to find matching V4L2 buffer for mmal buffer %p\n", buffer);
+		mmal_buffer_header_release(buffer);
+		return;
+	}
+
+	/* The header is owned by the V4L2 buffer, don't release it to the pool. */
+	video_buffer_put(dev, v4l2_buf);
+}
+
+static void * save_thread(void *arg)
+{
+	struct device *dev = (struct device *)arg;
+	MMAL_BUFFER_HEADER_T *buffer;
+	MMAL_STATUS_T status;
+	unsigned int bytes_written;
+
+	while (!dev->thread_quit)
+	{
+		//Being lazy and using a timed wait instead of setting up a
+		//mechanism for skipping this when destroying the thread
+		buffer = mmal_queue_timedwait(dev->save_queue, 500);
+		if (!buffer)
+			continue;
+
+		//print("Buffer %p saving, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+		if (dev->h264_fd)
+		{
+			bytes_written = fwrite(buffer->data, 1, buffer->length, dev->h264_fd);
+			fflush(dev->h264_fd);
+
+			if (bytes_written != buffer->length)
+			{
+				print("Failed to write buffer data (%d from %d)- aborting", bytes_written, buffer->length);
+			}
+		}
+		else
+		{
+			print("No file to save to\n");
+		}
+		if (dev->pts_fd &&
+		    !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) &&
+		    buffer->pts != MMAL_TIME_UNKNOWN)
+			fprintf(dev->pts_fd, "%lld.%03lld\n", buffer->pts/1000, buffer->pts%1000);
+
+		buffer->length = 0;
+		status = mmal_port_send_buffer(dev->encoder->output[0], buffer);
+		if(status != MMAL_SUCCESS)
+		{
+			print("mmal_port_send_buffer failed on buffer %p, status %d", buffer, status);
+		}
+	}
+	return NULL;
+}
+
+static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	struct device *dev = (struct device *)port->userdata;
+
+	//print("Buffer %p returned, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+
+	if (port->is_enabled)
+		mmal_queue_put(dev->save_queue, buffer);
+	else
+		mmal_buffer_header_release(buffer);
+}
+
+static void buffers_to_isp(struct device *dev)
+{
+	MMAL_BUFFER_HEADER_T *buffer;
+
+	while ((buffer = mmal_queue_get(dev->isp_output_pool->queue)) != NULL)
+	{
+		mmal_port_send_buffer(dev->isp->output[0], buffer);
+	}
+
+}
+static void isp_output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	//print("Buffer %p from isp, filled %d, timestamp %llu, flags %04X\n", buffer, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+	struct device *dev = (struct device*)port->userdata;
+
+	if (dev->render)
+	{
+		MMAL_BUFFER_HEADER_T *out = mmal_queue_get(dev->render_pool->queue);
+		if (out)
+		{
+			mmal_buffer_header_replicate(out, buffer);
+			mmal_port_send_buffer(dev->render->input[0], out);
+		}
+	}
+	if (dev->encoder)
+	{
+		MMAL_BUFFER_HEADER_T *out = mmal_queue_get(dev->encode_pool->queue);
+		if (out)
+		{
+			mmal_buffer_header_replicate(out, buffer);
+			mmal_port_send_buffer(dev->encoder->input[0], out);
+		}
+	}
+	mmal_buffer_header_release(buffer);
+
+	buffers_to_isp(dev);
+}
+
+static void render_encoder_input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	//print("Buffer %p returned from %s, filled %d, timestamp %llu, flags %04X\n", buffer, port->name, buffer->length, buffer->pts, buffer->flags);
+	//vcos_log_error("File handle: %p", port->userdata);
+	struct device *dev = (struct device*)port->userdata;
+
+	mmal_buffer_header_release(buffer);
+
+	buffers_to_isp(dev);
+}
+
+#define LOG_DEBUG print
+
+static void dump_port_format(MMAL_ES_FORMAT_T *format)
+{
+   const char *name_type;
+
+   if (!format)
+      return;
+
+   switch(format->type)
+   {
+   case MMAL_ES_TYPE_AUDIO: name_type = "audio"; break;
+   case MMAL_ES_TYPE_VIDEO: name_type = "video"; break;
+   case MMAL_ES_TYPE_SUBPICTURE: name_type = "subpicture"; break;
+   default: name_type = "unknown"; break;
+   }
+
+   LOG_DEBUG("type: %s, fourcc: %4.4s", name_type, (char *)&format->encoding);
+   LOG_DEBUG(" bitrate: %i, framed: %i", format->bitrate,
+            !!(format->flags & MMAL_ES_FORMAT_FLAG_FRAMED));
+   LOG_DEBUG(" extra data: %i, %p", format->extradata_size, format->extradata);
+   switch(format->type)
+   {
+   case MMAL_ES_TYPE_AUDIO:
+      LOG_DEBUG(" samplerate: %i, channels: %i, bps: %i, block align: %i\n",
                format->es->audio.sample_rate, format->es->audio.channels,
                format->es->audio.bits_per_sample, format->es->audio.block_align);
       break;
 
-   case MMAL_ES_TYPE_VIDEO:
-      LOG_DEBUG(" width: %i, height: %i, (%i,%i,%i,%i)",
-               format->es->video.width, format->es->video.height,
-               format->es->video.crop.x, format->es->video.crop.y,
-               format->es->video.crop.width, format->es->video.crop.height);
-      LOG_DEBUG(" pixel aspect ratio: %i/%i, frame rate: %i/%i\n",
-               format->es->video.par.num, format->es->video.par.den,
-               format->es->video.frame_rate.num, format->es->video.frame_rate.den);
-      break;
+   case MMAL_ES_TYPE_VIDEO:
+      LOG_DEBUG(" width: %i, height: %i, (%i,%i,%i,%i)",
+               format->es->video.width, format->es->video.height,
+               format->es->video.crop.x, format->es->video.crop.y,
+               format->es->video.crop.width, format->es->video.crop.height);
+      LOG_DEBUG(" pixel aspect ratio: %i/%i, frame rate: %i/%i\n",
+               format->es->video.par.num, format->es->video.par.den,
+               format->es->video.frame_rate.num, format->es->video.frame_rate.den);
+      break;
+
+   case MMAL_ES_TYPE_SUBPICTURE:
+      break;
+
+   default: break;
+   }
+}
+
+void mmal_log_dump_port(MMAL_PORT_T *port)
+{
+   if (!port)
+      return;
+
+   LOG_DEBUG("%s(%p)", port->name, port);
+
+   dump_port_format(port->format);
+
+   LOG_DEBUG("buffers num: %i(opt %i, min %i), size: %i(opt %i, min: %i), align: %i\n",
+            port->buffer_num, port->buffer_num_recommended, port->buffer_num_min,
+            port->buffer_size, port->buffer_size_recommended, port->buffer_size_min,
+            port->buffer_alignment_min);
+}
+
+/*
+ * Dequeue all pending events. Return true if the source resolution changed,
+ * the caller is responsible for reconfiguring the device.
+ */
+static bool handle_event(struct device *dev)
+{
+        struct v4l2_event ev;
+        bool resolution = false;
+
+        while (!ioctl(dev->fd, VIDIOC_DQEVENT, &ev)) {
+            switch (ev.type) {
+            case V4L2_EVENT_SOURCE_CHANGE:
+                fprintf(stderr, "Source changed\n");
+                if (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)
+                        resolution = true;
+                break;
+            case V4L2_EVENT_EOS:
+                fprintf(stderr, "EOS\n");
+                break;
+            }
+        }
+
+        return resolution;
+}
+
+static int setup_mmal(struct device *dev, int nbufs, int do_encode, const char *filename)
+{
+	MMAL_STATUS_T status;
+	VCOS_STATUS_T vcos_status;
+	MMAL_PORT_T *port;
+	const struct v4l2_format_info *info;
+	struct v4l2_format fmt;
+	int ret;
+	MMAL_PORT_T *isp_output, *encoder_input = NULL, *encoder_output = NULL;
+
+	//FIXME: Clean up after errors
+
+	status = mmal_component_create("vc.ril.isp", &dev->isp);
+	if(status != MMAL_SUCCESS)
+	{
+		print("Failed to create isp\n");
+		return -1;
+	}
+
+	if (do_encode)
+	{
+		status = mmal_component_create("vc.ril.video_encode", &dev->encoder);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to create encoder");
+			return -1;
+		}
+		encoder_input = dev->encoder->input[0];
+		encoder_output = dev->encoder->output[0];
+	}
+
+	if (1)
+	{
+		status = mmal_component_create("vc.ril.video_render", &dev->render);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to create render\n");
+			return -1;
+		}
+	}
+
+	port = dev->isp->input[0];
+
+	memset(&fmt, 0, sizeof fmt);
+	fmt.type = dev->type;
+
+	ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
+	if (ret < 0) {
+		print("Unable to get format: %s (%d).\n", strerror(errno),
+			errno);
+		return ret;
+	}
+
+	info = v4l2_format_by_fourcc(fmt.fmt.pix.pixelformat);
+	if (!info || info->mmal_encoding == MMAL_ENCODING_UNUSED)
+	{
+		print("Unsupported encoding\n");
+		return -1;
+	}
+	port->format->encoding = info->mmal_encoding;
+	port->format->es->video.crop.width = fmt.fmt.pix.width;
+	port->format->es->video.crop.height = fmt.fmt.pix.height;
+	port->format->es->video.width = (port->format->es->video.crop.width+31) & ~31;
+	//mmal_encoding_stride_to_width(port->format->encoding, fmt.fmt.pix.bytesperline);
+	//The ISP doesn't care about padding on the height, but other components may.
+	port->format->es->video.height = fmt.fmt.pix.height;
+	//Ignore for now, but will be wanted for video encode.
+	//port->format->es->video.frame_rate.num = 10000;
+	//port->format->es->video.frame_rate.den = frame_interval ? frame_interval : 10000;
+	port->buffer_num = nbufs;
+	if (dev->frame_period.denominator) {
+		dev->frame_time_usec = 1000000ULL * dev->frame_period.numerator
+				     / dev->frame_period.denominator;
+	} else if (dev->fps) {
+		dev->frame_time_usec = 1000000/dev->fps;
+	}
+
+	status = mmal_port_format_commit(port);
+	if (status != MMAL_SUCCESS)
+	{
+		print("Commit failed\n");
+		return -1;
+	}
+	mmal_log_dump_port(port);
+
+	unsigned int mmal_stride = mmal_encoding_width_to_stride(info->mmal_encoding, port->format->es->video.width);
+	if (mmal_stride != fmt.fmt.pix.bytesperline) {
+		if (video_set_format(dev, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.pixelformat, mmal_stride,
+				     fmt.fmt.pix.sizeimage, fmt.fmt.pix.field, fmt.fmt.pix.flags) < 0) 
+			print("Failed to adjust stride\n");
+		else
+			// Retrieve settings again so local state is correct
+			video_get_format(dev);
+	}
+
+	dev->mmal_pool = mmal_pool_create(nbufs, 0);
+	if (!dev->mmal_pool) {
+		print("Failed to create pool\n");
+		return -1;
+	}
+	print("Created pool of length %d, size %d\n", nbufs, 0);
+
+	port->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+	mmal_format_copy(dev->isp->output[0]->format, port->format);
+	port = dev->isp->output[0];
+	port->format->encoding = MMAL_ENCODING_I420;
+	while(port->format->es->video.crop.width > 1920)
+	{
+		port->format->es->video.crop.width >>= 1;
+		port->format->es->video.crop.height >>= 1;
+	}
+	port->buffer_num = 3;
+
+	status = mmal_port_format_commit(port);
+	if (status != MMAL_SUCCESS)
+	{
+		print("ISP o/p commit failed\n");
+		return -1;
+	}
+
+	isp_output = dev->isp->output[0];
+
+	if (dev->render)
+	{
+		status = mmal_format_full_copy(dev->render->input[0]->format, isp_output->format);
+		dev->render->input[0]->buffer_num = 3;
+		if (status == MMAL_SUCCESS)
+			status = mmal_port_format_commit(dev->render->input[0]);
+	}
+
+	//  Encoder setup
+	if (dev->encoder)
+	{
+		status = mmal_format_full_copy(encoder_input->format, isp_output->format);
+		encoder_input->buffer_num = 3;
+		if (status == MMAL_SUCCESS)
+			status = mmal_port_format_commit(encoder_input);
+
+		// Only supporting H264 at the moment
+		encoder_output->format->encoding = MMAL_ENCODING_H264;
+
+		encoder_output->format->bitrate = 10000000;
+		encoder_output->buffer_size = 256<<10;//encoder_output->buffer_size_recommended;
+
+		if (encoder_output->buffer_size < encoder_output->buffer_size_min)
+			encoder_output->buffer_size = encoder_output->buffer_size_min;
+
+		encoder_output->buffer_num = 8; //encoder_output->buffer_num_recommended;
+
+		if (encoder_output->buffer_num < encoder_output->buffer_num_min)
+			encoder_output->buffer_num = encoder_output->buffer_num_min;
+
+		// We need to set the frame rate on output to 0, to ensure it gets
+		// updated correctly from the input framerate when port connected
+		encoder_output->format->es->video.frame_rate.num = 0;
+		encoder_output->format->es->video.frame_rate.den = 1;
+
+		// Commit the port changes to the output port
+		status = mmal_port_format_commit(encoder_output);
+
+		if (status != MMAL_SUCCESS)
+		{
+			print("Unable to set format on encoder output port\n");
+		}
+
+		{
+			MMAL_PARAMETER_VIDEO_PROFILE_T  param;
+			param.hdr.id = MMAL_PARAMETER_PROFILE;
+			param.hdr.size = sizeof(param);
+
+			param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;//state->profile;
+			param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+
+			status = mmal_port_parameter_set(encoder_output, &param.hdr);
+			if (status != MMAL_SUCCESS)
+			{
+				print("Unable to set H264 profile\n");
+			}
+		}
+
+		if (mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
+		{
+			print("Unable to set immutable input flag\n");
+			// Continue rather than abort..
+		}
+
+		//set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
+		if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 0) != MMAL_SUCCESS)
+		{
+			print("failed to set INLINE HEADER FLAG parameters\n");
+			// Continue rather than abort..
+		}
+
+		//set INLINE VECTORS flag to request motion vector estimates
+		if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 0) != MMAL_SUCCESS)
+		{
+			print("failed to set INLINE VECTORS parameters\n");
+			// Continue rather than abort..
+		}
+
+		if (status != MMAL_SUCCESS)
+		{
+			print("Unable to set format on video encoder input port\n");
+		}
+
+		print("Enable encoder....\n");
+		status = mmal_component_enable(dev->encoder);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to enable\n");
+			return -1;
+		}
+		status = mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+		status += mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to set zero copy\n");
+			return -1;
+		}
+		encoder_input->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+	}
+
+	status = mmal_port_parameter_set_boolean(isp_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+
+	isp_output->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+	if (dev->render)
+	{
+		status += mmal_port_parameter_set_boolean(dev->render->input[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+		if (status != MMAL_SUCCESS)
+		{
+			return -1;
+		}
+
+		dev->render->input[0]->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+
+		status = mmal_port_enable(dev->render->input[0], render_encoder_input_callback);
+		if (status != MMAL_SUCCESS)
+			return -1;
+
+		print("Create pool of %d buffers of size %d for render\n", dev->render->input[0]->buffer_num, 0);
+		dev->render_pool = mmal_port_pool_create(dev->render->input[0], dev->render->input[0]->buffer_num, dev->render->input[0]->buffer_size);
+		if(!dev->render_pool)
+		{
+			print("Failed to create render pool\n");
+			return -1;
+		}
+	}
+
+	if (dev->encoder)
+	{
+		status = mmal_port_enable(encoder_input, render_encoder_input_callback);
+		if (status != MMAL_SUCCESS)
+			return -1;
+
+		print("Create pool of %d buffers of size %d for encode ip\n", encoder_input->buffer_num, 0);
+		dev->encode_pool = mmal_port_pool_create(encoder_input, isp_output->buffer_num, isp_output->buffer_size);
+		if(!dev->encode_pool)
+		{
+			print("Failed to create encode ip pool\n");
+			return -1;
+		}
+	}
+
+	status = mmal_port_enable(isp_output, isp_output_callback);
+	if (status != MMAL_SUCCESS)
+		return -1;
+
+	print("Create pool of %d buffers of size %d for encode/render\n", isp_output->buffer_num, isp_output->buffer_size);
+	dev->isp_output_pool = mmal_port_pool_create(isp_output, isp_output->buffer_num, isp_output->buffer_size);
+	if(!dev->isp_output_pool)
+	{
+		print("Failed to create pool\n");
+		return -1;
+	}
+
+	buffers_to_isp(dev);
+
+	// open h264 file and put the file handle in userdata for the encoder output port
+	if (dev->encoder)
+	{
+		if (filename[0] == '-' && filename[1] == '\0')
+		{
+			dev->h264_fd = stdout;
+			debug = 0;
+		}
+		else {
+			printf("Writing data to %s\n", filename);
+			dev->h264_fd = fopen(filename, "wb");
+		}
+
+		dev->pts_fd = (void*)fopen("file.pts", "wb");
+		if (dev->pts_fd) /* save header for mkvmerge */
+			fprintf(dev->pts_fd, "# timecode format v2\n");
+
+		encoder_output->userdata = (void*)dev;
+
+		//Create encoder output buffers
+
+		print("Create pool of %d buffers of size %d\n", encoder_output->buffer_num, encoder_output->buffer_size);
+		dev->output_pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+		if(!dev->output_pool)
+		{
+			print("Failed to create pool\n");
+			return -1;
+		}
+
+		dev->save_queue = mmal_queue_create();
+		if(!dev->save_queue)
+		{
+			print("Failed to create queue\n");
+			return -1;
+		}
+
+		vcos_status = vcos_thread_create(&dev->save_thread, "save-thread",
+					NULL, save_thread, dev);
+		if(vcos_status != VCOS_SUCCESS)
+		{
+			print("Failed to create save thread\n");
+			return -1;
+		}
+
+		status = mmal_port_enable(encoder_output, encoder_buffer_callback);
+		if(status != MMAL_SUCCESS)
+		{
+			print("Failed to enable port\n");
+			return -1;
+		}
+
+		unsigned int i;
+		for(i=0; i<encoder_output->buffer_num; i++)
+		{
+			MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(dev->output_pool->queue);
+
+			if (!buffer)
+			{
+				print("Where'd my buffer go?!\n");
+				return -1;
+			}
+			status = mmal_port_send_buffer(encoder_output, buffer);
+			if(status != MMAL_SUCCESS)
+			{
+				print("mmal_port_send_buffer failed on buffer %p, status %d\n", buffer, status);
+				return -1;
+			}
+			print("Sent buffer %p\n", buffer);
+		}
+	}
+
+	return 0;
+}
+
+static int enable_mmal_ip(struct device *dev)
+{
+	MMAL_STATUS_T status;
+
+	if (mmal_port_parameter_set_boolean(dev->isp->input[0], MMAL_PARAMETER_ZERO_COPY, dev->can_zero_copy) != MMAL_SUCCESS)
+	{
+		print("Failed to set zero copy\n");
+		return -1;
+	}
+	status = mmal_port_enable(dev->isp->input[0], isp_ip_cb);
+	if (status != MMAL_SUCCESS)
+	{
+		print("ISP input enable failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_mmal(struct device *dev)
+{
+	//FIXME: Clean up everything properly
+	dev->thread_quit = 1;
+	vcos_thread_join(&dev->save_thread, NULL);
+}
+
+/*
+ * Log-linear histogram. Values are bucketed by their most significant bit,
+ * each power of two being split in HISTOGRAM_SUB_BUCKETS linear sub-buckets,
+ * which bounds the relative error to 1/HISTOGRAM_SUB_BUCKETS over the whole
+ * 64-bit range.
+ */
+#define HISTOGRAM_SUB_BITS	4
+#define HISTOGRAM_SUB_BUCKETS	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS	((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+static void histogram_init(struct histogram *hist)
+{
+	memset(hist, 0, sizeof *hist);
+	hist->min = UINT64_MAX;
+}
+
+static unsigned int histogram_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS
+	     + (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/* Return the midpoint of a bucket. */
+static uint64_t histogram_bucket_value(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift)
+	     + ((1ULL << shift) >> 1);
+}
+
+static void histogram_record(struct histogram *hist, uint64_t value)
+{
+	hist->counts[histogram_bucket(value)]++;
+	hist->total++;
+	if (value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		dst->counts[i] += src->counts[i];
+
+	dst->total += src->total;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t histogram_percentile(const struct histogram *hist, double percentile)
+{
+	uint64_t rank;
+	uint64_t count = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (!hist->total)
+		return 0;
+
+	rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		count += hist->counts[i];
+		if (count >= rank)
+			break;
+	}
+
+	value = histogram_bucket_value(i);
+	if (value < hist->min)
+		value = hist->min;
+	if (value > hist->max)
+		value = hist->max;
+
+	return value;
+}
+
+/* Print the percentiles of a histogram of durations in nanoseconds. */
+static void histogram_fprint(FILE *out, const struct histogram *hist,
+			     const char *name)
+{
+	if (!hist->total)
+		return;
+
+	fprintf(out, "%s: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us (%" PRIu64 " samples)\n",
+		name,
+		histogram_percentile(hist, 50.0) / 1000.0,
+		histogram_percentile(hist, 90.0) / 1000.0,
+		histogram_percentile(hist, 99.0) / 1000.0,
+		histogram_percentile(hist, 99.9) / 1000.0,
+		hist->max / 1000.0, hist->total);
+}
+
+static void histogram_print(const struct histogram *hist, const char *name)
+{
+	if (debug)
+		histogram_fprint(stdout, hist, name);
+}
+
+/* Plane data of a dequeued buffer to be written to disk. */
+struct save_job
+{
+	unsigned int index;
+	unsigned int sequence;
+	off_t offset;
+	void *header;
+	unsigned int header_size;
+	unsigned int align;
+	unsigned int num_planes;
+	void *data[VIDEO_MAX_PLANES];
+	unsigned int length[VIDEO_MAX_PLANES];
+};
+
+static void save_job_init(struct device *dev, struct v4l2_buffer *buf,
+			  unsigned int sequence, struct save_job *job)
+{
+	unsigned int i;
+
+	job->index = buf->index;
+	job->sequence = sequence;
+	job->offset = -1;
+	job->header = NULL;
+	job->header_size = 0;
+	job->align = dev->direct ? dev->direct_align : 1;
+	job->num_planes = dev->num_planes;
+
+	for (i = 0; i < dev->num_planes; i++) {
+		struct buffer *buffer = &dev->buffers[buf->index];
+		void *data = buffer->staging[i] ? buffer->staging[i] : buffer->mem[i];
+		unsigned int length;
+
+		if (video_is_mplane(dev)) {
+			length = buf->m.planes[i].bytesused;
+
+			/* O_DIRECT requires aligned data, keep the prefix. */
+			if (!dev->write_data_prefix && !dev->direct) {
+				data += buf->m.planes[i].data_offset;
+				length -= buf->m.planes[i].data_offset;
+			}
+
+		} else {
+			length = buf->bytesused;
+		}
+
+		job->data[i] = data;
+		job->length[i] = length;
+	}
+}
+
+/*
+ * Return the number of bytes written for a plane, padded to full blocks for
+ * O_DIRECT.
+ */
+static unsigned int save_job_length(const struct save_job *job, unsigned int plane)
+{
+	return round_up(job->length[plane], job->align);
+}
+
+static unsigned int save_job_size(const struct save_job *job)
+{
+	unsigned int size = 0;
+	unsigned int i;
+
+	for (i = 0; i < job->num_planes; i++)
+		size += save_job_length(job, i);
+
+	return size;
+}
+
+/*
+ * Open the file a frame is saved to. The first '#' character in the pattern
+ * is expanded to the sequence number, otherwise frames are appended to a
+ * single file. The filename buffer must be at least strlen(pattern) + 12 bytes
+ * long.
+ */
+static int save_job_open(const char *pattern, unsigned int sequence,
+			 char *filename, bool *append, int flags)
+{
+	const char *p;
+
+	p = strchr(pattern, '#');
+	if (p != NULL) {
+		sprintf(filename, "%.*s%06u%s", (int)(p - pattern), pattern,
+			sequence, p + 1);
+		*append = false;
+	} else {
+		strcpy(filename, pattern);
+		*append = true;
+	}
+
+	return open(filename, O_CREAT | O_WRONLY | flags | (*append ? O_APPEND : O_TRUNC),
+		    S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+}
+
+/*
+ * Write the planes of a job to fd, at the job offset if positive or at the
+ * current file position otherwise. The job header, if any, is written at the
+ * job offset before the planes.
+ */
+static int save_job_write(const struct save_job *job, int fd)
+{
+	off_t offset = job->offset;
+	unsigned int i;
+	int ret = 0;
+
+	if (job->header && offset >= 0) {
+		ret = pwrite(fd, job->header, job->header_size, offset);
+		if (ret != (int)job->header_size) {
+			print("write error: %s (%d)\n", strerror(errno), errno);
+			return ret < 0 ? -errno : -EIO;
+		}
+		offset += job->header_size;
+	}
+
+	for (i = 0; i < job->num_planes; i++) {
+		unsigned int length = save_job_length(job, i);
+
+		if (offset >= 0) {
+			ret = pwrite(fd, job->data[i], length, offset);
+			offset += length;
+		} else {
+			ret = write(fd, job->data[i], length);
+		}
+
+		if (ret < 0) {
+			print("write error: %s (%d)\n", strerror(errno), errno);
+			return -errno;
+		} else if (ret != (int)length) {
+			print("write error: only %d bytes written instead of %u\n",
+			       ret, length);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Save a frame to its own file, or append it to a single file. The filename
+ * buffer must hold strlen(pattern) + 12 bytes.
+ */
+static int video_save_image(struct device *dev, struct v4l2_buffer *buf,
+			    const char *pattern, char *filename,
+			    unsigned int sequence)
+{
+	struct save_job job;
+	bool append;
+	int ret;
+	int fd;
+
+	fd = save_job_open(pattern, sequence, filename, &append,
+			   dev->direct ? O_DIRECT : 0);
+	if (fd == -1)
+		return -errno;
+
+	save_job_init(dev, buf, sequence, &job);
+	ret = save_job_write(&job, fd);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Report the CPU time spent in write calls. Buffered writes copy frames to
+ * the page cache, compare the figure with a run without --direct to measure
+ * the saving.
+ */
+static void save_report_cpu(struct device *dev, unsigned long long bytes,
+			    uint64_t cpu_ns)
+{
+	double mb = bytes / (1024.0 * 1024.0);
+
+	if (!bytes)
+		return;
+
+	if (cpu_ns)
+		print("Write CPU: %.1f us/MB over %.1f MB (%s I/O)\n",
+			cpu_ns / 1000.0 / mb, mb, dev->direct ? "direct" : "buffered");
+	if (dev->direct)
+		print("Direct I/O: %.1f MB written bypassing the page cache\n", mb);
+}
+
+/*
+ * Single-file recording. Frames are written to fixed-size slots of a
+ * preallocated file, either appended or wrapping around as a ring. Each slot
+ * starts with a frame header followed by the planes. Slots are keyed by the
+ * V4L2 sequence number relative to the first recorded frame, so dropped frames
+ * leave empty slots. Sequence numbers recorded after a source change continue
+ * from the last frame recorded before it, skipping the duration of the
+ * interruption. Recording stops if the source change modifies the format.
+ *
+ * A separate index file ("<file>.idx") starts with a record_index_header and
+ * contains one record_index_entry per slot, written once the frame data has
+ * been written. A frame is looked up in O(1) by sequence number at entry
+ * (sequence - first_sequence) % nslots (nslots being unbounded in append
+ * mode), and by timestamp at sequence first_sequence + (timestamp -
+ * first_timestamp) / frame_period, checking the entry sequence and valid
+ * fields.
+ */
+#define RECORD_FRAME_MAGIC		0x52465659	/* "YVFR" */
+#define RECORD_INDEX_MAGIC		0x58495659	/* "YVIX" */
+#define RECORD_INDEX_VERSION		1
+#define RECORD_INDEX_HEADER_SIZE	256
+#define RECORD_SLOT_ALIGN		4096
+#define RECORD_HEADER_INTERVAL_NS	1000000000ULL
+
+struct record_frame_header
+{
+	uint32_t magic;
+	uint32_t sequence;
+	uint64_t timestamp;
+	uint32_t flags;
+	uint32_t field;
+	uint32_t num_planes;
+	uint32_t bytesused[VIDEO_MAX_PLANES];
+	uint32_t reserved;
+};
+
+struct record_index_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t mode;
+	uint32_t pixelformat;
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_planes;
+	uint32_t bytesperline[VIDEO_MAX_PLANES];
+	uint32_t nslots;
+	uint64_t slot_size;
+	uint32_t header_size;
+	uint32_t first_sequence;
+	uint32_t last_sequence;
+	uint32_t frames;
+	uint64_t first_timestamp;
+	uint64_t frame_period;
+	uint32_t plane_align;
+};
+
+struct record_index_entry
+{
+	uint32_t sequence;
+	uint32_t flags;
+	uint64_t timestamp;
+	uint64_t offset;
+	uint32_t bytesused;
+	uint16_t field;
+	uint16_t valid;
+};
+
+struct recorder
+{
+	struct device *dev;
+	enum record_mode mode;
+	int fd;
+	int index_fd;
+
+	uint64_t size;
+	uint64_t grow;
+	uint64_t end;
+	uint64_t slot_size;
+	unsigned int header_size;
+	unsigned int nslots;
+
+	/* Per-buffer frame headers and index entries */
+	void *headers;
+	struct record_index_entry *entries;
+
+	bool started;
+	uint32_t first_sequence;
+	uint32_t last_sequence;
+	uint64_t first_timestamp;
+	uint64_t last_timestamp;
+	uint64_t header_timestamp;	/* Last index header update */
+	unsigned int frames;
+	unsigned int overwritten;
+	unsigned int rejected;
+
+	/* Format of the recorded frames */
+	uint32_t pixelformat;
+	unsigned int width;
+	unsigned int height;
+	unsigned int num_planes;
+	uint32_t bytesperline[VIDEO_MAX_PLANES];
+	struct v4l2_fract frame_period;
+
+	/* Added to the V4L2 sequence to keep it running across restarts */
+	uint32_t sequence_offset;
+	bool restarted;
+	bool stopped;
+};
+
+static uint64_t timeval_ns(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+/*
+ * Write the index header. It's written in full when the recorder is opened and
+ * closed, and its fields that change while recording are refreshed every
+ * RECORD_HEADER_INTERVAL_NS, so that a recording interrupted by a crash or
+ * power loss can still be looked up.
+ */
+static void recorder_write_header(struct recorder *rec, bool full)
+{
+	struct record_index_header header;
+	struct device *dev = rec->dev;
+	size_t offset = 0;
+	size_t size = sizeof header;
+	unsigned int i;
+
+	memset(&header, 0, sizeof header);
+	header.magic = RECORD_INDEX_MAGIC;
+	header.version = RECORD_INDEX_VERSION;
+	header.mode = rec->mode;
+	header.pixelformat = rec->pixelformat;
+	header.width = rec->width;
+	header.height = rec->height;
+	header.num_planes = rec->num_planes;
+	for (i = 0; i < rec->num_planes; i++)
+		header.bytesperline[i] = rec->bytesperline[i];
+	header.nslots = rec->mode == RECORD_RING ? rec->nslots : 0;
+	header.slot_size = rec->slot_size;
+	header.header_size = rec->header_size;
+	header.first_sequence = rec->first_sequence;
+	header.last_sequence = rec->last_sequence;
+	header.frames = rec->frames;
+	header.first_timestamp = rec->first_timestamp;
+	header.plane_align = dev->direct ? dev->direct_align : 1;
+	if (rec->last_sequence != rec->first_sequence)
+		header.frame_period = (rec->last_timestamp - rec->first_timestamp)
+				    / (rec->last_sequence - rec->first_sequence);
+
+	if (!full) {
+		offset = offsetof(struct record_index_header, first_sequence);
+		size = offsetof(struct record_index_header, plane_align) - offset;
+	}
+
+	if (pwrite(rec->index_fd, (void *)&header + offset, size, offset) != (ssize_t)size)
+		print("Unable to write record index header: %s (%d)\n",
+			strerror(errno), errno);
+}
+
+static void recorder_close(struct recorder *rec)
+{
+	if (rec->index_fd >= 0) {
+		recorder_write_header(rec, true);
+		close(rec->index_fd);
+	}
+
+	if (rec->fd >= 0) {
+		/* Drop the preallocated space past the last appended frame. */
+		if (rec->mode == RECORD_APPEND && rec->started &&
+		    ftruncate(rec->fd, rec->end) < 0)
+			print("Unable to truncate record file: %s (%d)\n",
+				strerror(errno), errno);
+		close(rec->fd);
+	}
+
+	free(rec->headers);
+	free(rec->entries);
+	free(rec);
+}
+
+static struct recorder *recorder_open(struct device *dev, const char *filename,
+				      enum record_mode mode, uint64_t size)
+{
+	struct recorder *rec;
+	uint64_t frame_size = 0;
+	unsigned int align;
+	char *index_name;
+	unsigned int i;
+	int ret;
+
+	rec = calloc(1, sizeof *rec);
+	if (rec == NULL)
+		return NULL;
+
+	rec->dev = dev;
+	rec->mode = mode;
+	rec->fd = -1;
+	rec->index_fd = -1;
+	rec->header_size = sizeof(struct record_frame_header);
+	align = RECORD_SLOT_ALIGN;
+
+	rec->pixelformat = dev->pixelformat;
+	rec->width = dev->width;
+	rec->height = dev->height;
+	rec->num_planes = dev->num_planes;
+	for (i = 0; i < dev->num_planes; i++)
+		rec->bytesperline[i] = dev->plane_fmt[i].bytesperline;
+	rec->frame_period = dev->frame_period;
+
+	/* Keep the planes block-aligned for O_DIRECT. */
+	if (dev->direct) {
+		rec->header_size = round_up(rec->header_size, dev->direct_align);
+		if (dev->direct_align > align)
+			align = dev->direct_align;
+	}
+
+	for (i = 0; i < dev->num_planes; i++)
+		frame_size += dev->buffers[0].size[i];
+
+	rec->slot_size = (rec->header_size + frame_size + align - 1)
+		       / align * align;
+
+	if (mode == RECORD_RING) {
+		if (size < rec->slot_size) {
+			print("Record size %" PRIu64 " too small for one %" PRIu64 " bytes frame\n",
+				size, rec->slot_size);
+			goto error;
+		}
+		rec->nslots = size / rec->slot_size;
+		rec->size = rec->nslots * rec->slot_size;
+
+		/* Frames in flight must not share a slot. */
+		if (rec->nslots < dev->max_bufs) {
+			print("Record size too small, %u slots for %u buffers\n",
+				rec->nslots, dev->max_bufs);
+			goto error;
+		}
+	} else {
+		rec->grow = size > 16 * rec->slot_size ? size : 16 * rec->slot_size;
+		rec->size = rec->grow;
+	}
+
+	if (posix_memalign(&rec->headers, align, dev->max_bufs * rec->header_size))
+		goto error;
+	rec->entries = calloc(dev->max_bufs, sizeof rec->entries[0]);
+	if (rec->entries == NULL)
+		goto error;
+
+	rec->fd = open(filename, O_CREAT | O_RDWR | O_TRUNC |
+		       (dev->direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (rec->fd < 0) {
+		print("Unable to open %s: %s (%d)\n", filename, strerror(errno), errno);
+		goto error;
+	}
+
+	ret = posix_fallocate(rec->fd, 0, rec->size);
+	if (ret) {
+		print("Unable to preallocate %" PRIu64 " bytes for %s: %s (%d)\n",
+			rec->size, filename, strerror(ret), ret);
+		goto error;
+	}
+
+	index_name = malloc(strlen(filename) + 5);
+	if (index_name == NULL)
+		goto error;
+	sprintf(index_name, "%s.idx", filename);
+
+	rec->index_fd = open(index_name, O_CREAT | O_RDWR | O_TRUNC,
+			     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	if (rec->index_fd < 0) {
+		print("Unable to open %s: %s (%d)\n", index_name, strerror(errno), errno);
+		free(index_name);
+		goto error;
+	}
+	free(index_name);
+
+	if (mode == RECORD_RING &&
+	    ftruncate(rec->index_fd, RECORD_INDEX_HEADER_SIZE +
+		      rec->nslots * sizeof(struct record_index_entry)) < 0) {
+		print("Unable to size record index: %s (%d)\n",
+			strerror(errno), errno);
+		goto error;
+	}
+
+	recorder_write_header(rec, true);
+
+	print("Recording to %s (%s, %" PRIu64 " bytes slots, %" PRIu64 " bytes preallocated)\n",
+		filename, mode == RECORD_RING ? "ring" : "append", rec->slot_size,
+		rec->size);
+
+	return rec;
+
+error:
+	recorder_close(rec);
+	return NULL;
+}
+
+/*
+ * Allocate the slot of a frame and fill its header and index entry. The job
+ * offset is set to the start of the slot, where the header is written before
+ * the planes. Called from the processing thread only. Return false if the
+ * frame can't be recorded.
+ */
+static bool recorder_prepare(struct recorder *rec, struct v4l2_buffer *buf,
+			     struct save_job *job)
+{
+	struct record_index_entry *entry = &rec->entries[buf->index];
+	struct record_frame_header *header;
+	uint64_t timestamp = timeval_ns(&buf->timestamp);
+	uint32_t sequence;
+	uint64_t offset;
+	uint32_t rel;
+	unsigned int i;
+
+	if (rec->stopped)
+		return false;
+
+	/*
+	 * The driver restarts the sequence when streaming restarts. Skip the
+	 * slots of the frames that would have been captured in the meantime,
+	 * to keep the lookup by timestamp valid.
+	 */
+	if (rec->restarted) {
+		if (rec->frames) {
+			uint64_t period = rec->frame_period.denominator
+					? 1000000000ULL * rec->frame_period.numerator
+					  / rec->frame_period.denominator : 0;
+			uint32_t gap = 1;
+
+			if (!period && rec->last_sequence != rec->first_sequence)
+				period = (rec->last_timestamp - rec->first_timestamp)
+				       / (rec->last_sequence - rec->first_sequence);
+
+			if (period && timestamp > rec->last_timestamp)
+				gap = (timestamp - rec->last_timestamp + period / 2) / period;
+			if (gap < 1)
+				gap = 1;
+
+			rec->sequence_offset = rec->last_sequence + gap - buf->sequence;
+		}
+		rec->restarted = false;
+	}
+
+	sequence = buf->sequence + rec->sequence_offset;
+
+	/*
+	 * Slots are keyed by sequence number. A frame whose sequence doesn't
+	 * move forward would overwrite an earlier slot, or underflow the slot
+	 * index and grow the file to terabytes.
+	 */
+	if (rec->frames && (int32_t)(sequence - rec->last_sequence) <= 0) {
+		if (!rec->rejected++)
+			print("Recorder: sequence %u after %u, skipping frame\n",
+				sequence, rec->last_sequence);
+		return false;
+	}
+
+	if (!rec->started) {
+		rec->first_sequence = sequence;
+		rec->first_timestamp = timestamp;
+		rec->started = true;
+	}
+
+	rel = sequence - rec->first_sequence;
+	if (rec->mode == RECORD_RING) {
+		if (rel >= rec->nslots)
+			rec->overwritten++;
+		offset = (uint64_t)(rel % rec->nslots) * rec->slot_size;
+	} else {
+		offset = (uint64_t)rel * rec->slot_size;
+	}
+
+	if (offset + rec->slot_size > rec->size) {
+		uint64_t size = offset + rec->slot_size + rec->grow;
+		int ret;
+
+		ret = posix_fallocate(rec->fd, rec->size, size - rec->size);
+		if (ret) {
+			print("Unable to grow record file: %s (%d)\n",
+				strerror(ret), ret);
+			return false;
+		}
+		rec->size = size;
+	}
+
+	if (offset + rec->slot_size > rec->end)
+		rec->end = offset + rec->slot_size;
+
+	header = rec->headers + buf->index * rec->header_size;
+	memset(header, 0, rec->header_size);
+	header->magic = RECORD_FRAME_MAGIC;
+	header->sequence = sequence;
+	header->timestamp = timestamp;
+	header->flags = buf->flags;
+	header->field = buf->field;
+	header->num_planes = job->num_planes;
+	for (i = 0; i < job->num_planes; i++)
+		header->bytesused[i] = job->length[i];
+
+	entry->bytesused = 0;
+	for (i = 0; i < job->num_planes; i++)
+		entry->bytesused += job->length[i];
+
+	job->offset = offset;
+	job->header = header;
+	job->header_size = rec->header_size;
+
+	entry->sequence = sequence;
+	entry->flags = buf->flags;
+	entry->timestamp = timestamp;
+	entry->offset = offset;
+	entry->field = buf->field;
+	entry->valid = 1;
+
+	rec->last_sequence = sequence;
+	rec->last_timestamp = timestamp;
+	rec->frames++;
+
+	if (rec->frames == 1 ||
+	    timestamp - rec->header_timestamp >= RECORD_HEADER_INTERVAL_NS) {
+		recorder_write_header(rec, false);
+		rec->header_timestamp = timestamp;
+	}
+
+	return true;
+}
+
+/* Return the offset of the index entry of a prepared frame. */
+static off_t recorder_entry_offset(struct recorder *rec, unsigned int index)
+{
+	return RECORD_INDEX_HEADER_SIZE + rec->entries[index].offset
+	     / rec->slot_size * sizeof(struct record_index_entry);
+}
+
+/* Write the index entry of a frame once its data has been written. */
+static int recorder_commit(struct recorder *rec, unsigned int index)
+{
+	const struct record_index_entry *entry = &rec->entries[index];
+	off_t offset = recorder_entry_offset(rec, index);
+
+	if (pwrite(rec->index_fd, entry, sizeof *entry, offset) != sizeof *entry) {
+		print("Unable to write record index: %s (%d)\n",
+			strerror(errno), errno);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Called when streaming is restarted, before the first frame of the new stream
+ * is prepared. Frames are described by the index header only, recording stops
+ * if the format or frame rate changed.
+ */
+static void recorder_restart(struct recorder *rec)
+{
+	struct device *dev = rec->dev;
+	bool changed;
+	unsigned int i;
+
+	changed = dev->pixelformat != rec->pixelformat ||
+		  dev->width != rec->width || dev->height != rec->height ||
+		  dev->num_planes != rec->num_planes ||
+		  dev->frame_period.numerator != rec->frame_period.numerator ||
+		  dev->frame_period.denominator != rec->frame_period.denominator;
+	for (i = 0; i < dev->num_planes && !changed; i++)
+		changed = dev->plane_fmt[i].bytesperline != rec->bytesperline[i];
+
+	if (changed && !rec->stopped) {
+		print("Recorder: format changed, recording stopped\n");
+		rec->stopped = true;
+	}
+
+	rec->restarted = true;
+}
+
+static void recorder_report(struct recorder *rec)
+{
+	print("Recorder: %u frames in %" PRIu64 " bytes (%s), sequences %u-%u, %u slots overwritten, %u out of sequence\n",
+		rec->frames, rec->mode == RECORD_RING ? rec->size : rec->end,
+		rec->mode == RECORD_RING ? "ring" : "append",
+		rec->first_sequence, rec->last_sequence, rec->overwritten,
+		rec->rejected);
+	if (rec->stopped)
+		print("Recorder: stopped on a format change\n");
+}
+
+/* Save a frame synchronously to the record file. */
+static int recorder_save(struct recorder *rec, struct v4l2_buffer *buf,
+			 unsigned int sequence)
+{
+	struct save_job job;
+	int ret;
+
+	save_job_init(rec->dev, buf, sequence, &job);
+	if (!recorder_prepare(rec, buf, &job))
+		return -ENOSPC;
+
+	ret = save_job_write(&job, rec->fd);
+	if (ret < 0)
+		return ret;
+
+	return recorder_commit(rec, buf->index);
+}
+
+/*
+ * Asynchronous writer pool. Jobs are queued by the processing thread in a
+ * bounded FIFO and written by a pool of threads, each holding a reference to
+ * its V4L2 buffer until the data has been written. When all frames go to the
+ * same file they are written with pwrite() at offsets allocated when
+ * queueing, so that frames stay in order regardless of the thread they are
+ * written by.
+ */
+struct writer;
+
+struct writer_thread
+{
+	struct writer *writer;
+	pthread_t thread;
+	char *filename;
+	struct histogram latency;
+	unsigned long long bytes;
+	uint64_t cpu_ns;
+	uint64_t thread_cpu_ns;
+	unsigned int errors;
+};
+
+struct writer
+{
+	struct device *dev;
+	const char *pattern;
+	struct recorder *rec;
+	int fd;
+	off_t offset;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct save_job *jobs;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int count;
+	unsigned int max_count;
+	unsigned int dropped;
+	bool quit;
+
+	struct writer_thread *threads;
+	unsigned int nthreads;
+};
+
+static int writer_save(struct writer_thread *thread, struct save_job *job)
+{
+	struct writer *writer = thread->writer;
+	bool append;
+	int ret;
+	int fd;
+
+	if (writer->fd >= 0)
+		return save_job_write(job, writer->fd);
+
+	fd = save_job_open(writer->pattern, job->sequence, thread->filename,
+			   &append, writer->dev->direct ? O_DIRECT : 0);
+	if (fd == -1) {
+		print("Unable to open %s: %s (%d)\n", thread->filename,
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = save_job_write(job, fd);
+	close(fd);
+
+	return ret;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer_thread *thread = arg;
+	struct writer *writer = thread->writer;
+	struct device *dev = writer->dev;
+	struct save_job job;
+	uint64_t start;
+	uint64_t cpu;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&writer->lock);
+		while (!writer->count && !writer->quit)
+			pthread_cond_wait(&writer->cond, &writer->lock);
+
+		if (!writer->count) {
+			pthread_mutex_unlock(&writer->lock);
+			break;
+		}
+
+		job = writer->jobs[writer->head];
+		writer->head = (writer->head + 1) % writer->depth;
+		writer->count--;
+		pthread_mutex_unlock(&writer->lock);
+
+		start = clock_ns(CLOCK_MONOTONIC);
+		cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		ret = writer_save(thread, &job);
+		thread->cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+		histogram_record(&thread->latency, clock_ns(CLOCK_MONOTONIC) - start);
+
+		if (ret < 0)
+			thread->errors++;
+		else
+			thread->bytes += save_job_size(&job);
+
+		if (ret == 0 && writer->rec)
+			recorder_commit(writer->rec, job.index);
+
+		video_buffer_put(dev, &dev->buffers[job.index]);
+	}
+
+	thread->thread_cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	return NULL;
+}
+
+/* Wait for all queued jobs to complete and stop the writer threads. */
+static void writer_stop(struct writer *writer)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&writer->lock);
+	if (writer->quit) {
+		pthread_mutex_unlock(&writer->lock);
+		return;
+	}
+	writer->quit = true;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+
+	for (i = 0; i < writer->nthreads; ++i)
+		pthread_join(writer->threads[i].thread, NULL);
+}
+
+static void writer_destroy(struct writer *writer)
+{
+	unsigned int i;
+
+	writer_stop(writer);
+
+	for (i = 0; i < writer->nthreads; ++i)
+		free(writer->threads[i].filename);
+
+	if (writer->fd >= 0 && !writer->rec)
+		close(writer->fd);
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->threads);
+	free(writer->jobs);
+	free(writer);
+}
+
+static struct writer *writer_create(struct device *dev, const char *pattern,
+				    struct recorder *rec, unsigned int nthreads,
+				    unsigned int depth)
+{
+	struct writer *writer;
+	unsigned int i;
+	int ret;
+
+	writer = calloc(1, sizeof *writer);
+	if (writer == NULL)
+		return NULL;
+
+	writer->dev = dev;
+	writer->pattern = pattern;
+	writer->rec = rec;
+	writer->depth = depth;
+	writer->fd = -1;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+
+	writer->jobs = calloc(depth, sizeof writer->jobs[0]);
+	writer->threads = calloc(nthreads, sizeof writer->threads[0]);
+	if (writer->jobs == NULL || writer->threads == NULL)
+		goto error;
+
+	/* Frames appended to a single file share one file descriptor. */
+	if (rec) {
+		writer->fd = rec->fd;
+	} else if (strchr(pattern, '#') == NULL) {
+		writer->fd = open(pattern, O_CREAT | O_WRONLY |
+				  (dev->direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (writer->fd < 0) {
+			print("Unable to open %s: %s (%d)\n", pattern,
+				strerror(errno), errno);
+			goto error;
+		}
+
+		writer->offset = lseek(writer->fd, 0, SEEK_END);
+	}
+
+	for (i = 0; i < nthreads; ++i) {
+		struct writer_thread *thread = &writer->threads[i];
+
+		thread->writer = writer;
+		histogram_init(&thread->latency);
+		thread->filename = malloc(strlen(pattern) + 12);
+		if (thread->filename == NULL)
+			goto error;
+
+		ret = pthread_create(&thread->thread, NULL, writer_thread, thread);
+		if (ret) {
+			print("Unable to create writer thread: %s (%d).\n",
+				strerror(ret), ret);
+			free(thread->filename);
+			goto error;
+		}
+
+		writer->nthreads++;
+	}
+
+	return writer;
+
+error:
+	writer_destroy(writer);
+	return NULL;
+}
+
+/*
+ * Queue a buffer for writing. Return false if the queue is full, in which case
+ * the frame isn't saved.
+ */
+static bool writer_queue(struct writer *writer, struct v4l2_buffer *buf,
+			 unsigned int sequence)
+{
+	struct device *dev = writer->dev;
+	struct save_job *job;
+
+	pthread_mutex_lock(&writer->lock);
+
+	if (writer->count == writer->depth) {
+		writer->dropped++;
+		pthread_mutex_unlock(&writer->lock);
+		return false;
+	}
+
+	job = &writer->jobs[(writer->head + writer->count) % writer->depth];
+	save_job_init(dev, buf, sequence, job);
+
+	if (writer->rec) {
+		if (!recorder_prepare(writer->rec, buf, job)) {
+			pthread_mutex_unlock(&writer->lock);
+			return false;
+		}
+	} else if (writer->fd >= 0) {
+		job->offset = writer->offset;
+		writer->offset += save_job_size(job);
+	}
+
+	video_buffer_get(&dev->buffers[buf->index]);
+
+	if (++writer->count > writer->max_count)
+		writer->max_count = writer->count;
+
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+
+	return true;
+}
+
+/* Return the total CPU time of the writer threads, once stopped. */
+static uint64_t writer_cpu(struct writer *writer)
+{
+	uint64_t cpu_ns = 0;
+	unsigned int i;
+
+	for (i = 0; i < writer->nthreads; ++i)
+		cpu_ns += writer->threads[i].thread_cpu_ns;
+
+	return cpu_ns;
+}
+
+static void writer_report(struct writer *writer)
+{
+	unsigned long long bytes = 0;
+	unsigned int errors = 0;
+	struct histogram latency;
+	uint64_t cpu_ns = 0;
+	unsigned int i;
+
+	histogram_init(&latency);
+
+	for (i = 0; i < writer->nthreads; ++i) {
+		histogram_merge(&latency, &writer->threads[i].latency);
+		bytes += writer->threads[i].bytes;
+		cpu_ns += writer->threads[i].cpu_ns;
+		errors += writer->threads[i].errors;
+	}
+
+	print("Writer: %u threads, %llu bytes written, queue high-water %u of %u, %u frames dropped (queue full), %u errors\n",
+		writer->nthreads, bytes, writer->max_count, writer->depth,
+		writer->dropped, errors);
+	histogram_print(&latency, "Write latency");
+	save_report_cpu(writer->dev, bytes, cpu_ns);
+}
+
+/*
+ * io_uring writer backend. Plane writes are submitted by the processing
+ * thread straight from the V4L2 buffers, registered with the ring when
+ * possible, and completions are reaped in batches by the capture event loop
+ * through an eventfd. liburing isn't required, the ring is set up with raw
+ * system calls.
+ */
+#ifdef HAVE_IO_URING
+
+struct uring_job
+{
+	int fd;
+	atomic_uint pending;		/* Writes not completed yet */
+	atomic_int error;
+	unsigned int bytes;
+	uint64_t submit_ns;
+	/* The last entries hold the frame header and index entry, if any. */
+	unsigned int length[VIDEO_MAX_PLANES + 2];
+	struct iovec iov[VIDEO_MAX_PLANES + 2];
+};
+
+struct uring_writer
+{
+	struct device *dev;
+	const char *pattern;
+	struct recorder *rec;
+	char *filename;
+	int fd;
+	off_t offset;
+
+	int ring_fd;
+	int event_fd;
+	unsigned int fixed_buffers;	/* Number of registered buffers */
+	bool fixed_file;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_job *jobs;
+	atomic_uint inflight;
+
+	struct histogram latency;
+	unsigned long long bytes;
+	atomic_uint errors;
+	unsigned int submits;
+	unsigned int reaps;
+	unsigned int completions;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+				 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_writer_destroy(struct uring_writer *uw)
+{
+	if (uw->sqes)
+		munmap(uw->sqes, uw->sqes_size);
+	if (uw->cq_ptr && uw->cq_ptr != uw->sq_ptr)
+		munmap(uw->cq_ptr, uw->cq_size);
+	if (uw->sq_ptr)
+		munmap(uw->sq_ptr, uw->sq_size);
+	if (uw->ring_fd >= 0)
+		close(uw->ring_fd);
+	if (uw->event_fd >= 0)
+		close(uw->event_fd);
+	if (uw->fd >= 0 && !uw->rec)
+		close(uw->fd);
+
+	free(uw->jobs);
+	free(uw->filename);
+	free(uw);
+}
+
+static int uring_writer_map(struct uring_writer *uw, struct io_uring_params *p)
+{
+	uw->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	uw->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uw->cq_size > uw->sq_size)
+			uw->sq_size = uw->cq_size;
+		uw->cq_size = uw->sq_size;
+	}
+
+	uw->sq_ptr = mmap(NULL, uw->sq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (uw->sq_ptr == MAP_FAILED) {
+		uw->sq_ptr = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		uw->cq_ptr = uw->sq_ptr;
+	} else {
+		uw->cq_ptr = mmap(NULL, uw->cq_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (uw->cq_ptr == MAP_FAILED) {
+			uw->cq_ptr = NULL;
+			return -errno;
+		}
+	}
+
+	uw->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	uw->sqes = mmap(NULL, uw->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uw->ring_fd,
+			IORING_OFF_SQES);
+	if (uw->sqes == MAP_FAILED) {
+		uw->sqes = NULL;
+		return -errno;
+	}
+
+	uw->sq_tail = uw->sq_ptr + p->sq_off.tail;
+	uw->sq_mask = uw->sq_ptr + p->sq_off.ring_mask;
+	uw->sq_array = uw->sq_ptr + p->sq_off.array;
+	uw->cq_head = uw->cq_ptr + p->cq_off.head;
+	uw->cq_tail = uw->cq_ptr + p->cq_off.tail;
+	uw->cq_mask = uw->cq_ptr + p->cq_off.ring_mask;
+	uw->cqes = uw->cq_ptr + p->cq_off.cqes;
+
+	return 0;
+}
+
+/*
+ * Register all planes of all buffers, indexed by buffer * num_planes + plane.
+ * Any previous registration is dropped, as buffers may have been reallocated.
+ */
+static void uring_writer_register_buffers(struct uring_writer *uw)
+{
+	struct device *dev = uw->dev;
+	unsigned int count = dev->nbufs * dev->num_planes;
+	struct iovec *iov;
+	unsigned int i;
+	int ret;
+
+	if (uw->fixed_buffers) {
+		sys_io_uring_register(uw->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		uw->fixed_buffers = 0;
+	}
+
+	iov = calloc(count, sizeof *iov);
+	if (iov == NULL)
+		return;
+
+	for (i = 0; i < count; ++i) {
+		struct buffer *buffer = &dev->buffers[i / dev->num_planes];
+
+		/* Registration pins the pages, map them all upfront. */
+		if (video_buffer_map(dev, buffer) < 0) {
+			free(iov);
+			return;
+		}
+
+		iov[i].iov_base = buffer->staging[i % dev->num_planes]
+				? buffer->staging[i % dev->num_planes]
+				: buffer->mem[i % dev->num_planes];
+		iov[i].iov_len = buffer->size[i % dev->num_planes];
+	}
+
+	ret = sys_io_uring_register(uw->ring_fd, IORING_REGISTER_BUFFERS, iov, count);
+	if (ret < 0)
+		print("io_uring: unable to register buffers (%s), using unregistered writes\n",
+			strerror(errno));
+	else
+		uw->fixed_buffers = dev->nbufs;
+
+	free(iov);
+}
+
+static struct uring_writer *uring_writer_create(struct device *dev,
+						const char *pattern,
+						struct recorder *rec)
+{
+	struct io_uring_params params;
+	struct uring_writer *uw;
+	unsigned int i;
+	int ret;
+
+	uw = calloc(1, sizeof *uw);
+	if (uw == NULL)
+		return NULL;
+
+	uw->dev = dev;
+	uw->pattern = pattern;
+	uw->rec = rec;
+	uw->fd = -1;
+	uw->ring_fd = -1;
+	uw->event_fd = -1;
+	atomic_init(&uw->inflight, 0);
+	atomic_init(&uw->errors, 0);
+	histogram_init(&uw->latency);
+
+	uw->jobs = calloc(dev->max_bufs, sizeof uw->jobs[0]);
+	uw->filename = malloc(strlen(pattern) + 12);
+	if (uw->jobs == NULL || uw->filename == NULL)
+		goto error;
+
+	for (i = 0; i < dev->max_bufs; ++i)
+		uw->jobs[i].fd = -1;
+
+	/*
+	 * Each buffer has at most one write per plane in flight, plus one for
+	 * the frame header and one for the index entry when recording.
+	 */
+	memset(&params, 0, sizeof params);
+	uw->ring_fd = sys_io_uring_setup(dev->max_bufs * (dev->num_planes + 2), &params);
+	if (uw->ring_fd < 0) {
+		print("io_uring: setup failed: %s (%d)\n", strerror(errno), errno);
+		goto error;
+	}
+
+	ret = uring_writer_map(uw, &params);
+	if (ret < 0) {
+		print("io_uring: unable to map rings: %s (%d)\n", strerror(-ret), -ret);
+		goto error;
+	}
+
+	uw->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uw->event_fd < 0)
+		goto error;
+
+	ret = sys_io_uring_register(uw->ring_fd, IORING_REGISTER_EVENTFD,
+				    &uw->event_fd, 1);
+	if (ret < 0) {
+		print("io_uring: unable to register eventfd: %s (%d)\n",
+			strerror(errno), errno);
+		goto error;
+	}
+
+	uring_writer_register_buffers(uw);
+
+	/* Frames appended to a single file use a registered file. */
+	if (rec || strchr(pattern, '#') == NULL) {
+		if (rec) {
+			uw->fd = rec->fd;
+		} else {
+			uw->fd = open(pattern, O_CREAT | O_WRONLY |
+				      (dev->direct ? O_DIRECT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			if (uw->fd < 0) {
+				print("Unable to open %s: %s (%d)\n", pattern,
+					strerror(errno), errno);
+				goto error;
+			}
+
+			uw->offset = lseek(uw->fd, 0, SEEK_END);
+		}
+
+		ret = sys_io_uring_register(uw->ring_fd, IORING_REGISTER_FILES,
+					    &uw->fd, 1);
+		uw->fixed_file = ret >= 0;
+	}
+
+	print("io_uring: %u entries, %s buffers, %s file\n", params.sq_entries,
+		uw->fixed_buffers ? "registered" : "unregistered",
+		uw->fixed_file ? "registered" : "unregistered");
+
+	return uw;
+
+error:
+	uring_writer_destroy(uw);
+	return NULL;
+}
+
+/*
+ * Release a job once all its writes have completed or been dropped. Called
+ * from the capture thread, or from the processing thread when a submission
+ * fails.
+ */
+static void uring_writer_finish(struct uring_writer *uw, unsigned int index)
+{
+	struct device *dev = uw->dev;
+	struct uring_job *job = &uw->jobs[index];
+	int error = atomic_load(&job->error);
+
+	if (error) {
+		print("io_uring: write error: %s (%d)\n", strerror(-error), -error);
+		atomic_fetch_add(&uw->errors, 1);
+	} else {
+		/* Jobs without errors are only finished by the capture thread. */
+		uw->bytes += job->bytes;
+	}
+
+	if (job->fd >= 0) {
+		close(job->fd);
+		job->fd = -1;
+	}
+
+	atomic_fetch_sub(&uw->inflight, 1);
+	video_buffer_put(dev, &dev->buffers[index]);
+}
+
+/*
+ * Submit the planes of a buffer. Return false if the frame can't be saved, in
+ * which case no reference to the buffer is held.
+ */
+static bool uring_writer_queue(struct uring_writer *uw, struct v4l2_buffer *buf,
+			       unsigned int sequence)
+{
+	struct device *dev = uw->dev;
+	struct uring_job *job = &uw->jobs[buf->index];
+	struct save_job save;
+	unsigned int submitted;
+	unsigned int link;
+	unsigned int count;
+	unsigned int tail;
+	unsigned int mask;
+	off_t offset;
+	unsigned int i;
+	int ret;
+
+	save_job_init(dev, buf, sequence, &save);
+
+	if (uw->rec) {
+		if (!recorder_prepare(uw->rec, buf, &save))
+			return false;
+		offset = save.offset + save.header_size;
+		job->fd = -1;
+	} else if (uw->fd >= 0) {
+		offset = uw->offset;
+		uw->offset += save_job_size(&save);
+		job->fd = -1;
+	} else {
+		bool append;
+
+		job->fd = save_job_open(uw->pattern, sequence, uw->filename,
+					&append, dev->direct ? O_DIRECT : 0);
+		if (job->fd < 0) {
+			print("Unable to open %s: %s (%d)\n", uw->filename,
+				strerror(errno), errno);
+			return false;
+		}
+		offset = 0;
+	}
+
+	/*
+	 * When recording, the index entry is written by a last SQE linked to
+	 * the frame writes. It only runs once they have all succeeded.
+	 */
+	link = uw->rec ? IOSQE_IO_LINK : 0;
+	count = save.num_planes + (save.header ? 1 : 0) + (uw->rec ? 1 : 0);
+	atomic_store(&job->pending, count);
+	atomic_store(&job->error, 0);
+	job->bytes = save_job_size(&save);
+	job->submit_ns = clock_ns(CLOCK_MONOTONIC);
+
+	video_buffer_get(&dev->buffers[buf->index]);
+	atomic_fetch_add(&uw->inflight, 1);
+
+	tail = *uw->sq_tail;
+	mask = *uw->sq_mask;
+
+	for (i = 0; i < save.num_planes; i++) {
+		struct io_uring_sqe *sqe = &uw->sqes[tail & mask];
+
+		memset(sqe, 0, sizeof *sqe);
+
+		if (uw->fd >= 0 && uw->fixed_file) {
+			sqe->fd = 0;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = uw->fd >= 0 ? uw->fd : job->fd;
+		}
+		sqe->flags |= link;
+
+		job->length[i] = save_job_length(&save, i);
+
+		/* Buffers added when growing the pool aren't registered. */
+		if (buf->index < uw->fixed_buffers) {
+			sqe->opcode = IORING_OP_WRITE_FIXED;
+			sqe->addr = (unsigned long)save.data[i];
+			sqe->len = job->length[i];
+			sqe->buf_index = buf->index * dev->num_planes + i;
+		} else {
+			job->iov[i].iov_base = save.data[i];
+			job->iov[i].iov_len = job->length[i];
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->addr = (unsigned long)&job->iov[i];
+			sqe->len = 1;
+		}
+
+		sqe->off = offset;
+		sqe->user_data = (buf->index << 8) | i;
+		offset += job->length[i];
+
+		uw->sq_array[tail & mask] = tail & mask;
+		tail++;
+	}
+
+	/* The frame header isn't in a registered buffer. */
+	if (save.header) {
+		struct io_uring_sqe *sqe = &uw->sqes[tail & mask];
+
+		memset(sqe, 0, sizeof *sqe);
+		if (uw->fixed_file) {
+			sqe->fd = 0;
+			sqe->flags = IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = uw->fd;
+		}
+		sqe->flags |= link;
+
+		job->iov[i].iov_base = save.header;
+		job->iov[i].iov_len = save.header_size;
+		job->length[i] = save.header_size;
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (unsigned long)&job->iov[i];
+		sqe->len = 1;
+		sqe->off = save.offset;
+		sqe->user_data = (buf->index << 8) | i;
+
+		uw->sq_array[tail & mask] = tail & mask;
+		tail++;
+		i++;
+	}
+
+	if (uw->rec) {
+		struct io_uring_sqe *sqe = &uw->sqes[tail & mask];
+
+		memset(sqe, 0, sizeof *sqe);
+		sqe->fd = uw->rec->index_fd;
+
+		job->iov[i].iov_base = &uw->rec->entries[buf->index];
+		job->iov[i].iov_len = sizeof(struct record_index_entry);
+		job->length[i] = sizeof(struct record_index_entry);
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (unsigned long)&job->iov[i];
+		sqe->len = 1;
+		sqe->off = recorder_entry_offset(uw->rec, buf->index);
+		sqe->user_data = (buf->index << 8) | i;
+
+		uw->sq_array[tail & mask] = tail & mask;
+		tail++;
+	}
+
+	__atomic_store_n(uw->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = 0;
+	while (submitted < count) {
+		ret = sys_io_uring_enter(uw->ring_fd, count - submitted, 0, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		submitted += ret;
+	}
+	uw->submits++;
+
+	if (submitted == count)
+		return true;
+
+	print("io_uring: submitted %u of %u writes: %s (%d)\n", submitted,
+		count, ret < 0 ? strerror(errno) : "ring full", ret < 0 ? errno : 0);
+
+	/*
+	 * The kernel hasn't consumed the remaining SQEs, drop them from the
+	 * ring. The writes that have been submitted may already have been
+	 * reaped, the job is finished by whichever thread drops the last
+	 * pending write.
+	 */
+	__atomic_store_n(uw->sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+	atomic_store(&job->error, -EIO);
+
+	if (atomic_fetch_sub(&job->pending, count - submitted) == count - submitted)
+		uring_writer_finish(uw, buf->index);
+
+	return submitted != 0;
+}
+
+/* Reap all available completions. Called from the capture thread. */
+static int uring_writer_reap(struct uring_writer *uw)
+{
+	unsigned int head = *uw->cq_head;
+	unsigned int tail = __atomic_load_n(uw->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int mask = *uw->cq_mask;
+	unsigned int count = 0;
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uw->cqes[head & mask];
+		unsigned int index = cqe->user_data >> 8;
+		unsigned int plane = cqe->user_data & 0xff;
+		struct uring_job *job = &uw->jobs[index];
+
+		if (cqe->res < 0)
+			atomic_store(&job->error, cqe->res);
+		else if ((unsigned int)cqe->res != job->length[plane])
+			atomic_store(&job->error, -EIO);
+
+		head++;
+		count++;
+
+		if (atomic_fetch_sub(&job->pending, 1) != 1)
+			continue;
+
+		histogram_record(&uw->latency,
+				 clock_ns(CLOCK_MONOTONIC) - job->submit_ns);
+		uw->completions++;
+		uring_writer_finish(uw, index);
+	}
+
+	__atomic_store_n(uw->cq_head, head, __ATOMIC_RELEASE);
+
+	if (count)
+		uw->reaps++;
+
+	return count;
+}
+
+/*
+ * Wait for all submitted writes to complete. Called once the capture thread
+ * has stopped reaping completions.
+ */
+static void uring_writer_stop(struct uring_writer *uw)
+{
+	while (atomic_load(&uw->inflight)) {
+		if (!uring_writer_reap(uw))
+			sys_io_uring_enter(uw->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+	}
+}
+
+static void uring_writer_report(struct uring_writer *uw)
+{
+	print("io_uring writer: %llu bytes written, %u frames in %u reaps (%.2f frames/reap), %u errors\n",
+		uw->bytes, uw->completions, uw->reaps,
+		uw->reaps ? (double)uw->completions / uw->reaps : 0.0,
+		atomic_load(&uw->errors));
+	histogram_print(&uw->latency, "Write latency");
+	save_report_cpu(uw->dev, uw->bytes, 0);
+}
+
+#else
+
+struct uring_writer
+{
+	int event_fd;
+};
+
+static struct uring_writer *uring_writer_create(struct device *dev,
+						const char *pattern,
+						struct recorder *rec)
+{
+	(void)dev;
+	(void)pattern;
+	(void)rec;
+
+	print("io_uring: not supported by this build\n");
+	return NULL;
+}
+
+static bool uring_writer_queue(struct uring_writer *uw, struct v4l2_buffer *buf,
+			       unsigned int sequence)
+{
+	(void)uw;
+	(void)buf;
+	(void)sequence;
+
+	return false;
+}
+
+static int uring_writer_reap(struct uring_writer *uw)
+{
+	(void)uw;
+
+	return 0;
+}
+
+static void uring_writer_stop(struct uring_writer *uw) { (void)uw; }
+static void uring_writer_report(struct uring_writer *uw) { (void)uw; }
+static void uring_writer_destroy(struct uring_writer *uw) { (void)uw; }
+
+#endif /* HAVE_IO_URING */
+
+unsigned int video_buffer_bytes_used(struct device *dev, struct v4l2_buffer *buf)
+{
+	unsigned int bytesused = 0;
+	unsigned int i;
+
+	if (!video_is_mplane(dev))
+		return buf->bytesused;
+
+	for (i = 0; i < dev->num_planes; i++)
+		bytesused += buf->m.planes[i].bytesused;
+
+	return bytesused;
+}
+
+/*
+ * Event loop. Sources are registered once with epoll in edge-triggered mode,
+ * handlers must thus drain their fd completely before returning. A handler
+ * returns a negative error code to stop the loop, 0 if it had nothing to do
+ * and a positive value otherwise, which is used to account for spurious
+ * wakeups.
+ */
+struct event_source;
+
+typedef int (*event_handler_t)(struct event_source *source, uint32_t events);
+
+struct event_source
+{
+	int fd;
+	uint32_t events;
+	event_handler_t handler;
+	void *priv;
+};
+
+#define EVENT_LOOP_MAX_EVENTS	8
+
+struct event_loop
+{
+	int epfd;
+
+	unsigned long long wakeups;
+	unsigned long long events;
+	unsigned long long spurious;
+	uint64_t wait_ns;
+	uint64_t busy_ns;
+	uint64_t cpu_start_ns;
+};
+
+static int event_loop_init(struct event_loop *loop)
+{
+	memset(loop, 0, sizeof *loop);
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		print("Unable to create epoll instance: %s (%d).\n",
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	loop->cpu_start_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	return 0;
+}
+
+static void event_loop_cleanup(struct event_loop *loop)
+{
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	loop->epfd = -1;
+}
+
+static int event_loop_add(struct event_loop *loop, struct event_source *source)
+{
+	struct epoll_event ev;
+	int ret;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = source->events | EPOLLET;
+	ev.data.ptr = source;
+
+	ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, source->fd, &ev);
+	if (ret < 0) {
+		print("Unable to add fd %d to event loop: %s (%d).\n",
+			source->fd, strerror(errno), errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int event_loop_dispatch(struct event_loop *loop, int timeout)
+{
+	struct epoll_event evs[EVENT_LOOP_MAX_EVENTS];
+	uint64_t before, after;
+	int work = 0;
+	int ret = 0;
+	int nevents;
+	int i;
+
+	before = clock_ns(CLOCK_MONOTONIC);
+	nevents = epoll_wait(loop->epfd, evs, ARRAY_SIZE(evs), timeout);
+	after = clock_ns(CLOCK_MONOTONIC);
+	loop->wait_ns += after - before;
+
+	if (nevents < 0) {
+		if (errno == EINTR)
+			return 0;
+		print("epoll_wait failed: %s (%d).\n", strerror(errno), errno);
+		return -errno;
+	}
+
+	loop->wakeups++;
+	loop->events += nevents;
+
+	for (i = 0; i < nevents; ++i) {
+		struct event_source *source = evs[i].data.ptr;
+
+		ret = source->handler(source, evs[i].events);
+		if (ret < 0)
+			break;
+		work += ret;
+	}
+
+	if (!work)
+		loop->spurious++;
+
+	loop->busy_ns += clock_ns(CLOCK_MONOTONIC) - after;
+
+	return ret < 0 ? ret : 0;
+}
+
+static void event_loop_report(struct event_loop *loop, unsigned int frames)
+{
+	uint64_t cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - loop->cpu_start_ns;
+
+	if (!loop->wakeups)
+		return;
+
+	print("Event loop: %llu wakeups (%llu spurious), %llu events, %.2f frames/wakeup\n",
+		loop->wakeups, loop->spurious, loop->events,
+		(double)frames / loop->wakeups);
+	print("Event loop: %.1f us busy, %.1f us waiting per wakeup, %.1f us CPU per frame\n",
+		loop->busy_ns / 1000.0 / loop->wakeups,
+		loop->wait_ns / 1000.0 / loop->wakeups,
+		frames ? cpu_ns / 1000.0 / frames : 0.0);
+}
+
+static int event_timer_init(struct event_source *source, uint64_t interval_ns,
+			    event_handler_t handler, void *priv)
+{
+	struct itimerspec its;
+	int ret;
+
+	source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (source->fd < 0) {
+		print("Unable to create timer: %s (%d).\n", strerror(errno),
+			errno);
+		return -errno;
+	}
+
+	its.it_interval.tv_sec = interval_ns / 1000000000ULL;
+	its.it_interval.tv_nsec = interval_ns % 1000000000ULL;
+	its.it_value = its.it_interval;
+
+	ret = timerfd_settime(source->fd, 0, &its, NULL);
+	if (ret < 0) {
+		print("Unable to arm timer: %s (%d).\n", strerror(errno),
+			errno);
+		close(source->fd);
+		source->fd = -1;
+		return -errno;
+	}
+
+	source->events = EPOLLIN;
+	source->handler = handler;
+	source->priv = priv;
+
+	return 0;
+}
+
+/* Arm a timer to expire once at an absolute CLOCK_MONOTONIC time. */
+static int event_timer_set(struct event_source *source, uint64_t expiry_ns)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = expiry_ns / 1000000000ULL;
+	its.it_value.tv_nsec = expiry_ns % 1000000000ULL;
+
+	if (timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		print("Unable to arm timer: %s (%d).\n", strerror(errno),
+			errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Return the number of timer expirations since the last call. */
+static uint64_t event_timer_read(struct event_source *source)
+{
+	uint64_t expirations;
+
+	if (read(source->fd, &expirations, sizeof expirations) != sizeof expirations)
+		return 0;
+
+	return expirations;
+}
+
+#define CAPTURE_TIMEOUT_NS	(10 * 1000000000ULL)
+#define STARVATION_DELAY_NS	(100 * 1000000ULL)
+
+/*
+ * Buffer descriptor handed from the capture thread to the processing thread.
+ * The v4l2_buffer m.planes pointer refers to the descriptor's own planes
+ * array.
+ */
+struct buffer_desc
+{
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	uint64_t dequeued;
+};
+
+/*
+ * Lock-free single-producer/single-consumer ring. The head is only written by
+ * the producer and the tail only by the consumer, each on its own cache line.
+ */
+struct buffer_ring
+{
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	_Alignas(64) unsigned int size;
+	unsigned int high_water;
+	struct buffer_desc *slots;
+
+	/* Consumer wakeup */
+	int fd;
+	atomic_bool waiting;
+};
+
+static int buffer_ring_init(struct buffer_ring *ring, unsigned int count)
+{
+	unsigned int size = 1;
+
+	while (size < count)
+		size <<= 1;
+
+	ring->slots = calloc(size, sizeof ring->slots[0]);
+	if (ring->slots == NULL)
+		return -ENOMEM;
+
+	ring->fd = eventfd(0, EFD_CLOEXEC);
+	if (ring->fd < 0) {
+		free(ring->slots);
+		ring->slots = NULL;
+		return -errno;
+	}
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, false);
+	ring->size = size;
+	ring->high_water = 0;
+
+	return 0;
+}
+
+static void buffer_ring_cleanup(struct buffer_ring *ring)
+{
+	if (ring->slots == NULL)
+		return;
+
+	close(ring->fd);
+	free(ring->slots);
+	ring->slots = NULL;
+}
+
+static void buffer_ring_notify(struct buffer_ring *ring)
+{
+	eventfd_signal(ring->fd);
+}
+
+static void buffer_ring_wake(struct buffer_ring *ring)
+{
+	/* Pairs with the fence in buffer_ring_wait(). */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load_explicit(&ring->waiting, memory_order_relaxed))
+		buffer_ring_notify(ring);
+}
+
+/* Producer side. Return false if the ring is full. */
+static bool buffer_ring_push(struct buffer_ring *ring, const struct v4l2_buffer *buf,
+			     uint64_t dequeued)
+{
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	struct buffer_desc *desc;
+
+	if (head - tail == ring->size)
+		return false;
+
+	desc = &ring->slots[head & (ring->size - 1)];
+	desc->buf = *buf;
+	memcpy(desc->planes, buf->m.planes, sizeof desc->planes);
+	desc->buf.m.planes = desc->planes;
+	desc->dequeued = dequeued;
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	if (head + 1 - tail > ring->high_water)
+		ring->high_water = head + 1 - tail;
+
+	buffer_ring_wake(ring);
+	return true;
+}
+
+/*
+ * Consumer side. Return the oldest descriptor without removing it from the
+ * ring, or NULL if the ring is empty. The descriptor stays valid until
+ * buffer_ring_pop() is called.
+ */
+static struct buffer_desc *buffer_ring_peek(struct buffer_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	return &ring->slots[tail & (ring->size - 1)];
+}
+
+static void buffer_ring_pop(struct buffer_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Block the consumer until the producer pushes a descriptor. */
+static void buffer_ring_wait(struct buffer_ring *ring)
+{
+	atomic_store_explicit(&ring->waiting, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (buffer_ring_peek(ring) == NULL)
+		eventfd_clear(ring->fd);
+	atomic_store_explicit(&ring->waiting, false, memory_order_relaxed);
+}
+
+/*
+ * Per-frame statistics. The processing thread records a fixed-size binary
+ * record per frame in a lock-free ring, and a reporter thread drains the ring
+ * periodically to print interval summaries and, optionally, per-frame lines.
+ * Records are dropped and counted if the reporter falls behind.
+ */
+#define STATS_RING_SIZE		4096
+
+/*
+ * Frame drop causes. Driver gaps are detected from sequence numbers, or from
+ * timestamps and the nominal frame period when the driver doesn't set the
+ * sequence. Pool starvation covers frames dequeued but not processed because
+ * a downstream pool or the processing ring was empty, and writer backpressure
+ * frames not saved because the writer queue was full.
+ */
+enum drop_cause
+{
+	DROP_NONE = -1,
+	DROP_DRIVER_GAP = 0,
+	DROP_ERROR,
+	DROP_POOL_STARVATION,
+	DROP_WRITER_BACKPRESSURE,
+	DROP_CAUSES,
+};
+
+struct frame_stats
+{
+	uint32_t frame;
+	uint32_t index;
+	uint32_t sequence;
+	uint32_t bytesused;
+	uint32_t flags;
+	uint8_t field;
+	int8_t drop;		/* enum drop_cause of this frame */
+	uint16_t skipped;	/* frames discarded before this one */
+	uint32_t stream;	/* stats_stream generation */
+	uint64_t timestamp;	/* V4L2 buffer timestamp */
+	uint64_t dequeued;	/* CLOCK_MONOTONIC at DQBUF */
+	uint64_t processed;	/* CLOCK_MONOTONIC after processing */
+};
+
+/*
+ * Stream format as seen by the reporter thread. The capture thread publishes
+ * a new generation when it reconfigures the device, and records carry the
+ * generation of the frame.
+ */
+#define STATS_STREAMS		4
+
+struct stats_stream
+{
+	uint32_t pixelformat;
+	unsigned int width;
+	unsigned int height;
+	unsigned int num_planes;
+	unsigned int nbufs;
+	struct v4l2_plane_pix_format plane_fmt[VIDEO_MAX_PLANES];
+	struct v4l2_fract period;
+};
+
+struct stats_interval
+{
+	unsigned int frames;
+	unsigned int drops[DROP_CAUSES];
+	unsigned long long bytes;
+	uint64_t first_timestamp;
+	uint64_t last_timestamp;
+	uint64_t process_sum;
+	uint64_t process_max;
+	unsigned long major_faults;
+	unsigned long minor_faults;
+
+	/* Buffer timestamp to dequeue, and buffer timestamp deltas */
+	struct histogram latency;
+	struct histogram interval;
+};
+
+struct stats_reporter
+{
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	_Alignas(64) struct frame_stats *records;
+	atomic_uint overflows;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+	bool quit;
+
+	struct device *dev;
+	FILE *out;
+	uint64_t interval_ns;
+	bool print_frames;
+
+	/* Stream format generations, protected by the lock */
+	struct stats_stream streams[STATS_STREAMS];
+	atomic_uint stream_gen;
+
+	/* Machine-readable report */
+	FILE *report;
+	char *report_buf;
+	bool report_header;
+	clockid_t capture_clock;
+	clockid_t processing_clock;
+	int64_t reporter_cpu_ns;
+
+	/* Reporter thread */
+	struct stats_stream stream;
+	unsigned int stream_current;
+	struct stats_interval current;
+	struct stats_interval total;
+	bool started;
+	uint32_t last_sequence;
+	uint64_t last_timestamp;
+	uint64_t start_ns;
+	uint64_t interval_start_ns;
+	struct rusage usage;	/* Process page faults at the interval start */
+};
+
+/* Producer side, called from the processing thread. */
+static void stats_record(struct stats_reporter *stats,
+			 const struct frame_stats *record)
+{
+	unsigned int head = atomic_load_explicit(&stats->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&stats->tail, memory_order_acquire);
+
+	if (stats->records == NULL)
+		return;
+
+	if (head - tail == STATS_RING_SIZE) {
+		atomic_fetch_add_explicit(&stats->overflows, 1, memory_order_relaxed);
+		return;
+	}
+
+	stats->records[head & (STATS_RING_SIZE - 1)] = *record;
+	atomic_store_explicit(&stats->head, head + 1, memory_order_release);
+}
+
+static void stats_print_frame(struct stats_reporter *stats,
+			      const struct frame_stats *record)
+{
+	const char *ts_type, *ts_source;
+	double fps;
+
+	fps = stats->started ? record->timestamp - stats->last_timestamp : 0;
+	fps = fps ? 1000000000.0 / fps : 0.0;
+
+	get_ts_flags(record->flags, &ts_type, &ts_source);
+	fprintf(stats->out, "%u (%u) [%c] %s %u %u B %" PRIu64 ".%06" PRIu64 " %" PRIu64 ".%06" PRIu64 " %.3f fps ts %s/%s\n",
+		record->frame, record->index,
+		(record->flags & V4L2_BUF_FLAG_ERROR) ? 'E' : '-',
+		v4l2_field_name(record->field), record->sequence,
+		record->bytesused,
+		record->timestamp / 1000000000, record->timestamp % 1000000000 / 1000,
+		record->dequeued / 1000000000, record->dequeued % 1000000000 / 1000,
+		fps, ts_type, ts_source);
+}
+
+/* Return the number of frames missing before a record. */
+static unsigned int stats_gap(struct stats_reporter *stats,
+			      const struct frame_stats *record)
+{
+	const struct v4l2_fract *period = &stats->stream.period;
+	uint64_t delta;
+	uint64_t unit;
+	uint64_t count;
+
+	if (record->sequence > stats->last_sequence)
+		return record->sequence - stats->last_sequence - 1;
+	if (record->sequence < stats->last_sequence)
+		return 0;
+
+	/*
+	 * The sequence isn't set, count the frame periods elapsed since the
+	 * previous frame, rounded to the nearest integer.
+	 */
+	if (!period->numerator || !period->denominator ||
+	    record->timestamp <= stats->last_timestamp)
+		return 0;
+
+	delta = record->timestamp - stats->last_timestamp;
+	unit = period->numerator * 1000000000ULL;
+	count = (delta * period->denominator + unit / 2) / unit;
+
+	return count > 1 ? count - 1 : 0;
+}
+
+static void stats_account(struct stats_reporter *stats,
+			  const struct frame_stats *record)
+{
+	struct stats_interval *cur = &stats->current;
+
+	if (record->stream != stats->stream_current) {
+		pthread_mutex_lock(&stats->lock);
+		stats->stream = stats->streams[record->stream % STATS_STREAMS];
+		pthread_mutex_unlock(&stats->lock);
+		stats->stream_current = record->stream;
+	}
+
+	if (stats->print_frames)
+		stats_print_frame(stats, record);
+
+	if (stats->started) {
+		unsigned int gap = stats_gap(stats, record);
+
+		/* Frames discarded by the pipeline show up as gaps too. */
+		gap = gap > record->skipped ? gap - record->skipped : 0;
+		cur->drops[DROP_DRIVER_GAP] += gap;
+	}
+	cur->drops[DROP_POOL_STARVATION] += record->skipped;
+
+	if (!cur->frames)
+		cur->first_timestamp = record->timestamp;
+	cur->last_timestamp = record->timestamp;
+
+	cur->frames++;
+	cur->bytes += record->bytesused;
+	if (record->flags & V4L2_BUF_FLAG_ERROR)
+		cur->drops[DROP_ERROR]++;
+	else if (record->drop != DROP_NONE)
+		cur->drops[record->drop]++;
+
+	/* Capture latency is only meaningful with monotonic timestamps. */
+	if ((record->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+	    record->dequeued >= record->timestamp)
+		histogram_record(&cur->latency,
+				 record->dequeued - record->timestamp);
+
+	if (stats->started && record->timestamp > stats->last_timestamp)
+		histogram_record(&cur->interval,
+				 record->timestamp - stats->last_timestamp);
+
+	if (record->processed > record->dequeued) {
+		uint64_t process = record->processed - record->dequeued;
+
+		cur->process_sum += process;
+		if (process > cur->process_max)
+			cur->process_max = process;
+	}
+
+	stats->started = true;
+	stats->last_sequence = record->sequence;
+	stats->last_timestamp = record->timestamp;
+}
+
+static void stats_merge(struct stats_interval *total,
+			const struct stats_interval *cur)
+{
+	unsigned int i;
+
+	if (!total->frames)
+		total->first_timestamp = cur->first_timestamp;
+	total->last_timestamp = cur->last_timestamp;
+
+	total->frames += cur->frames;
+	for (i = 0; i < DROP_CAUSES; i++)
+		total->drops[i] += cur->drops[i];
+	total->bytes += cur->bytes;
+	histogram_merge(&total->latency, &cur->latency);
+	histogram_merge(&total->interval, &cur->interval);
+	total->process_sum += cur->process_sum;
+	if (cur->process_max > total->process_max)
+		total->process_max = cur->process_max;
+	total->major_faults += cur->major_faults;
+	total->minor_faults += cur->minor_faults;
+}
+
+static void stats_print_interval(struct stats_reporter *stats, const char *name,
+				 const struct stats_interval *cur, uint64_t elapsed)
+{
+	double seconds = elapsed / 1000000000.0;
+	unsigned int dropped = 0;
+	double fps = 0.0;
+	unsigned int i;
+
+	for (i = 0; i < DROP_CAUSES; i++)
+		dropped += cur->drops[i];
+
+	if (cur->frames > 1 && cur->last_timestamp > cur->first_timestamp)
+		fps = (cur->frames - 1) * 1000000000.0
+		    / (cur->last_timestamp - cur->first_timestamp);
+
+	fprintf(stats->out, "[%s] %u frames, %.3f fps, %u dropped (%u driver, %u error, %u pool, %u writer), %.2f MB/s",
+		name, cur->frames, fps, dropped, cur->drops[DROP_DRIVER_GAP],
+		cur->drops[DROP_ERROR], cur->drops[DROP_POOL_STARVATION],
+		cur->drops[DROP_WRITER_BACKPRESSURE], seconds ? cur->bytes / seconds / (1024 * 1024) : 0.0);
+
+	if (cur->frames)
+		fprintf(stats->out, ", processing avg %.3f max %.3f ms",
+			cur->process_sum / 1000000.0 / cur->frames,
+			cur->process_max / 1000000.0);
+
+	fprintf(stats->out, ", faults %lu major %lu minor\n",
+		cur->major_faults, cur->minor_faults);
+
+	histogram_fprint(stats->out, &cur->latency, "  Capture latency");
+	histogram_fprint(stats->out, &cur->interval, "  Frame interval");
+}
+
+static void stats_interval_init(struct stats_interval *cur)
+{
+	memset(cur, 0, sizeof *cur);
+	histogram_init(&cur->latency);
+	histogram_init(&cur->interval);
+}
+
+/*
+ * Machine-readable run report. Records are written as JSON lines or CSV rows
+ * with a fixed set of fields, identified by a schema version that must be
+ * bumped whenever fields are changed or removed.
+ */
+#define STATS_REPORT_SCHEMA	2
+
+/* Per-thread CPU time in nanoseconds, negative if unknown. */
+struct stats_cpu
+{
+	int64_t capture;
+	int64_t processing;
+	int64_t reporter;
+	int64_t writers;
+};
+
+static const char * const stats_drop_names[DROP_CAUSES] = {
+	[DROP_DRIVER_GAP] = "driver",
+	[DROP_ERROR] = "error",
+	[DROP_POOL_STARVATION] = "pool",
+	[DROP_WRITER_BACKPRESSURE] = "writer",
+};
+
+static const double stats_percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+static const char * const stats_percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+static const char *stats_memtype_name(enum v4l2_memory memtype)
+{
+	switch (memtype) {
+	case V4L2_MEMORY_MMAP:
+		return "mmap";
+	case V4L2_MEMORY_USERPTR:
+		return "userptr";
+	case V4L2_MEMORY_DMABUF:
+		return "dmabuf";
+	default:
+		return "unknown";
+	}
+}
+
+static void stats_csv_header(FILE *out)
+{
+	unsigned int i, j;
+
+	fprintf(out, "schema,type,time_s,elapsed_s,fourcc,width,height,num_planes,"
+		"stride,sizeimage,memtype,nbufs,period_num,period_den,frames,fps,"
+		"bytes,throughput_Bps");
+	for (i = 0; i < DROP_CAUSES; i++)
+		fprintf(out, ",drops_%s", stats_drop_names[i]);
+	fprintf(out, ",drops_total");
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < ARRAY_SIZE(stats_percentiles); j++)
+			fprintf(out, ",%s_%s_us", i ? "interval" : "latency",
+				stats_percentile_names[j]);
+		fprintf(out, ",%s_max_us,%s_samples", i ? "interval" : "latency",
+			i ? "interval" : "latency");
+	}
+	fprintf(out, ",faults_major,faults_minor");
+	fprintf(out, ",cpu_capture_ms,cpu_processing_ms,cpu_reporter_ms,cpu_writers_ms\n");
+}
+
+static void stats_json_histogram(FILE *out, const char *name,
+				 const struct histogram *hist)
+{
+	unsigned int i;
+
+	fprintf(out, ",\"%s\":{", name);
+	for (i = 0; i < ARRAY_SIZE(stats_percentiles); i++)
+		fprintf(out, "\"%s\":%.1f,", stats_percentile_names[i],
+			histogram_percentile(hist, stats_percentiles[i]) / 1000.0);
+	fprintf(out, "\"max\":%.1f,\"samples\":%" PRIu64 "}",
+		hist->total ? hist->max / 1000.0 : 0.0, hist->total);
+}
+
+static void stats_csv_histogram(FILE *out, const struct histogram *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(stats_percentiles); i++)
+		fprintf(out, ",%.1f",
+			histogram_percentile(hist, stats_percentiles[i]) / 1000.0);
+	fprintf(out, ",%.1f,%" PRIu64, hist->total ? hist->max / 1000.0 : 0.0,
+		hist->total);
+}
+
+static void stats_write_report(struct stats_reporter *stats, const char *type,
+			       const struct stats_interval *cur, uint64_t now,
+			       uint64_t elapsed, const struct stats_cpu *cpu)
+{
+	const struct device *dev = stats->dev;
+	const struct stats_stream *fmt = &stats->stream;
+	int64_t cpus[4] = { cpu->capture, cpu->processing, cpu->reporter, cpu->writers };
+	static const char * const cpu_names[4] = { "capture", "processing", "reporter", "writers" };
+	bool json = dev->stats_format == STATS_FORMAT_JSON;
+	FILE *out = stats->report;
+	unsigned int dropped = 0;
+	double fps = 0.0;
+	char fourcc[5];
+	unsigned int i;
+
+	if (out == NULL)
+		return;
+
+	for (i = 0; i < DROP_CAUSES; i++)
+		dropped += cur->drops[i];
+
+	if (cur->frames > 1 && cur->last_timestamp > cur->first_timestamp)
+		fps = (cur->frames - 1) * 1000000000.0
+		    / (cur->last_timestamp - cur->first_timestamp);
+
+	for (i = 0; i < 4; i++)
+		fourcc[i] = isprint((fmt->pixelformat >> (i * 8)) & 0xff)
+			  ? (fmt->pixelformat >> (i * 8)) & 0xff : '?';
+	fourcc[4] = '\0';
+
+	if (json) {
+		fprintf(out, "{\"schema\":%u,\"type\":\"%s\",\"time_s\":%.3f,\"elapsed_s\":%.3f,",
+			STATS_REPORT_SCHEMA, type,
+			(now - stats->start_ns) / 1000000000.0,
+			elapsed / 1000000000.0);
+		fprintf(out, "\"format\":{\"fourcc\":\"%s\",\"width\":%u,\"height\":%u,\"planes\":[",
+			fourcc, fmt->width, fmt->height);
+		for (i = 0; i < fmt->num_planes; i++)
+			fprintf(out, "%s{\"stride\":%u,\"sizeimage\":%u}",
+				i ? "," : "", fmt->plane_fmt[i].bytesperline,
+				fmt->plane_fmt[i].sizeimage);
+		fprintf(out, "]},\"memtype\":\"%s\",\"nbufs\":%u,"
+			"\"frame_period\":{\"num\":%u,\"den\":%u},",
+			stats_memtype_name(dev->memtype), fmt->nbufs,
+			fmt->period.numerator, fmt->period.denominator);
+		fprintf(out, "\"frames\":%u,\"fps\":%.3f,\"bytes\":%llu,\"throughput_Bps\":%.0f,\"drops\":{",
+			cur->frames, fps, cur->bytes,
+			elapsed ? cur->bytes * 1000000000.0 / elapsed : 0.0);
+		for (i = 0; i < DROP_CAUSES; i++)
+			fprintf(out, "\"%s\":%u,", stats_drop_names[i], cur->drops[i]);
+		fprintf(out, "\"total\":%u}", dropped);
+		stats_json_histogram(out, "latency_us", &cur->latency);
+		stats_json_histogram(out, "frame_interval_us", &cur->interval);
+		fprintf(out, ",\"faults\":{\"major\":%lu,\"minor\":%lu}",
+			cur->major_faults, cur->minor_faults);
+		fprintf(out, ",\"cpu_ms\":{");
+		for (i = 0; i < 4; i++) {
+			if (cpus[i] < 0)
+				fprintf(out, "%s\"%s\":null", i ? "," : "", cpu_names[i]);
+			else
+				fprintf(out, "%s\"%s\":%.3f", i ? "," : "", cpu_names[i],
+					cpus[i] / 1000000.0);
+		}
+		fprintf(out, "}}\n");
+	} else {
+		if (!stats->report_header) {
+			stats_csv_header(out);
+			stats->report_header = true;
+		}
+
+		fprintf(out, "%u,%s,%.3f,%.3f,%s,%u,%u,%u,", STATS_REPORT_SCHEMA,
+			type, (now - stats->start_ns) / 1000000000.0,
+			elapsed / 1000000000.0, fourcc, fmt->width, fmt->height,
+			fmt->num_planes);
+		/* Multi-planar values are separated by semicolons. */
+		for (i = 0; i < fmt->num_planes; i++)
+			fprintf(out, "%s%u", i ? ";" : "", fmt->plane_fmt[i].bytesperline);
+		fprintf(out, ",");
+		for (i = 0; i < fmt->num_planes; i++)
+			fprintf(out, "%s%u", i ? ";" : "", fmt->plane_fmt[i].sizeimage);
+		fprintf(out, ",%s,%u,%u,%u,%u,%.3f,%llu,%.0f",
+			stats_memtype_name(dev->memtype), fmt->nbufs,
+			fmt->period.numerator, fmt->period.denominator,
+			cur->frames, fps, cur->bytes,
+			elapsed ? cur->bytes * 1000000000.0 / elapsed : 0.0);
+		for (i = 0; i < DROP_CAUSES; i++)
+			fprintf(out, ",%u", cur->drops[i]);
+		fprintf(out, ",%u", dropped);
+		stats_csv_histogram(out, &cur->latency);
+		stats_csv_histogram(out, &cur->interval);
+		fprintf(out, ",%lu,%lu", cur->major_faults, cur->minor_faults);
+		for (i = 0; i < 4; i++) {
+			if (cpus[i] < 0)
+				fprintf(out, ",");
+			else
+				fprintf(out, ",%.3f", cpus[i] / 1000000.0);
+		}
+		fprintf(out, "\n");
+	}
+
+	fflush(out);
+}
+
+/* Consume all pending records. Called from the reporter thread. */
+static void stats_drain(struct stats_reporter *stats)
+{
+	unsigned int tail = atomic_load_explicit(&stats->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&stats->head, memory_order_acquire);
+
+	while (tail != head) {
+		stats_account(stats, &stats->records[tail & (STATS_RING_SIZE - 1)]);
+		tail++;
+	}
+
+	atomic_store_explicit(&stats->tail, tail, memory_order_release);
+}
+
+static int64_t stats_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) < 0)
+		return -1;
+
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void stats_flush_interval(struct stats_reporter *stats, uint64_t now,
+				 bool report)
+{
+	struct rusage usage;
+	char name[24];
+
+	getrusage(RUSAGE_SELF, &usage);
+	stats->current.major_faults = usage.ru_majflt - stats->usage.ru_majflt;
+	stats->current.minor_faults = usage.ru_minflt - stats->usage.ru_minflt;
+	stats->usage = usage;
+
+	if (stats->interval_ns && stats->current.frames) {
+		unsigned int states[BUFFER_STATE_COUNT];
+		unsigned int i;
+
+		sprintf(name, "%.1fs", (now - stats->start_ns) / 1000000000.0);
+		stats_print_interval(stats, name, &stats->current,
+				     now - stats->interval_start_ns);
+
+		video_buffer_states(stats->dev, states);
+		fprintf(stats->out, "  Buffers:");
+		for (i = 0; i < BUFFER_STATE_COUNT; i++)
+			fprintf(stats->out, " %u %s%s", states[i],
+				buffer_state_names[i],
+				i < BUFFER_STATE_COUNT - 1 ? "," : "\n");
+	}
+
+	/* Interval records carry the cumulative CPU time of live threads. */
+	if (report && stats->dev->stats_intervals && stats->current.frames) {
+		struct stats_cpu cpu = {
+			.capture = stats_clock_ns(stats->capture_clock),
+			.processing = stats_clock_ns(stats->processing_clock),
+			.reporter = stats_clock_ns(CLOCK_THREAD_CPUTIME_ID),
+			.writers = -1,
+		};
+
+		stats_write_report(stats, "interval", &stats->current, now,
+				   now - stats->interval_start_ns, &cpu);
+	}
+
+	stats->interval_start_ns = now;
+
+	stats_merge(&stats->total, &stats->current);
+	stats_interval_init(&stats->current);
+	fflush(stats->out);
+}
+
+static void *stats_thread(void *arg)
+{
+	struct stats_reporter *stats = arg;
+	uint64_t period = stats->interval_ns ? stats->interval_ns : 100000000ULL;
+	uint64_t next = stats->start_ns + period;
+	struct timespec ts;
+	bool quit;
+
+	pthread_mutex_lock(&stats->lock);
+
+	while (1) {
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+
+		while (!stats->quit &&
+		       pthread_cond_timedwait(&stats->cond, &stats->lock, &ts) != ETIMEDOUT)
+			;
+
+		quit = stats->quit;
+		pthread_mutex_unlock(&stats->lock);
+
+		stats_drain(stats);
+		if (quit)
+			break;
+
+		stats_flush_interval(stats, next, true);
+		next += period;
+
+		pthread_mutex_lock(&stats->lock);
+	}
+
+	stats->reporter_cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	return NULL;
+}
+
+static void stats_stream_init(struct stats_stream *fmt,
+			      const struct device *dev)
+{
+	unsigned int i;
+
+	memset(fmt, 0, sizeof *fmt);
+	fmt->pixelformat = dev->pixelformat;
+	fmt->width = dev->width;
+	fmt->height = dev->height;
+	fmt->num_planes = dev->num_planes;
+	fmt->nbufs = dev->nbufs;
+	for (i = 0; i < dev->num_planes; i++)
+		fmt->plane_fmt[i] = dev->plane_fmt[i];
+	fmt->period = dev->frame_period;
+}
+
+/*
+ * Publish the device format to the reporter thread after the capture thread
+ * has changed it. Frames processed from then on are accounted with the new
+ * format.
+ */
+static void stats_publish_stream(struct stats_reporter *stats,
+				 const struct device *dev)
+{
+	unsigned int gen;
+
+	if (stats->records == NULL)
+		return;
+
+	pthread_mutex_lock(&stats->lock);
+	gen = atomic_load_explicit(&stats->stream_gen, memory_order_relaxed) + 1;
+	stats_stream_init(&stats->streams[gen % STATS_STREAMS], dev);
+	atomic_store_explicit(&stats->stream_gen, gen, memory_order_release);
+	pthread_mutex_unlock(&stats->lock);
+}
+
+/*
+ * Start the reporter thread. The capture thread is the caller, the processing
+ * thread is only used to sample its CPU time.
+ */
+static int stats_start(struct stats_reporter *stats, struct device *dev,
+		       FILE *out, pthread_t processing)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	memset(stats, 0, sizeof *stats);
+	atomic_init(&stats->head, 0);
+	atomic_init(&stats->tail, 0);
+	atomic_init(&stats->overflows, 0);
+
+	stats->dev = dev;
+	stats->out = out;
+	stats->interval_ns = dev->stats_interval * 1000000ULL;
+	stats->print_frames = dev->print_frames;
+	atomic_init(&stats->stream_gen, 0);
+	stats_stream_init(&stats->streams[0], dev);
+	stats->stream = stats->streams[0];
+	stats->capture_clock = CLOCK_THREAD_CPUTIME_ID;
+	stats->processing_clock = CLOCK_THREAD_CPUTIME_ID;
+	pthread_getcpuclockid(pthread_self(), &stats->capture_clock);
+	pthread_getcpuclockid(processing, &stats->processing_clock);
+	stats->start_ns = clock_ns(CLOCK_MONOTONIC);
+	stats->interval_start_ns = stats->start_ns;
+	getrusage(RUSAGE_SELF, &stats->usage);
+	stats_interval_init(&stats->current);
+	stats_interval_init(&stats->total);
+
+	stats->records = calloc(STATS_RING_SIZE, sizeof stats->records[0]);
+	if (stats->records == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_init(&stats->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stats->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (dev->stats_format != STATS_FORMAT_NONE) {
+		stats->report = fopen(dev->stats_file, "w");
+		if (stats->report == NULL) {
+			print("Unable to open stats file %s: %s (%d)\n",
+				dev->stats_file, strerror(errno), errno);
+			return -errno;
+		}
+
+		/*
+		 * stdio allocates the stream buffer on first use, which is on
+		 * the reporter thread while allocations are being counted.
+		 */
+		stats->report_buf = malloc(BUFSIZ);
+		if (stats->report_buf == NULL)
+			return -ENOMEM;
+		setvbuf(stats->report, stats->report_buf, _IOFBF, BUFSIZ);
+	}
+
+	ret = pthread_create(&stats->thread, NULL, stats_thread, stats);
+	if (ret) {
+		print("Unable to create stats thread: %s (%d).\n",
+			strerror(ret), ret);
+		return -ret;
+	}
+
+	stats->running = true;
+	return 0;
+}
+
+/* Stop the reporter thread after it has consumed all pending records. */
+static void stats_stop(struct stats_reporter *stats)
+{
+	if (!stats->running)
+		return;
 
-   case MMAL_ES_TYPE_SUBPICTURE:
-      break;
+	pthread_mutex_lock(&stats->lock);
+	stats->quit = true;
+	pthread_cond_signal(&stats->cond);
+	pthread_mutex_unlock(&stats->lock);
 
-   default: break;
-   }
+	pthread_join(stats->thread, NULL);
+	stats->running = false;
+
+	stats_flush_interval(stats, clock_ns(CLOCK_MONOTONIC), false);
 }
 
-void mmal_log_dump_port(MMAL_PORT_T *port)
+static void stats_report(struct stats_reporter *stats, struct stats_cpu *cpu)
 {
-   if (!port)
-      return;
+	struct stats_interval *total = &stats->total;
+	uint64_t now = clock_ns(CLOCK_MONOTONIC);
 
-   LOG_DEBUG("%s(%p)", port->name, port);
+	cpu->reporter = stats->reporter_cpu_ns;
+	stats_write_report(stats, "total", total, now, now - stats->start_ns, cpu);
 
-   dump_port_format(port->format);
+	if (!total->frames)
+		return;
 
-   LOG_DEBUG("buffers num: %i(opt %i, min %i), size: %i(opt %i, min: %i), align: %i\n",
-            port->buffer_num, port->buffer_num_recommended, port->buffer_num_min,
-            port->buffer_size, port->buffer_size_recommended, port->buffer_size_min,
-            port->buffer_alignment_min);
+	stats_print_interval(stats, "total", total, now - stats->start_ns);
+	if (atomic_load(&stats->overflows))
+		fprintf(stats->out, "Stats: %u records lost (ring overflow)\n",
+			atomic_load(&stats->overflows));
+	fflush(stats->out);
 }
 
-int video_set_dv_timings(struct device *dev);
+static void stats_cleanup(struct stats_reporter *stats)
+{
+	if (stats->records == NULL)
+		return;
+
+	stats_stop(stats);
+	if (stats->report)
+		fclose(stats->report);
+	free(stats->report_buf);
+	pthread_cond_destroy(&stats->cond);
+	pthread_mutex_destroy(&stats->lock);
+	free(stats->records);
+	stats->records = NULL;
+}
 
-static void handle_event(struct device *dev)
+struct capture
 {
-        struct v4l2_event ev;
+	struct device *dev;
+	struct event_loop loop;
+	struct event_source video;
+	struct event_source release;
+	struct event_source watchdog;
+	struct event_source uring_event;
+	struct event_source pacer;
+	struct event_source loopback;
+
+	unsigned int nframes;
+	unsigned int skip;
+	unsigned int delay;
+	const char *pattern;
+	char *filename;
+	int do_requeue_last;
+	enum buffer_fill_mode fill;
+
+	/* Capture thread */
+	unsigned int dequeued;
+	unsigned int held;
+	unsigned int held_max;
+	uint64_t last_activity_ns;
+	atomic_uint skipped;
+	uint64_t starved_since;
+	unsigned int grow_events;
+	unsigned int initial_bufs;
+	bool reconfiguring;
+	uint64_t source_change_ns;
+	unsigned int source_changes;
+	uint64_t source_gap_max_ns;
+
+	/* Output pacing */
+	uint64_t pace_start_ns;
+	uint64_t pace_slot;
+	uint64_t pace_free;		/* Buffers waiting for their slot */
+	unsigned int pace_queued;
+	unsigned int pace_late;
+	unsigned int pace_missed;
+	struct histogram pace_jitter;
+
+	/* Processing thread */
+	struct recorder *rec;
+	struct histogram loop_latency;
+	uint32_t loop_sequence;
+	unsigned int loop_frames;
+	unsigned int loop_lost;
+	unsigned int loop_repeated;
+	unsigned int loop_undecoded;
+	struct writer *writer;
+	struct uring_writer *uring;
+	struct buffer_ring ring;
+	struct stats_reporter stats;
+	pthread_t thread;
+	atomic_bool quit;
+	uint64_t process_cpu_ns;
+
+	unsigned int frames;
+	unsigned int size;
+	struct timespec ts;
 
-        while (!ioctl(dev->fd, VIDIOC_DQEVENT, &ev)) {
-            switch (ev.type) {
-            case V4L2_EVENT_SOURCE_CHANGE:
-                fprintf(stderr, "Source changed\n");
+	/* Synchronous writes */
+	unsigned long long write_bytes;
+	uint64_t write_cpu_ns;
 
-		video_set_dv_timings(dev);
-//                stop_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE);
-//                unmap_buffers(buffers, n_buffers);
+	/* Staging copies */
+	unsigned long long staging_bytes;
+	uint64_t staging_ns;
+	unsigned int staging_frames;
+};
 
-                fprintf(stderr, "Unmapped all buffers\n");
-//                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+static void video_process_save(struct capture *cap, struct v4l2_buffer *buf)
+{
+	struct device *dev = cap->dev;
+	uint64_t cpu;
+	int ret;
 
-//                init_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, &buffers, &n_buffers);
+	cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
 
-//                start_capturing_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers, n_buffers);
-                break;
-            case V4L2_EVENT_EOS:
-                fprintf(stderr, "EOS\n");
-                break;
-            }
-        }
+	if (cap->rec)
+		ret = recorder_save(cap->rec, buf, cap->frames);
+	else
+		ret = video_save_image(dev, buf, cap->pattern, cap->filename,
+				       cap->frames);
+
+	cap->write_cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	if (!ret)
+		cap->write_bytes += video_buffer_bytes_used(dev, buf);
 }
 
-static int setup_mmal(struct device *dev, int nbufs, int do_encode, const char *filename)
+/* Copy the frame payload to the staging buffers. */
+static void video_buffer_stage(struct capture *cap, struct buffer *buffer,
+			       const struct v4l2_buffer *buf)
 {
-	MMAL_STATUS_T status;
-	VCOS_STATUS_T vcos_status;
-	MMAL_PORT_T *port;
-	const struct v4l2_format_info *info;
-	struct v4l2_format fmt;
-	int ret;
-	MMAL_PORT_T *isp_output, *encoder_input = NULL, *encoder_output = NULL;
+	struct device *dev = cap->dev;
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	unsigned int length;
+	unsigned int i;
 
-	//FIXME: Clean up after errors
+	for (i = 0; i < dev->num_planes; i++) {
+		length = video_is_mplane(dev) ? buf->m.planes[i].bytesused
+		       : buf->bytesused;
+		if (length > buffer->size[i])
+			length = buffer->size[i];
 
-	status = mmal_component_create("vc.ril.isp", &dev->isp);
-	if(status != MMAL_SUCCESS)
-	{
-		print("Failed to create isp\n");
-		return -1;
+		stream_copy(buffer->staging[i], buffer->mem[i], length);
+		cap->staging_bytes += length;
 	}
 
-	if (do_encode)
-	{
-		status = mmal_component_create("vc.ril.video_encode", &dev->encoder);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to create encoder");
-			return -1;
-		}
-		encoder_input = dev->encoder->input[0];
-		encoder_output = dev->encoder->output[0];
+	cap->staging_ns += clock_ns(CLOCK_MONOTONIC) - start;
+	cap->staging_frames++;
+}
+
+/*
+ * Decode the frame code of a loopback capture. The latency runs from the
+ * generation of the frame on the output side to its dequeue. Frames repeated
+ * by the capture side don't count, gaps in the output sequence are lost
+ * frames.
+ */
+static void video_loopback_check(struct capture *cap, const struct buffer *buffer,
+				 uint64_t dequeued)
+{
+	uint32_t code[PATTERN_CODE_WORDS];
+	uint64_t timestamp;
+	uint32_t sequence;
+
+	if (!test_pattern_decode(&cap->dev->test_pattern, buffer, code)) {
+		cap->loop_undecoded++;
+		return;
 	}
 
-	if (1)
-	{
-		status = mmal_component_create("vc.ril.video_render", &dev->render);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to create render\n");
-			return -1;
+	sequence = code[1];
+	timestamp = (uint64_t)code[2] << 32 | code[3];
+
+	if (cap->loop_frames) {
+		if (sequence == cap->loop_sequence) {
+			cap->loop_repeated++;
+			return;
 		}
+		if (sequence > cap->loop_sequence + 1)
+			cap->loop_lost += sequence - cap->loop_sequence - 1;
 	}
 
-	port = dev->isp->input[0];
+	cap->loop_sequence = sequence;
+	cap->loop_frames++;
 
-	memset(&fmt, 0, sizeof fmt);
-	fmt.type = dev->type;
+	/*
+	 * The frames queued before streaming starts are rendered during setup,
+	 * their latency includes the capture device initialization.
+	 */
+	if (sequence < cap->dev->loopback->nbufs)
+		return;
 
-	ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
-	if (ret < 0) {
-		print("Unable to get format: %s (%d).\n", strerror(errno),
-			errno);
-		return ret;
-	}
+	if (dequeued > timestamp)
+		histogram_record(&cap->loop_latency, dequeued - timestamp);
+}
 
-	info = v4l2_format_by_fourcc(fmt.fmt.pix.pixelformat);
-	if (!info || info->mmal_encoding == MMAL_ENCODING_UNUSED)
-	{
-		print("Unsupported encoding\n");
-		return -1;
-	}
-	port->format->encoding = info->mmal_encoding;
-	port->format->es->video.crop.width = fmt.fmt.pix.width;
-	port->format->es->video.crop.height = fmt.fmt.pix.height;
-	port->format->es->video.width = (port->format->es->video.crop.width+31) & ~31;
-	//mmal_encoding_stride_to_width(port->format->encoding, fmt.fmt.pix.bytesperline);
-	//The ISP doesn't care about padding on the height, but other components may.
-	port->format->es->video.height = fmt.fmt.pix.height;
-	//Ignore for now, but will be wanted for video encode.
-	//port->format->es->video.frame_rate.num = 10000;
-	//port->format->es->video.frame_rate.den = frame_interval ? frame_interval : 10000;
-	port->buffer_num = nbufs;
-	if (dev->fps) {
-		dev->frame_time_usec = 1000000/dev->fps;
+static void video_process_buffer(struct capture *cap, struct v4l2_buffer *buf,
+				 uint64_t dequeued)
+{
+	struct device *dev = cap->dev;
+	struct buffer *buffer = &dev->buffers[buf->index];
+	struct frame_stats record;
+	bool mapped = true;
+
+	/* Hold a reference until processing completes. */
+	atomic_store_explicit(&buffer->refs, 1, memory_order_relaxed);
+	video_buffer_transition(dev, buffer, BUFFER_STATE_MASK(DEQUEUED),
+				BUFFER_STATE_PIPELINE);
+
+	if (dev->cpu_reads) {
+		mapped = video_buffer_map(dev, buffer) == 0;
+		video_buffer_sync(dev, buffer, DMA_BUF_SYNC_START);
 	}
 
-	status = mmal_port_format_commit(port);
-	if (status != MMAL_SUCCESS)
-	{
-		print("Commit failed\n");
-		return -1;
+	if (mapped && dev->staging)
+		video_buffer_stage(cap, buffer, buf);
+
+	if (video_is_capture(dev) && mapped)
+		video_verify_buffer(dev, buf);
+
+	if (dev->loopback && mapped)
+		video_loopback_check(cap, buffer, dequeued);
+	//print("bytesused in buffer is %d\n", buf->bytesused);
+	cap->size += buf->bytesused;
+
+	clock_gettime(CLOCK_MONOTONIC, &cap->ts);
+
+	record.frame = cap->frames;
+	record.index = buf->index;
+	record.sequence = buf->sequence;
+	record.bytesused = video_buffer_bytes_used(dev, buf);
+	record.flags = buf->flags;
+	record.field = buf->field;
+	record.timestamp = timeval_ns(&buf->timestamp);
+	record.dequeued = dequeued;
+	record.drop = DROP_NONE;
+	record.stream = atomic_load_explicit(&cap->stats.stream_gen,
+					     memory_order_acquire);
+	record.skipped = atomic_exchange_explicit(&cap->skipped, 0,
+						  memory_order_relaxed);
+
+	if (!mapped)
+		record.drop = DROP_ERROR;
+
+	/*
+	 * Save the image. The buffer stays in the WRITING state when handed to
+	 * the writers, the processing reference keeps it from being released
+	 * in the meantime.
+	 */
+	if (video_is_capture(dev) && cap->pattern && !cap->skip && mapped) {
+		video_buffer_transition(dev, buffer, BUFFER_STATE_MASK(PIPELINE),
+					BUFFER_STATE_WRITING);
+
+		if (cap->uring) {
+			if (!uring_writer_queue(cap->uring, buf, cap->frames)) {
+				record.drop = DROP_WRITER_BACKPRESSURE;
+				video_buffer_transition(dev, buffer, BUFFER_STATE_MASK(WRITING),
+							BUFFER_STATE_PIPELINE);
+			}
+		} else if (cap->writer) {
+			if (!writer_queue(cap->writer, buf, cap->frames)) {
+				record.drop = DROP_WRITER_BACKPRESSURE;
+				video_buffer_transition(dev, buffer, BUFFER_STATE_MASK(WRITING),
+							BUFFER_STATE_PIPELINE);
+			}
+		} else {
+			video_process_save(cap, buf);
+			video_buffer_transition(dev, buffer, BUFFER_STATE_MASK(WRITING),
+						BUFFER_STATE_PIPELINE);
+		}
 	}
-	mmal_log_dump_port(port);
 
-	unsigned int mmal_stride = mmal_encoding_width_to_stride(info->mmal_encoding, port->format->es->video.width);
-	if (mmal_stride != fmt.fmt.pix.bytesperline) {
-		if (video_set_format(dev, fmt.fmt.pix.width, fmt.fmt.pix.height, fmt.fmt.pix.pixelformat, mmal_stride,
-				     fmt.fmt.pix.sizeimage, fmt.fmt.pix.field, fmt.fmt.pix.flags) < 0) 
-			print("Failed to adjust stride\n");
-		else
-			// Retrieve settings again so local state is correct
-			video_get_format(dev);
+	/*
+	 * Each V4L2 buffer owns its MMAL header, which is only in flight while
+	 * the buffer is held by the pipeline.
+	 */
+	if (buffer->mmal) {
+		MMAL_BUFFER_HEADER_T *mmal = buffer->mmal;
+		MMAL_STATUS_T status;
+
+		/* Need to wait for MMAL to be finished with the buffer before returning to V4L2 */
+		video_buffer_get(buffer);
+		/*if (buf->bytesused != buf->length)
+		{
+			print("V4L2 buffer came back as shorter than allocated - length %u, bytesused %u\n",
+			       buf->length, buf->bytesused);
+		}*/
+		mmal->length = buf->length;	//Deliberately use length as MMAL wants the padding
+
+		if (!dev->starttime.tv_sec)
+			dev->starttime = buf->timestamp;
+
+		struct timeval pts;
+		timersub(&buf->timestamp, &dev->starttime, &pts);
+		//MMAL PTS is in usecs, so convert from struct timeval
+		mmal->pts = (pts.tv_sec * 1000000) + pts.tv_usec;
+		dev->lastpts = mmal->pts;
+
+		mmal->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+		//mmal->pts = buf->timestamp;
+		status = mmal_port_send_buffer(dev->isp->input[0], mmal);
+		if (status != MMAL_SUCCESS) {
+			print("mmal_port_send_buffer failed %d\n", status);
+			record.drop = DROP_POOL_STARVATION;
+			video_buffer_put(dev, buffer);
+		}
 	}
 
-	dev->mmal_pool = mmal_pool_create(nbufs, 0);
-	if (!dev->mmal_pool) {
-		print("Failed to create pool\n");
-		return -1;
+	if (cap->skip)
+		--cap->skip;
+
+	/* Requeue the buffer. */
+	if (cap->delay > 0)
+		usleep(cap->delay * 1000);
+
+	record.processed = clock_ns(CLOCK_MONOTONIC);
+	stats_record(&cap->stats, &record);
+
+	cap->frames++;
+
+	video_buffer_put(dev, buffer);
+}
+
+static void *video_process_thread(void *arg)
+{
+	struct capture *cap = arg;
+	struct buffer_desc *desc;
+
+	while (1) {
+		desc = buffer_ring_peek(&cap->ring);
+		if (desc == NULL) {
+			if (atomic_load(&cap->quit))
+				break;
+			buffer_ring_wait(&cap->ring);
+			continue;
+		}
+
+		video_process_buffer(cap, &desc->buf, desc->dequeued);
+		buffer_ring_pop(&cap->ring);
 	}
-	print("Created pool of length %d, size %d\n", nbufs, 0);
 
-	port->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+	/*
+	 * io_uring cancels the requests of a thread when it exits, wait for
+	 * the writes submitted from this thread. The capture thread has left
+	 * the event loop and doesn't reap completions anymore.
+	 */
+	if (cap->uring)
+		uring_writer_stop(cap->uring);
 
-	mmal_format_copy(dev->isp->output[0]->format, port->format);
-	port = dev->isp->output[0];
-	port->format->encoding = MMAL_ENCODING_I420;
-	while(port->format->es->video.crop.width > 1920)
-	{
-		port->format->es->video.crop.width >>= 1;
-		port->format->es->video.crop.height >>= 1;
+	cap->process_cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	return NULL;
+}
+
+/*
+ * Grow the buffer pool when the driver has been left with fewer buffers than
+ * the watermark for STARVATION_DELAY_NS, adding enough buffers to bring it
+ * back to the watermark. The last nbufs frames aren't requeued and don't
+ * count as starvation.
+ */
+static void video_check_starvation(struct capture *cap)
+{
+	struct device *dev = cap->dev;
+	unsigned int queued = dev->nbufs - cap->held;
+	uint64_t now;
+	int ret;
+
+	/*
+	 * No buffer is queued while the device is being reconfigured. Paced
+	 * output keeps few buffers queued by design.
+	 */
+	if (dev->nbufs >= dev->max_bufs || cap->reconfiguring ||
+	    dev->pace_period.denominator)
+		return;
+
+	if (queued >= dev->buffer_watermark ||
+	    cap->dequeued + dev->nbufs >= cap->nframes) {
+		cap->starved_since = 0;
+		return;
 	}
-	port->buffer_num = 3;
 
-	status = mmal_port_format_commit(port);
-	if (status != MMAL_SUCCESS)
-	{
-		print("ISP o/p commit failed\n");
-		return -1;
+	now = clock_ns(CLOCK_MONOTONIC);
+	if (!cap->starved_since) {
+		cap->starved_since = now;
+		return;
 	}
 
-	isp_output = dev->isp->output[0];
+	if (now - cap->starved_since < STARVATION_DELAY_NS)
+		return;
 
-	if (dev->render)
-	{
-		status = mmal_format_full_copy(dev->render->input[0]->format, isp_output->format);
-		dev->render->input[0]->buffer_num = 3;
-		if (status == MMAL_SUCCESS)
-			status = mmal_port_format_commit(dev->render->input[0]);
+	alloc_check_pause();
+	ret = video_grow_buffers(dev, dev->buffer_watermark - queued, cap->fill);
+	alloc_check_resume();
+	if (ret < 0) {
+		print("Unable to grow the buffer pool, keeping %u buffers\n",
+			dev->nbufs);
+		dev->max_bufs = dev->nbufs;
+		return;
 	}
 
-	//  Encoder setup
-	if (dev->encoder)
-	{
-		status = mmal_format_full_copy(encoder_input->format, isp_output->format);
-		encoder_input->buffer_num = 3;
-		if (status == MMAL_SUCCESS)
-			status = mmal_port_format_commit(encoder_input);
+	print("Buffer pool grown by %d to %u buffers, %u queued for %" PRIu64 " ms\n",
+		ret, dev->nbufs, queued, (now - cap->starved_since) / 1000000);
 
-		// Only supporting H264 at the moment
-		encoder_output->format->encoding = MMAL_ENCODING_H264;
+	cap->grow_events++;
+	stats_publish_stream(&cap->stats, dev);
+	cap->starved_since = 0;
+}
 
-		encoder_output->format->bitrate = 10000000;
-		encoder_output->buffer_size = 256<<10;//encoder_output->buffer_size_recommended;
+/*
+ * Restart streaming once all buffers are back after a source change, reusing
+ * them when they fit the new format.
+ */
+static int video_reconfigure(struct capture *cap)
+{
+	struct device *dev = cap->dev;
+	int ret;
 
-		if (encoder_output->buffer_size < encoder_output->buffer_size_min)
-			encoder_output->buffer_size = encoder_output->buffer_size_min;
+	ret = video_realloc_buffers(dev);
+	if (ret < 0)
+		return ret;
 
-		encoder_output->buffer_num = 8; //encoder_output->buffer_num_recommended;
+	if (cap->rec)
+		recorder_restart(cap->rec);
 
-		if (encoder_output->buffer_num < encoder_output->buffer_num_min)
-			encoder_output->buffer_num = encoder_output->buffer_num_min;
+	stats_publish_stream(&cap->stats, dev);
 
-		// We need to set the frame rate on output to 0, to ensure it gets
-		// updated correctly from the input framerate when port connected
-		encoder_output->format->es->video.frame_rate.num = 0;
-		encoder_output->format->es->video.frame_rate.den = 1;
+	if (ret && cap->uring)
+		uring_writer_register_buffers(cap->uring);
+
+	print("Source change: %ux%u, %s %u buffers in %" PRIu64 " ms\n",
+		dev->width, dev->height, ret ? "reallocated" : "reused",
+		dev->nbufs, (clock_ns(CLOCK_MONOTONIC) - cap->source_change_ns) / 1000000);
+
+	ret = video_queue_all_buffers(dev, cap->fill);
+	if (ret < 0)
+		return ret;
+
+	ret = video_enable(dev, 1);
+	if (ret < 0)
+		return ret;
+
+	cap->reconfiguring = false;
+	cap->last_activity_ns = clock_ns(CLOCK_MONOTONIC);
+
+	return 0;
+}
+
+/*
+ * Stop streaming on a resolution change. The device is reconfigured as soon
+ * as the processing stages have released all the buffers they hold.
+ */
+static int video_source_change(struct capture *cap)
+{
+	struct device *dev = cap->dev;
+	int ret;
+
+	/* The MMAL ISP input port would need to be reconfigured as well. */
+	if (dev->isp || !video_is_capture(dev)) {
+		video_set_dv_timings(dev);
+		stats_publish_stream(&cap->stats, dev);
+		return 0;
+	}
+
+	if (cap->reconfiguring)
+		return 0;
+
+	if (!cap->source_change_ns)
+		cap->source_change_ns = clock_ns(CLOCK_MONOTONIC);
+	cap->reconfiguring = true;
+
+	ret = video_enable(dev, 0);
+	if (ret < 0)
+		return ret;
 
-		// Commit the port changes to the output port
-		status = mmal_port_format_commit(encoder_output);
+	video_buffers_reclaim(dev);
 
-		if (status != MMAL_SUCCESS)
-		{
-			print("Unable to set format on encoder output port\n");
-		}
+	if (cap->held)
+		return 0;
 
-		{
-			MMAL_PARAMETER_VIDEO_PROFILE_T  param;
-			param.hdr.id = MMAL_PARAMETER_PROFILE;
-			param.hdr.size = sizeof(param);
+	alloc_check_pause();
+	ret = video_reconfigure(cap);
+	alloc_check_resume();
 
-			param.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;//state->profile;
-			param.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+	return ret;
+}
 
-			status = mmal_port_parameter_set(encoder_output, &param.hdr);
-			if (status != MMAL_SUCCESS)
-			{
-				print("Unable to set H264 profile\n");
-			}
-		}
+/* Report the gap between a source change and the first frame that follows. */
+static void video_source_change_done(struct capture *cap)
+{
+	const struct v4l2_fract *period = &cap->dev->frame_period;
+	uint64_t gap = cap->last_activity_ns - cap->source_change_ns;
 
-		if (mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_VIDEO_IMMUTABLE_INPUT, 1) != MMAL_SUCCESS)
-		{
-			print("Unable to set immutable input flag\n");
-			// Continue rather than abort..
-		}
+	if (period->numerator)
+		print("Source change: first frame after %" PRIu64 " ms (%" PRIu64 " frame periods)\n",
+			gap / 1000000, (uint64_t)(gap * period->denominator /
+			(period->numerator * 1000000000ULL)));
+	else
+		print("Source change: first frame after %" PRIu64 " ms\n",
+			gap / 1000000);
 
-		//set INLINE HEADER flag to generate SPS and PPS for every IDR if requested
-		if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 0) != MMAL_SUCCESS)
-		{
-			print("failed to set INLINE HEADER FLAG parameters\n");
-			// Continue rather than abort..
-		}
+	if (gap > cap->source_gap_max_ns)
+		cap->source_gap_max_ns = gap;
+	cap->source_changes++;
+	cap->source_change_ns = 0;
+}
 
-		//set INLINE VECTORS flag to request motion vector estimates
-		if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 0) != MMAL_SUCCESS)
-		{
-			print("failed to set INLINE VECTORS parameters\n");
-			// Continue rather than abort..
-		}
+/*
+ * Dequeue one buffer and hand it to the processing thread. Return 1 if a
+ * buffer has been dequeued, 0 if no buffer was ready or a negative error code
+ * otherwise.
+ */
+static int video_dequeue_buffer(struct capture *cap)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct device *dev = cap->dev;
+	struct v4l2_buffer buf;
+	uint64_t start;
+	int ret;
 
-		if (status != MMAL_SUCCESS)
-		{
-			print("Unable to set format on video encoder input port\n");
-		}
+	memset(&buf, 0, sizeof buf);
+	memset(planes, 0, sizeof planes);
 
-		print("Enable encoder....\n");
-		status = mmal_component_enable(dev->encoder);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to enable\n");
-			return -1;
+	buf.type = dev->type;
+	buf.memory = dev->memtype;
+	buf.length = VIDEO_MAX_PLANES;
+	buf.m.planes = planes;
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		if (errno != EIO) {
+			print("Unable to dequeue buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return -errno;
 		}
-		status = mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-		status += mmal_port_parameter_set_boolean(encoder_input, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to set zero copy\n");
-			return -1;
+		/* The driver still returns the index of the failed buffer. */
+		if (buf.index >= dev->nbufs) {
+			print("Unable to dequeue buffer: %s (%d), invalid index %u.\n",
+				strerror(errno), errno, buf.index);
+			return -EIO;
 		}
-		encoder_input->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+		buf.type = dev->type;
+		buf.memory = dev->memtype;
+		if (dev->memtype == V4L2_MEMORY_USERPTR)
+			video_buffer_fill_userptr(dev, &dev->buffers[buf.index], &buf);
+		else if (dev->memtype == V4L2_MEMORY_DMABUF)
+			video_buffer_fill_dmabuf(dev, &dev->buffers[buf.index], &buf);
 	}
 
-	status = mmal_port_parameter_set_boolean(isp_output, MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
+	cap->last_activity_ns = clock_ns(CLOCK_MONOTONIC);
+	ioctl_time_record(&dev->dqbuf_time, start);
 
-	isp_output->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+	if (cap->source_change_ns)
+		video_source_change_done(cap);
+	video_buffer_transition(dev, &dev->buffers[buf.index],
+				BUFFER_STATE_MASK(QUEUED), BUFFER_STATE_DEQUEUED);
 
-	if (dev->render)
-	{
-		status += mmal_port_parameter_set_boolean(dev->render->input[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE);
-		if (status != MMAL_SUCCESS)
-		{
-			return -1;
-		}
+	/* Keep the last nbufs buffers dequeued unless requested otherwise. */
+	dev->buffers[buf.index].requeue = cap->do_requeue_last ||
+		cap->dequeued < cap->nframes - dev->nbufs;
+	cap->dequeued++;
 
-		dev->render->input[0]->userdata = (struct MMAL_PORT_USERDATA_T *)dev;
+	if (++cap->held > cap->held_max)
+		cap->held_max = cap->held;
 
-		status = mmal_port_enable(dev->render->input[0], render_encoder_input_callback);
-		if (status != MMAL_SUCCESS)
-			return -1;
+	video_check_starvation(cap);
 
-		print("Create pool of %d buffers of size %d for render\n", dev->render->input[0]->buffer_num, 0);
-		dev->render_pool = mmal_port_pool_create(dev->render->input[0], dev->render->input[0]->buffer_num, dev->render->input[0]->buffer_size);
-		if(!dev->render_pool)
-		{
-			print("Failed to create render pool\n");
-			return -1;
-		}
+	if (!buffer_ring_push(&cap->ring, &buf, cap->last_activity_ns)) {
+		print("Processing ring full, requeuing buffer %u\n", buf.index);
+		atomic_fetch_add_explicit(&cap->skipped, 1, memory_order_relaxed);
+		video_buffer_release(dev, buf.index);
 	}
 
-	if (dev->encoder)
-	{
-		status = mmal_port_enable(encoder_input, render_encoder_input_callback);
-		if (status != MMAL_SUCCESS)
-			return -1;
+	return 1;
+}
 
-		print("Create pool of %d buffers of size %d for encode ip\n", encoder_input->buffer_num, 0);
-		dev->encode_pool = mmal_port_pool_create(encoder_input, isp_output->buffer_num, isp_output->buffer_size);
-		if(!dev->encode_pool)
-		{
-			print("Failed to create encode ip pool\n");
-			return -1;
+static int video_event_handler(struct event_source *source, uint32_t events)
+{
+	struct capture *cap = source->priv;
+	int work = 0;
+	int ret;
+
+	if (events & EPOLLPRI) {
+		fprintf(stderr, "Exception\n");
+		if (handle_event(cap->dev)) {
+			ret = video_source_change(cap);
+			if (ret < 0)
+				return ret;
 		}
+		work++;
 	}
 
-	status = mmal_port_enable(isp_output, isp_output_callback);
-	if (status != MMAL_SUCCESS)
-		return -1;
+	/* The device doesn't stream while being reconfigured. */
+	if (!(events & (EPOLLIN | EPOLLOUT | EPOLLERR)) || cap->reconfiguring)
+		return work;
 
-	print("Create pool of %d buffers of size %d for encode/render\n", isp_output->buffer_num, isp_output->buffer_size);
-	dev->isp_output_pool = mmal_port_pool_create(isp_output, isp_output->buffer_num, isp_output->buffer_size);
-	if(!dev->isp_output_pool)
-	{
-		print("Failed to create pool\n");
-		return -1;
+	/* Edge-triggered, drain all completed buffers. */
+	while (cap->dequeued < cap->nframes) {
+		ret = video_dequeue_buffer(cap);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		work++;
 	}
 
-	buffers_to_isp(dev);
+	return work;
+}
 
-	// open h264 file and put the file handle in userdata for the encoder output port
-	if (dev->encoder)
-	{
-		if (filename[0] == '-' && filename[1] == '\0')
-		{
-			dev->h264_fd = stdout;
-			debug = 0;
-		}
-		else {
-			printf("Writing data to %s\n", filename);
-			dev->h264_fd = fopen(filename, "wb");
-		}
+/* Requeue the buffers released by the processing stages. */
+static int video_release_handler(struct event_source *source, uint32_t events)
+{
+	struct capture *cap = source->priv;
+	struct device *dev = cap->dev;
+	uint64_t pending;
+	int ret;
 
-		dev->pts_fd = (void*)fopen("file.pts", "wb");
-		if (dev->pts_fd) /* save header for mkvmerge */
-			fprintf(dev->pts_fd, "# timecode format v2\n");
+	(void)events;
 
-		encoder_output->userdata = (void*)dev;
+	/* Reset the eventfd before collecting the released buffers. */
+	eventfd_clear(source->fd);
 
-		//Create encoder output buffers
+	pending = atomic_exchange_explicit(&dev->released, 0, memory_order_acquire);
+	if (!pending)
+		return 0;
 
-		print("Create pool of %d buffers of size %d\n", encoder_output->buffer_num, encoder_output->buffer_size);
-		dev->output_pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
-		if(!dev->output_pool)
-		{
-			print("Failed to create pool\n");
-			return -1;
-		}
+	cap->last_activity_ns = clock_ns(CLOCK_MONOTONIC);
 
-		dev->save_queue = mmal_queue_create();
-		if(!dev->save_queue)
-		{
-			print("Failed to create queue\n");
-			return -1;
-		}
+	while (pending) {
+		unsigned int index = __builtin_ctzll(pending);
 
-		vcos_status = vcos_thread_create(&dev->save_thread, "save-thread",
-					NULL, save_thread, dev);
-		if(vcos_status != VCOS_SUCCESS)
-		{
-			print("Failed to create save thread\n");
-			return -1;
-		}
+		pending &= pending - 1;
+		cap->held--;
 
-		status = mmal_port_enable(encoder_output, encoder_buffer_callback);
-		if(status != MMAL_SUCCESS)
-		{
-			print("Failed to enable port\n");
-			return -1;
-		}
+		if (!dev->buffers[index].requeue || cap->reconfiguring)
+			continue;
 
-		unsigned int i;
-		for(i=0; i<encoder_output->buffer_num; i++)
-		{
-			MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(dev->output_pool->queue);
+		/* Paced buffers wait for their frame slot. */
+		if (dev->pace_period.denominator) {
+			cap->pace_free |= 1ULL << index;
+			continue;
+		}
 
-			if (!buffer)
-			{
-				print("Where'd my buffer go?!\n");
-				return -1;
-			}
-			status = mmal_port_send_buffer(encoder_output, buffer);
-			if(status != MMAL_SUCCESS)
-			{
-				print("mmal_port_send_buffer failed on buffer %p, status %d\n", buffer, status);
-				return -1;
-			}
-			print("Sent buffer %p\n", buffer);
+		ret = video_queue_buffer(dev, index, cap->fill);
+		if (ret < 0) {
+			print("Unable to requeue buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return ret;
 		}
 	}
 
-	return 0;
+	/* The pipeline has returned the last buffer of the previous format. */
+	if (cap->reconfiguring && cap->held == 0) {
+		alloc_check_pause();
+		ret = video_reconfigure(cap);
+		alloc_check_resume();
+		if (ret < 0)
+			return ret;
+	}
+
+	return 1;
 }
 
-static int enable_mmal_ip(struct device *dev)
+/* Reap the io_uring writer completions. */
+static int video_uring_handler(struct event_source *source, uint32_t events)
 {
-	MMAL_STATUS_T status;
+	struct capture *cap = source->priv;
 
-	if (mmal_port_parameter_set_boolean(dev->isp->input[0], MMAL_PARAMETER_ZERO_COPY, dev->can_zero_copy) != MMAL_SUCCESS)
-	{
-		print("Failed to set zero copy\n");
-		return -1;
-	}
-	status = mmal_port_enable(dev->isp->input[0], isp_ip_cb);
-	if (status != MMAL_SUCCESS)
-	{
-		print("ISP input enable failed\n");
-		return -1;
-	}
-	return 0;
+	(void)events;
+
+	eventfd_clear(source->fd);
+
+	return uring_writer_reap(cap->uring);
 }
 
-static void destroy_mmal(struct device *dev)
+/* Scheduled time of an output frame slot, exact for rational frame rates. */
+static uint64_t video_pace_time(struct capture *cap, uint64_t slot)
 {
-	//FIXME: Clean up everything properly
-	dev->thread_quit = 1;
-	vcos_thread_join(&dev->save_thread, NULL);
+	const struct v4l2_fract *period = &cap->dev->pace_period;
+
+	return cap->pace_start_ns + slot * period->numerator * 1000000000ULL
+	       / period->denominator;
 }
 
-static void video_save_image(struct device *dev, struct v4l2_buffer *buf,
-			     const char *pattern, unsigned int sequence)
+/*
+ * Queue one output buffer per frame slot, timestamped with the slot time like
+ * a real source would. A slot without a free buffer, or that has passed
+ * entirely before the loop woke up, is missed and its frame dropped.
+ */
+static int video_pace_handler(struct event_source *source, uint32_t events)
 {
-	unsigned int size;
-	unsigned int i;
-	char *filename;
-	const char *p;
-	bool append;
-	int ret = 0;
-	int fd;
+	struct capture *cap = source->priv;
+	struct device *dev = cap->dev;
+	uint64_t period_ns;
+	uint64_t jitter;
+	uint64_t now;
+	uint64_t due;
+	unsigned int index;
+	int ret;
 
-	size = strlen(pattern);
-	filename = malloc(size + 12);
-	if (filename == NULL)
-		return;
+	(void)events;
 
-	p = strchr(pattern, '#');
-	if (p != NULL) {
-		sprintf(filename, "%.*s%06u%s", (int)(p - pattern), pattern,
-			sequence, p + 1);
-		append = false;
+	if (!event_timer_read(source))
+		return 0;
+
+	now = clock_ns(CLOCK_MONOTONIC);
+	while (video_pace_time(cap, cap->pace_slot + 1) <= now) {
+		cap->pace_slot++;
+		cap->pace_missed++;
+	}
+
+	due = video_pace_time(cap, cap->pace_slot);
+	period_ns = video_pace_time(cap, cap->pace_slot + 1) - due;
+
+	if (cap->pace_free) {
+		index = __builtin_ctzll(cap->pace_free);
+		cap->pace_free &= cap->pace_free - 1;
+
+		dev->output_timestamp_ns = due;
+		ret = video_queue_buffer(dev, index, cap->fill);
+		dev->output_timestamp_ns = 0;
+		if (ret < 0) {
+			print("Unable to queue buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return ret;
+		}
+
+		jitter = clock_ns(CLOCK_MONOTONIC) - due;
+		histogram_record(&cap->pace_jitter, jitter);
+		if (jitter > period_ns / 2)
+			cap->pace_late++;
+		cap->pace_queued++;
 	} else {
-		strcpy(filename, pattern);
-		append = true;
+		cap->pace_missed++;
 	}
 
-	fd = open(filename, O_CREAT | O_WRONLY | (append ? O_APPEND : O_TRUNC),
-		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	free(filename);
-	if (fd == -1)
-		return;
+	/* Stop once all frames have been queued. */
+	if (cap->pace_queued >= cap->nframes)
+		return 1;
+
+	cap->pace_slot++;
+	ret = event_timer_set(source, video_pace_time(cap, cap->pace_slot));
+	if (ret < 0)
+		return ret;
+
+	return 1;
+}
 
-	for (i = 0; i < dev->num_planes; i++) {
-		void *data = dev->buffers[buf->index].mem[i];
-		unsigned int length;
+/* Requeue the loopback output buffers with a new frame as they complete. */
+static int video_loopback_handler(struct event_source *source, uint32_t events)
+{
+	struct capture *cap = source->priv;
+	struct device *out = cap->dev->loopback;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buf;
+	int work = 0;
+	int ret;
 
-		if (video_is_mplane(dev)) {
-			length = buf->m.planes[i].bytesused;
+	(void)events;
 
-			if (!dev->write_data_prefix) {
-				data += buf->m.planes[i].data_offset;
-				length -= buf->m.planes[i].data_offset;
-			}
+	/* Edge-triggered, drain all completed buffers. */
+	while (1) {
+		memset(&buf, 0, sizeof buf);
+		memset(planes, 0, sizeof planes);
+		buf.type = out->type;
+		buf.memory = out->memtype;
+		buf.length = VIDEO_MAX_PLANES;
+		buf.m.planes = planes;
 
-		} else {
-			length = buf->bytesused;
+		ret = ioctl(out->fd, VIDIOC_DQBUF, &buf);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				break;
+			print("Unable to dequeue loopback buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return -errno;
 		}
 
-		ret = write(fd, data, length);
+		video_buffer_transition(out, &out->buffers[buf.index],
+					BUFFER_STATE_MASK(QUEUED), BUFFER_STATE_FREE);
+
+		ret = video_queue_buffer(out, buf.index, BUFFER_FILL_NONE);
 		if (ret < 0) {
-			print("write error: %s (%d)\n", strerror(errno), errno);
-			break;
-		} else if (ret != (int)length)
-			print("write error: only %d bytes written instead of %u\n",
-			       ret, length);
+			print("Unable to requeue loopback buffer: %s (%d).\n",
+				strerror(errno), errno);
+			return ret;
+		}
+		work++;
 	}
-	close(fd);
+
+	return work;
 }
 
-unsigned int video_buffer_bytes_used(struct device *dev, struct v4l2_buffer *buf)
+static int video_watchdog_handler(struct event_source *source, uint32_t events)
 {
-	unsigned int bytesused = 0;
-	unsigned int i;
+	struct capture *cap = source->priv;
 
-	if (!video_is_mplane(dev))
-		return buf->bytesused;
+	(void)events;
 
-	for (i = 0; i < dev->num_planes; i++)
-		bytesused += buf->m.planes[i].bytesused;
+	if (!event_timer_read(source))
+		return 0;
 
-	return bytesused;
+	if (clock_ns(CLOCK_MONOTONIC) - cap->last_activity_ns > CAPTURE_TIMEOUT_NS) {
+		fprintf(stderr, "capture timeout\n");
+		return -ETIMEDOUT;
+	}
+
+	/* No buffer gets dequeued when the driver has none left. */
+	video_check_starvation(cap);
+
+	return 1;
 }
 
 static int video_do_capture(struct device *dev, unsigned int nframes,
 	unsigned int skip, unsigned int delay, const char *pattern,
 	int do_requeue_last, int do_queue_late, enum buffer_fill_mode fill)
 {
-	struct v4l2_plane planes[VIDEO_MAX_PLANES];
-	struct v4l2_buffer buf;
+	struct capture cap;
+	struct stats_cpu cpu;
 	struct timespec start;
-	struct timeval last;
-	struct timespec ts;
-	unsigned int size;
-	unsigned int i = 0;
+	bool thread = false;
+	unsigned int allocs;
+	int loopback_flags = -1;
+	int flags = -1;
 	double bps;
 	double fps;
 	int ret;
-	int dropped_frames = 0;
 
-	/* Start streaming. */
-	ret = video_enable(dev, 1);
+	memset(&cap, 0, sizeof cap);
+	cap.dev = dev;
+	cap.nframes = nframes;
+	cap.skip = skip;
+	cap.delay = delay;
+	cap.pattern = pattern;
+	cap.do_requeue_last = do_requeue_last;
+	cap.fill = fill;
+	cap.release.fd = -1;
+	cap.watchdog.fd = -1;
+	cap.pacer.fd = -1;
+	histogram_init(&cap.loop_latency);
+	atomic_init(&cap.quit, false);
+	atomic_init(&cap.skipped, 0);
+
+	ret = event_loop_init(&cap.loop);
 	if (ret < 0)
 		goto done;
 
-	if (do_queue_late)
-		video_queue_all_buffers(dev, fill);
+	/* Synchronous saves format the file name in place for every frame. */
+	if (pattern) {
+		cap.filename = malloc(strlen(pattern) + 12);
+		if (cap.filename == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+	}
 
-	size = 0;
-	clock_gettime(CLOCK_MONOTONIC, &start);
-	last.tv_sec = start.tv_sec;
-	last.tv_usec = start.tv_nsec / 1000;
-
-        while (i < nframes) {
-                fd_set fds[3];
-                fd_set *rd_fds = &fds[0]; /* for capture */
-                fd_set *ex_fds = &fds[1]; /* for capture */
-                fd_set *wr_fds = &fds[2]; /* for output */
-                struct timeval tv;
-                int r;
-
-                if (rd_fds) {
-                    FD_ZERO(rd_fds);
-                    FD_SET(dev->fd, rd_fds);
-                }
-
-                if (ex_fds) {
-                    FD_ZERO(ex_fds);
-                    FD_SET(dev->fd, ex_fds);
-                }
-
-                if (wr_fds) {
-                    FD_ZERO(wr_fds);
-                    FD_SET(dev->fd, wr_fds);
-                }
-
-                /* Timeout. */
-                tv.tv_sec = 10;
-                tv.tv_usec = 0;
-
-                r = select(dev->fd + 1, rd_fds, wr_fds, ex_fds, &tv);
-
-                if (-1 == r) {
-                        if (EINTR == errno)
-                                continue;
-                        errno_exit("select");
-                }
-
-                if (0 == r) {
-                        fprintf(stderr, "select timeout\n");
-                        exit(EXIT_FAILURE);
-                }
-
-                if (rd_fds && FD_ISSET(dev->fd, rd_fds)) {
-			const char *ts_type, *ts_source;
-			int queue_buffer = 1;
-			/* Dequeue a buffer. */
-			memset(&buf, 0, sizeof buf);
-			memset(planes, 0, sizeof planes);
-
-			buf.type = dev->type;
-			buf.memory = dev->memtype;
-			buf.length = VIDEO_MAX_PLANES;
-			buf.m.planes = planes;
-
-			ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
-			if (ret < 0) {
-				if (errno != EIO) {
-					print("Unable to dequeue buffer: %s (%d).\n",
-						strerror(errno), errno);
-					goto done;
-				}
-				buf.type = dev->type;
-				buf.memory = dev->memtype;
-				if (dev->memtype == V4L2_MEMORY_USERPTR)
-					video_buffer_fill_userptr(dev, &dev->buffers[i], &buf);
-			}
+	/* Buffers are drained until EAGAIN, the device must not block. */
+	flags = fcntl(dev->fd, F_GETFL);
+	fcntl(dev->fd, F_SETFL, flags | O_NONBLOCK);
 
-			if (video_is_capture(dev))
-				video_verify_buffer(dev, &buf);
-			//print("bytesused in buffer is %d\n", buf.bytesused);
-			size += buf.bytesused;
+	cap.video.fd = dev->fd;
+	cap.video.events = (video_is_capture(dev) ? EPOLLIN : EPOLLOUT) | EPOLLPRI;
+	cap.video.handler = video_event_handler;
+	cap.video.priv = &cap;
 
-			fps = (buf.timestamp.tv_sec - last.tv_sec) * 1000000
-			    + buf.timestamp.tv_usec - last.tv_usec;
-			fps = fps ? 1000000.0 / fps : 0.0;
+	ret = event_loop_add(&cap.loop, &cap.video);
+	if (ret < 0)
+		goto done;
 
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			get_ts_flags(buf.flags, &ts_type, &ts_source);
-			print("%u (%u) [%c] %s %u %u B %ld.%06ld %ld.%06ld %.3f fps ts %s/%s\n", i, buf.index,
-				(buf.flags & V4L2_BUF_FLAG_ERROR) ? 'E' : '-',
-				v4l2_field_name(buf.field),
-				buf.sequence, video_buffer_bytes_used(dev, &buf),
-				buf.timestamp.tv_sec, buf.timestamp.tv_usec,
-				ts.tv_sec, ts.tv_nsec/1000, fps,
-				ts_type, ts_source);
-
-			last = buf.timestamp;
-
-			/* Save the image. */
-			if (video_is_capture(dev) && pattern && !skip)
-				video_save_image(dev, &buf, pattern, i);
-
-			if (dev->mmal_pool) {
-				MMAL_BUFFER_HEADER_T *mmal;
-				MMAL_STATUS_T status;
-				while ((mmal = mmal_queue_get(dev->mmal_pool->queue)) && !mmal->user_data) {
-					print("Discarding MMAL buffer %p as not mapped\n", mmal);
-				}
-				if (!mmal) {
-					print("Failed to get MMAL buffer\n");
-				} else {
-					/* Need to wait for MMAL to be finished with the buffer before returning to V4L2 */
-					queue_buffer = 0;
-					if (((struct buffer*)mmal->user_data)->idx != buf.index) {
-						print("Mismatch in expected buffers. V4L2 gave idx %d, MMAL expecting %d\n",
-							buf.index, ((struct buffer*)mmal->user_data)->idx);
-					}
-					/*if (buf.bytesused != buf.length)
-					{
-						print("V4L2 buffer came back as shorter than allocated - length %u, bytesused %u\n",
-						       buf.length, buf.bytesused);
-					}*/
-					mmal->length = buf.length;	//Deliberately use length as MMAL wants the padding
-
-					if (!dev->starttime.tv_sec)
-						dev->starttime = buf.timestamp;
-
-					struct timeval pts;
-					timersub(&buf.timestamp, &dev->starttime, &pts);
-					//MMAL PTS is in usecs, so convert from struct timeval
-					mmal->pts = (pts.tv_sec * 1000000) + pts.tv_usec;
-					if (mmal->pts > (dev->lastpts+dev->frame_time_usec+1000)) {
-						print("DROPPED FRAME - %lld and %lld, delta %lld\n", dev->lastpts, mmal->pts, mmal->pts-dev->lastpts);
-						dropped_frames++;
-					}
-					dev->lastpts = mmal->pts;
-
-					mmal->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
-					//mmal->pts = buf.timestamp;
-					status = mmal_port_send_buffer(dev->isp->input[0], mmal);
-					if (status != MMAL_SUCCESS)
-						print("mmal_port_send_buffer failed %d\n", status);
-				}
-			}
+	cap.release.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (cap.release.fd < 0) {
+		ret = -errno;
+		goto done;
+	}
+	cap.release.events = EPOLLIN;
+	cap.release.handler = video_release_handler;
+	cap.release.priv = &cap;
+	dev->release_fd = cap.release.fd;
+
+	ret = event_loop_add(&cap.loop, &cap.release);
+	if (ret < 0)
+		goto done;
+
+	ret = event_timer_init(&cap.watchdog, 1000000000ULL,
+			       video_watchdog_handler, &cap);
+	if (ret < 0)
+		goto done;
 
-			if (skip)
-				--skip;
+	ret = event_loop_add(&cap.loop, &cap.watchdog);
+	if (ret < 0)
+		goto done;
 
-			/* Requeue the buffer. */
-			if (delay > 0)
-				usleep(delay * 1000);
+	if (dev->pace_period.denominator) {
+		/* Created disarmed, the first slot starts with streaming. */
+		ret = event_timer_init(&cap.pacer, 0, video_pace_handler, &cap);
+		if (ret < 0)
+			goto done;
 
-			fflush(stdout);
+		ret = event_loop_add(&cap.loop, &cap.pacer);
+		if (ret < 0)
+			goto done;
 
-			i++;
+		histogram_init(&cap.pace_jitter);
+		cap.pace_free = dev->nbufs < 64 ? (1ULL << dev->nbufs) - 1 : ~0ULL;
+	}
 
-			if (i >= nframes - dev->nbufs && !do_requeue_last)
-				continue;
-			if (!queue_buffer)
-				continue;
+	if (dev->loopback) {
+		loopback_flags = fcntl(dev->loopback->fd, F_GETFL);
+		fcntl(dev->loopback->fd, F_SETFL, loopback_flags | O_NONBLOCK);
 
-			ret = video_queue_buffer(dev, buf.index, fill);
-			if (ret < 0) {
-				print("Unable to requeue buffer: %s (%d).\n",
-					strerror(errno), errno);
+		cap.loopback.fd = dev->loopback->fd;
+		cap.loopback.events = EPOLLOUT;
+		cap.loopback.handler = video_loopback_handler;
+		cap.loopback.priv = &cap;
+
+		ret = event_loop_add(&cap.loop, &cap.loopback);
+		if (ret < 0)
+			goto done;
+	}
+
+	cap.initial_bufs = dev->nbufs;
+
+	ret = buffer_ring_init(&cap.ring, dev->max_bufs);
+	if (ret < 0)
+		goto done;
+
+	if (video_is_capture(dev) && pattern && dev->record_mode != RECORD_NONE) {
+		cap.rec = recorder_open(dev, pattern, dev->record_mode,
+					dev->record_size);
+		if (cap.rec == NULL) {
+			ret = -EINVAL;
+			goto done;
+		}
+	}
+
+	if (video_is_capture(dev) && pattern && dev->io_uring) {
+		cap.uring = uring_writer_create(dev, pattern, cap.rec);
+		if (cap.uring) {
+			cap.uring_event.fd = cap.uring->event_fd;
+			cap.uring_event.events = EPOLLIN;
+			cap.uring_event.handler = video_uring_handler;
+			cap.uring_event.priv = &cap;
+
+			ret = event_loop_add(&cap.loop, &cap.uring_event);
+			if (ret < 0)
 				goto done;
-			}
-                }
-                if (wr_fds && FD_ISSET(dev->fd, wr_fds)) {
-                    fprintf(stderr, "Writing?!?!?\n");
-                }
-                if (ex_fds && FD_ISSET(dev->fd, ex_fds)) {
-                    fprintf(stderr, "Exception\n");
-                    handle_event(dev);
-                }
-                /* EAGAIN - continue select loop. */
-        }
+		} else {
+			print("io_uring unavailable, falling back to writer threads\n");
+		}
+	}
+
+	if (video_is_capture(dev) && pattern && !cap.uring &&
+	    (dev->writer_threads || dev->io_uring)) {
+		cap.writer = writer_create(dev, pattern, cap.rec,
+					   dev->writer_threads ? dev->writer_threads : 1,
+					   dev->writer_queue ? dev->writer_queue : dev->max_bufs);
+		if (cap.writer == NULL) {
+			ret = -ENOMEM;
+			goto done;
+		}
+	}
+
+	ret = pthread_create(&cap.thread, NULL, video_process_thread, &cap);
+	if (ret) {
+		print("Unable to create processing thread: %s (%d).\n",
+			strerror(ret), ret);
+		ret = -ret;
+		goto done;
+	}
+	thread = true;
+
+	/*
+	 * Per-frame output goes to stderr when stdout carries encoded data. No
+	 * frame can reach the processing thread before streaming starts.
+	 */
+	ret = stats_start(&cap.stats, dev, debug ? stdout : stderr, cap.thread);
+	if (ret < 0)
+		goto done;
+
+	/* Start streaming, the loopback output first. */
+	if (dev->loopback) {
+		ret = video_enable(dev->loopback, 1);
+		if (ret < 0)
+			goto done;
+	}
+
+	ret = video_enable(dev, 1);
+	if (ret < 0)
+		goto done;
+
+	if (do_queue_late && !dev->pace_period.denominator)
+		video_queue_all_buffers(dev, fill);
+
+	if (dev->pace_period.denominator) {
+		cap.pace_start_ns = clock_ns(CLOCK_MONOTONIC);
+		ret = event_timer_set(&cap.pacer, cap.pace_start_ns);
+		if (ret < 0) {
+			video_enable(dev, 0);
+			goto done;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cap.ts = start;
+	cap.last_activity_ns = clock_ns(CLOCK_MONOTONIC);
 
+	alloc_check_start();
 
-	/* Stop streaming. */
+	while (cap.dequeued < nframes) {
+		ret = event_loop_dispatch(&cap.loop, -1);
+		if (ret < 0)
+			break;
+	}
+
+	/* Debug builds fail the run when the steady state allocates. */
+	allocs = alloc_check_stop();
+	if (allocs) {
+		print("%u heap allocations and frees while streaming\n", allocs);
+		if (ret >= 0)
+			ret = -ENOMEM;
+	}
+
+	/* Let the processing thread drain the ring and the writers complete. */
+	atomic_store(&cap.quit, true);
+	buffer_ring_notify(&cap.ring);
+	pthread_join(cap.thread, NULL);
+	thread = false;
+	stats_stop(&cap.stats);
+
+	if (cap.writer)
+		writer_stop(cap.writer);
+
+	if (ret < 0) {
+		video_enable(dev, 0);
+		goto done;
+	}
+
+	/* Requeue the buffers released last if requested. */
+	video_release_handler(&cap.release, EPOLLIN);
+
+	/* Stop streaming, which returns all queued buffers. */
 	ret = video_enable(dev, 0);
 	if (ret < 0)
-		return ret;
+		goto done;
+
+	video_buffers_reclaim(dev);
+	video_buffer_audit(dev);
 
 	if (nframes == 0) {
 		print("No frames captured.\n");
 		goto done;
 	}
 
-	if (ts.tv_sec == start.tv_sec && ts.tv_nsec == start.tv_nsec) {
-		print("Captured %u frames (%u bytes) 0 seconds\n", i, size);
+	if (cap.ts.tv_sec == start.tv_sec && cap.ts.tv_nsec == start.tv_nsec) {
+		print("Captured %u frames (%u bytes) 0 seconds\n", cap.frames, cap.size);
 		goto done;
 	}
 
-	ts.tv_sec -= start.tv_sec;
-	ts.tv_nsec -= start.tv_nsec;
-	if (ts.tv_nsec < 0) {
-		ts.tv_sec--;
-		ts.tv_nsec += 1000000000;
+	cap.ts.tv_sec -= start.tv_sec;
+	cap.ts.tv_nsec -= start.tv_nsec;
+	if (cap.ts.tv_nsec < 0) {
+		cap.ts.tv_sec--;
+		cap.ts.tv_nsec += 1000000000;
 	}
 
-	bps = size/(ts.tv_nsec/1000.0+1000000.0*ts.tv_sec)*1000000.0;
-	fps = i/(ts.tv_nsec/1000.0+1000000.0*ts.tv_sec)*1000000.0;
+	bps = cap.size/(cap.ts.tv_nsec/1000.0+1000000.0*cap.ts.tv_sec)*1000000.0;
+	fps = cap.frames/(cap.ts.tv_nsec/1000.0+1000000.0*cap.ts.tv_sec)*1000000.0;
 
 	print("Captured %u frames in %lu.%06lu seconds (%f fps, %f B/s).\n",
-		i, ts.tv_sec, ts.tv_nsec/1000, fps, bps);
-	print("Total number of frames dropped %d\n", dropped_frames);
+		cap.frames, cap.ts.tv_sec, cap.ts.tv_nsec/1000, fps, bps);
+	cpu.capture = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	cpu.processing = cap.process_cpu_ns;
+	cpu.writers = cap.writer ? (int64_t)writer_cpu(cap.writer) : 0;
+	stats_report(&cap.stats, &cpu);
+	event_loop_report(&cap.loop, cap.dequeued);
+	ioctl_time_print(&dev->qbuf_time, "QBUF");
+	ioctl_time_print(&dev->dqbuf_time, "DQBUF");
+	ioctl_time_print(&dev->sync_time, "DMA_BUF_IOCTL_SYNC");
+	print("Processing ring: high-water %u of %u slots, max %u of %u buffers held outside the driver\n",
+		cap.ring.high_water, cap.ring.size, cap.held_max, dev->nbufs);
+	if (cap.staging_frames)
+		print("Staging: %u frames, %.1f us per frame, %.1f MB/s\n",
+			cap.staging_frames, cap.staging_ns / 1000.0 / cap.staging_frames,
+			cap.staging_bytes * 1000000000.0 / (cap.staging_ns + 1) / (1024 * 1024));
+	if (cap.pace_queued) {
+		print("Pacing: %u frames queued at %u/%u s per frame, %u late by over half a period, %u slots missed\n",
+			cap.pace_queued, dev->pace_period.numerator,
+			dev->pace_period.denominator, cap.pace_late,
+			cap.pace_missed);
+		histogram_print(&cap.pace_jitter, "Pacing jitter");
+	}
+	if (dev->loopback) {
+		print("Loopback: %u frames decoded, %u lost, %u repeated, %u without frame code\n",
+			cap.loop_frames, cap.loop_lost, cap.loop_repeated,
+			cap.loop_undecoded);
+		histogram_print(&cap.loop_latency, "Loopback latency");
+	}
+	if (cap.source_changes)
+		print("Source changes: %u, longest gap to the first frame %" PRIu64 " ms\n",
+			cap.source_changes, cap.source_gap_max_ns / 1000000);
+	if (dev->nbufs != cap.initial_bufs || dev->max_bufs != cap.initial_bufs)
+		print("Buffer pool: %u grow events, %u to %u buffers, limit %u\n",
+			cap.grow_events, cap.initial_bufs, dev->nbufs, dev->max_bufs);
+	if (cap.writer)
+		writer_report(cap.writer);
+	if (cap.uring)
+		uring_writer_report(cap.uring);
+	if (cap.rec)
+		recorder_report(cap.rec);
+	if (!cap.writer && !cap.uring)
+		save_report_cpu(dev, cap.write_bytes, cap.write_cpu_ns);
+
 done:
+	if (thread) {
+		atomic_store(&cap.quit, true);
+		buffer_ring_notify(&cap.ring);
+		pthread_join(cap.thread, NULL);
+	}
+	if (cap.writer)
+		writer_destroy(cap.writer);
+	if (cap.uring) {
+		uring_writer_stop(cap.uring);
+		uring_writer_destroy(cap.uring);
+	}
+	if (cap.rec)
+		recorder_close(cap.rec);
+	stats_cleanup(&cap.stats);
+	buffer_ring_cleanup(&cap.ring);
+	free(cap.filename);
+
+	dev->release_fd = -1;
+	if (cap.release.fd >= 0)
+		close(cap.release.fd);
+	if (cap.watchdog.fd >= 0)
+		close(cap.watchdog.fd);
+	if (cap.pacer.fd >= 0)
+		close(cap.pacer.fd);
+	event_loop_cleanup(&cap.loop);
+
+	/* Stop the loopback output once the capture side has stopped. */
+	if (dev->loopback) {
+		video_enable(dev->loopback, 0);
+		video_buffers_reclaim(dev->loopback);
+		video_free_buffers(dev->loopback);
+	}
+
+	/* Restore the blocking mode for later users of the file descriptors. */
+	if (flags >= 0)
+		fcntl(dev->fd, F_SETFL, flags);
+	if (loopback_flags >= 0)
+		fcntl(dev->loopback->fd, F_SETFL, loopback_flags);
+
+	if (ret < 0) {
+		video_free_buffers(dev);
+		return ret;
+	}
+
 	return video_free_buffers(dev);
 }
 
+static void fract_reduce(struct v4l2_fract *fract)
+{
+	unsigned int a = fract->numerator;
+	unsigned int b = fract->denominator;
+
+	while (b) {
+		unsigned int t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	if (a > 1) {
+		fract->numerator /= a;
+		fract->denominator /= a;
+	}
+}
+
 int video_set_dv_timings(struct device *dev)
 {
 	struct v4l2_dv_timings timings;
@@ -2648,7 +8809,12 @@ int video_set_dv_timings(struct device *dev)
 				bt->hfrontporch + bt->hsync + bt->hbackporch;
 			dev->fps = (unsigned int)((double)bt->pixelclock /
 				(tot_width * tot_height));
-			print("Framerate is %u\n", dev->fps);
+			dev->frame_period.numerator = tot_width * tot_height;
+			dev->frame_period.denominator = bt->pixelclock;
+			fract_reduce(&dev->frame_period);
+			print("Framerate is %u (%u/%u)\n", dev->fps,
+				dev->frame_period.denominator,
+				dev->frame_period.numerator);
 		}
 	} else {
 		memset(&std, 0, sizeof std);
@@ -2659,9 +8825,15 @@ int video_set_dv_timings(struct device *dev)
 			if (ret < 0) {
 				print("Failed to set standard\n");
 				return -1;
+			} else if (std & V4L2_STD_525_60) {
+				dev->fps = 30;
+				dev->frame_period.numerator = 1001;
+				dev->frame_period.denominator = 30000;
 			} else {
 				// SD video - assume 50Hz / 25fps
 				dev->fps = 25;
+				dev->frame_period.numerator = 1;
+				dev->frame_period.denominator = 25;
 			}
 		}
 	}
@@ -2691,6 +8863,7 @@ int video_get_fps(struct device *dev)
 
 	dev->fps = parm.parm.capture.timeperframe.denominator/
 			parm.parm.capture.timeperframe.numerator;
+	dev->frame_period = parm.parm.capture.timeperframe;
 
 	return 0;
 }
@@ -2698,6 +8871,30 @@ int video_get_fps(struct device *dev)
 #define V4L_BUFFERS_DEFAULT	8
 #define V4L_BUFFERS_MAX		32
 
+/* Parse a size with an optional K, M or G suffix. */
+static unsigned long long parse_size(const char *str, char **endptr)
+{
+	unsigned long long size = strtoull(str, endptr, 10);
+
+	switch (**endptr) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+		(*endptr)++;
+		break;
+	}
+
+	return size;
+}
+
 static void usage(const char *argv0)
 {
 	print("Usage: %s [options] device\n", argv0);
@@ -2720,6 +8917,7 @@ static void usage(const char *argv0)
 	print("-l, --list-controls		List available controls\n");
 	print("-n, --nbufs n			Set the number of video buffers\n");
 	print("-p, --pause			Pause before starting the video stream\n");
+	print("-P, --print-frames		Print one line per frame\n");
 	print("-q, --quality n			MJPEG quality (0-100)\n");
 	print("-r, --get-control ctrl		Get control 'ctrl'\n");
 	print("-R, --realtime=[priority]	Enable realtime RR scheduling\n");
@@ -2729,21 +8927,55 @@ static void usage(const char *argv0)
 	print("-u, --userptr			Use the user pointers streaming method\n");
 	print("-w, --set-control 'ctrl value'	Set control 'ctrl' to 'value'\n");
 	print("    --buffer-prefix		Write portions of buffer before data_offset\n");
+	print("    --buffer-budget size	Grow the buffer pool with VIDIOC_CREATE_BUFS up to size bytes\n");
+	print("				(optional K, M or G suffix) when the driver runs low on buffers\n");
 	print("    --buffer-size		Buffer size in bytes\n");
+	print("    --buffer-watermark n	Grow the pool when the driver holds fewer than n buffers (default 2)\n");
+	print("    --cache-hints		Skip cache maintenance for payloads the CPU doesn't access\n");
+	print("				and bracket CPU access with DMA_BUF_IOCTL_SYNC\n");
+	print("    --clip			Play the output file (-F) as a raw clip of consecutive frames,\n");
+	print("				looping, with USERPTR buffers pointing into the mapped file\n");
+	print("    --direct			Save frames with O_DIRECT from USERPTR buffers, padding\n");
+	print("				the format to the file system block size\n");
+	print("    --dmabuf[=source]		Use the DMABUF streaming method with buffers allocated\n");
+	print("				from a DMA heap (default /dev/dma_heap/system) or \"udmabuf\"\n");
 	print("    --enum-formats		Enumerate formats\n");
 	print("    --enum-inputs		Enumerate inputs\n");
 	print("    --fd                        Use a numeric file descriptor insted of a device\n");
+	print("    --hugepages			Allocate USERPTR buffers from a huge pages pool\n");
+	print("    --io-uring			Save frames with io_uring, falling back to writer threads\n");
 	print("    --field			Interlaced format field order\n");
 	print("    --log-status		Log device status\n");
+	print("    --loopback device		Stream a generated test pattern to the output device and\n");
+	print("				report its latency and frame loss to this capture device\n");
 	print("    --no-query			Don't query capabilities on open\n");
 	print("    --offset			User pointer buffer offset from page start\n");
+	print("    --pace			Queue output buffers at the -t frame rate with generated\n");
+	print("				timestamps, and report the pacing jitter\n");
+	print("    --prefault			Fault in and lock buffers and test patterns before streaming\n");
 	print("    --premultiplied		Color components are premultiplied by alpha value\n");
 	print("    --queue-late		Queue buffers after streamon, not before\n");
+	print("    --record[=mode]		Record frames to a single preallocated file with an index\n");
+	print("				mode is \"append\" (default) or \"ring\", requires -F without '#'\n");
+	print("    --record-size size		Record file size, with optional K, M or G suffix\n");
+	print("				(ring size in ring mode, preallocation step in append mode)\n");
 	print("    --requeue-last		Requeue the last buffers before streamoff\n");
 	print("    --timestamp-source		Set timestamp source on output buffers [eof, soe]\n");
 	print("    --skip n			Skip the first n frames\n");
 	print("    --sleep-forever		Sleep forever after configuring the device\n");
+	print("    --staging[=mode]		Copy frames to cached memory before the CPU reads them\n");
+	print("				mode is \"auto\" (default, when faster than reading in place)\n");
+	print("				or \"always\"\n");
+	print("    --stats format[,interval]	Write a run report in \"json\" or \"csv\" format at exit,\n");
+	print("				and at every stats interval if requested\n");
+	print("    --stats-file file		Run report file name (default yavta-stats.json or .csv)\n");
+	print("    --stats-interval ms	Print capture statistics every ms milliseconds\n");
+	print("				(default 1000, 0 to disable)\n");
 	print("    --stride value		Line stride in bytes\n");
+	print("    --test-pattern		Generate the output frames: colour bars, a moving gradient and\n");
+	print("				the frame sequence and timestamp coded in the top left corner\n");
+	print("    --writers n			Save frames asynchronously with n writer threads\n");
+	print("    --writer-queue n		Writer queue depth in frames (default: number of buffers)\n");
 	print("-m  --mmal			Enable MMAL rendering of images\n");
 }
 
@@ -2763,14 +8995,40 @@ static void usage(const char *argv0)
 #define OPT_PREMULTIPLIED	269
 #define OPT_QUEUE_LATE		270
 #define OPT_DATA_PREFIX		271
+#define OPT_WRITERS		272
+#define OPT_WRITER_QUEUE	273
+#define OPT_IO_URING		274
+#define OPT_RECORD		275
+#define OPT_RECORD_SIZE		276
+#define OPT_DIRECT		277
+#define OPT_STATS_INTERVAL	278
+#define OPT_STATS		279
+#define OPT_STATS_FILE		280
+#define OPT_DMABUF		281
+#define OPT_BUFFER_BUDGET	282
+#define OPT_BUFFER_WATERMARK	283
+#define OPT_HUGEPAGES		284
+#define OPT_PREFAULT		285
+#define OPT_CACHE_HINTS		286
+#define OPT_STAGING		287
+#define OPT_CLIP		288
+#define OPT_PACE		289
+#define OPT_TEST_PATTERN	290
+#define OPT_LOOPBACK		291
 
 static struct option opts[] = {
+	{"buffer-budget", 1, 0, OPT_BUFFER_BUDGET},
 	{"buffer-size", 1, 0, OPT_BUFFER_SIZE},
 	{"buffer-type", 1, 0, 'B'},
+	{"buffer-watermark", 1, 0, OPT_BUFFER_WATERMARK},
+	{"cache-hints", 0, 0, OPT_CACHE_HINTS},
 	{"capture", 2, 0, 'c'},
 	{"check-overrun", 0, 0, 'C'},
+	{"clip", 0, 0, OPT_CLIP},
 	{"data-prefix", 0, 0, OPT_DATA_PREFIX},
 	{"delay", 1, 0, 'd'},
+	{"direct", 0, 0, OPT_DIRECT},
+	{"dmabuf", 2, 0, OPT_DMABUF},
 	{"encode-to", 1, 0, 'E'},
 	{"enum-formats", 0, 0, OPT_ENUM_FORMATS},
 	{"enum-inputs", 0, 0, OPT_ENUM_INPUTS},
@@ -2780,29 +9038,44 @@ static struct option opts[] = {
 	{"fill-frames", 0, 0, 'I'},
 	{"format", 1, 0, 'f'},
 	{"help", 0, 0, 'h'},
+	{"hugepages", 0, 0, OPT_HUGEPAGES},
 	{"input", 1, 0, 'i'},
+	{"io-uring", 0, 0, OPT_IO_URING},
 	{"list-controls", 0, 0, 'l'},
 	{"log-status", 0, 0, OPT_LOG_STATUS},
+	{"loopback", 1, 0, OPT_LOOPBACK},
 	{"mmal", 0, 0, 'm'},
 	{"nbufs", 1, 0, 'n'},
 	{"no-query", 0, 0, OPT_NO_QUERY},
 	{"offset", 1, 0, OPT_USERPTR_OFFSET},
+	{"pace", 0, 0, OPT_PACE},
 	{"pause", 0, 0, 'p'},
+	{"prefault", 0, 0, OPT_PREFAULT},
 	{"premultiplied", 0, 0, OPT_PREMULTIPLIED},
+	{"print-frames", 0, 0, 'P'},
 	{"quality", 1, 0, 'q'},
 	{"queue-late", 0, 0, OPT_QUEUE_LATE},
 	{"get-control", 1, 0, 'r'},
 	{"requeue-last", 0, 0, OPT_REQUEUE_LAST},
 	{"realtime", 2, 0, 'R'},
+	{"record", 2, 0, OPT_RECORD},
+	{"record-size", 1, 0, OPT_RECORD_SIZE},
 	{"size", 1, 0, 's'},
 	{"set-control", 1, 0, 'w'},
 	{"skip", 1, 0, OPT_SKIP_FRAMES},
 	{"sleep-forever", 0, 0, OPT_SLEEP_FOREVER},
+	{"staging", 2, 0, OPT_STAGING},
+	{"stats", 1, 0, OPT_STATS},
+	{"stats-file", 1, 0, OPT_STATS_FILE},
+	{"stats-interval", 1, 0, OPT_STATS_INTERVAL},
 	{"stride", 1, 0, OPT_STRIDE},
+	{"test-pattern", 0, 0, OPT_TEST_PATTERN},
 	{"time-per-frame", 1, 0, 't'},
 	{"timestamp-source", 1, 0, OPT_TSTAMP_SRC},
 	{"dv-timings", 0, 0, 'T'},
 	{"userptr", 0, 0, 'u'},
+	{"writers", 1, 0, OPT_WRITERS},
+	{"writer-queue", 1, 0, OPT_WRITER_QUEUE},
 	{0, 0, 0, 0}
 };
 
@@ -2818,6 +9091,8 @@ int main(int argc, char *argv[])
 	unsigned int capabilities = V4L2_CAP_VIDEO_CAPTURE;
 	int do_file = 0, do_capture = 0, do_pause = 0;
 	int do_set_time_per_frame = 0;
+	int do_pace = 0;
+	const char *loopback = NULL;
 	int do_enum_formats = 0, do_set_format = 0;
 	int do_enum_inputs = 0, do_set_input = 0;
 	int do_list_controls = 0, do_get_control = 0, do_set_control = 0;
@@ -2860,7 +9135,7 @@ int main(int argc, char *argv[])
 	video_init(&dev);
 
 	opterr = 0;
-	while ((c = getopt_long(argc, argv, "B:c::Cd:E:f:F::hi:Ilmn:pq:r:R::s:t:Tuw:", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "B:c::Cd:E:f:F::hi:Ilmn:pPq:r:R::s:t:Tuw:", opts, NULL)) != -1) {
 
 		switch (c) {
 		case 'B':
@@ -2931,6 +9206,9 @@ int main(int argc, char *argv[])
 		case 'p':
 			do_pause = 1;
 			break;
+		case 'P':
+			dev.print_frames = true;
+			break;
 		case 'q':
 			quality = atoi(optarg);
 			break;
@@ -3057,6 +9335,103 @@ int main(int argc, char *argv[])
 		case OPT_DATA_PREFIX:
 			dev.write_data_prefix = true;
 			break;
+		case OPT_WRITERS:
+			dev.writer_threads = atoi(optarg);
+			break;
+		case OPT_WRITER_QUEUE:
+			dev.writer_queue = atoi(optarg);
+			break;
+		case OPT_IO_URING:
+			dev.io_uring = true;
+			break;
+		case OPT_DIRECT:
+			dev.direct = true;
+			break;
+		case OPT_BUFFER_BUDGET:
+			dev.buffer_budget = parse_size(optarg, &endptr);
+			if (*endptr != 0) {
+				print("Invalid buffer budget '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_BUFFER_WATERMARK:
+			dev.buffer_watermark = atoi(optarg);
+			break;
+		case OPT_CACHE_HINTS:
+			dev.cache_hints = true;
+			break;
+		case OPT_CLIP:
+			dev.clip_playback = true;
+			break;
+		case OPT_PACE:
+			do_pace = 1;
+			break;
+		case OPT_TEST_PATTERN:
+			dev.generate = true;
+			break;
+		case OPT_LOOPBACK:
+			loopback = optarg;
+			break;
+		case OPT_PREFAULT:
+			dev.prefault = true;
+			break;
+		case OPT_STAGING:
+			if (optarg == NULL || !strcmp(optarg, "auto")) {
+				dev.staging_mode = STAGING_AUTO;
+			} else if (!strcmp(optarg, "always")) {
+				dev.staging_mode = STAGING_ALWAYS;
+			} else {
+				print("Invalid staging mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_HUGEPAGES:
+			dev.hugepages = true;
+			break;
+		case OPT_DMABUF:
+			memtype = V4L2_MEMORY_DMABUF;
+			dev.dmabuf_source = optarg ? optarg : "/dev/dma_heap/system";
+			break;
+		case OPT_STATS:
+			if (!strncmp(optarg, "json", 4)) {
+				dev.stats_format = STATS_FORMAT_JSON;
+				endptr = optarg + 4;
+			} else if (!strncmp(optarg, "csv", 3)) {
+				dev.stats_format = STATS_FORMAT_CSV;
+				endptr = optarg + 3;
+			} else {
+				endptr = optarg;
+			}
+			if (!strcmp(endptr, ",interval")) {
+				dev.stats_intervals = true;
+			} else if (*endptr != 0 || endptr == optarg) {
+				print("Invalid stats format %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_STATS_FILE:
+			dev.stats_file = optarg;
+			break;
+		case OPT_STATS_INTERVAL:
+			dev.stats_interval = atoi(optarg);
+			break;
+		case OPT_RECORD:
+			if (optarg == NULL || !strcmp(optarg, "append")) {
+				dev.record_mode = RECORD_APPEND;
+			} else if (!strcmp(optarg, "ring")) {
+				dev.record_mode = RECORD_RING;
+			} else {
+				print("Invalid record mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_RECORD_SIZE:
+			dev.record_size = parse_size(optarg, &endptr);
+			if (*endptr != 0) {
+				print("Invalid record size '%s'\n", optarg);
+				return 1;
+			}
+			break;
 		default:
 			print("Invalid option -%c\n", c);
 			print("Run %s -h for help.\n", argv[0]);
@@ -3069,9 +9444,67 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (dev.hugepages && memtype != V4L2_MEMORY_USERPTR) {
+		print("Huge pages can only be used in USERPTR mode.\n");
+		return 1;
+	}
+
 	if (!do_file)
 		filename = NULL;
 
+	if (dev.generate && filename != NULL) {
+		print("The test pattern is either generated or read from a file, not both.\n");
+		return 1;
+	}
+
+	if (dev.clip_playback && filename == NULL) {
+		print("Clip playback requires a file name (-F).\n");
+		return 1;
+	}
+
+	if (dev.record_mode != RECORD_NONE &&
+	    (filename == NULL || strchr(filename, '#') != NULL)) {
+		print("Recording requires a single file name (-F without '#').\n");
+		return 1;
+	}
+
+	if (dev.record_mode == RECORD_RING && !dev.record_size) {
+		print("Ring recording requires --record-size.\n");
+		return 1;
+	}
+
+	if (dev.stats_format != STATS_FORMAT_NONE && dev.stats_file == NULL)
+		dev.stats_file = dev.stats_format == STATS_FORMAT_JSON
+			       ? "yavta-stats.json" : "yavta-stats.csv";
+
+	if (dev.direct) {
+		if (filename == NULL || memtype != V4L2_MEMORY_USERPTR) {
+			print("Direct I/O requires a file name and USERPTR buffers (-F and -u).\n");
+			return 1;
+		}
+
+		dev.direct_align = direct_io_alignment(filename);
+		if (!dev.direct_align) {
+			print("Direct I/O isn't supported for %s.\n", filename);
+			return 1;
+		}
+
+		if (userptr_offset % dev.direct_align) {
+			print("User pointer offset must be a multiple of %u for direct I/O.\n",
+				dev.direct_align);
+			return 1;
+		}
+
+		ret = direct_io_pad_file(filename, dev.direct_align);
+		if (ret < 0) {
+			print("Unable to align %s for direct I/O: %s (%d)\n",
+				filename, strerror(-ret), -ret);
+			return 1;
+		}
+
+		print("Direct I/O alignment %u bytes\n", dev.direct_align);
+	}
+
 	if (!video_has_fd(&dev)) {
 		if (optind >= argc) {
 			usage(argv[0]);
@@ -3097,6 +9530,33 @@ int main(int argc, char *argv[])
 
 	dev.memtype = memtype;
 
+	if ((dev.clip_playback || dev.generate) && !video_is_output(&dev)) {
+		print("Clip playback and test pattern generation require an output device.\n");
+		return 1;
+	}
+
+	if (loopback && !video_is_capture(&dev)) {
+		print("Loopback requires a capture device.\n");
+		return 1;
+	}
+
+	if (do_pace) {
+		if (!video_is_output(&dev) || !do_set_time_per_frame) {
+			print("Pacing requires an output device and a frame rate (-t).\n");
+			return 1;
+		}
+		dev.pace_period = time_per_frame;
+	}
+
+	/* The CPU only touches the payload to save, verify, fill or copy it. */
+	if (video_is_capture(&dev)) {
+		dev.cpu_reads = filename != NULL || loopback ||
+				(fill_mode & BUFFER_FILL_PADDING);
+		dev.cpu_writes = fill_mode != BUFFER_FILL_NONE;
+	} else {
+		dev.cpu_writes = true;
+	}
+
 	if (do_log_status)
 		video_log_status(&dev);
 
@@ -3181,6 +9641,11 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (loopback && video_loopback_open(&dev, loopback, nbufs) < 0) {
+		video_close(&dev);
+		return 1;
+	}
+
 	if (video_prepare_capture(&dev, nbufs, userptr_offset, filename, fill_mode)) {
 		video_close(&dev);
 		return 1;
@@ -3192,7 +9657,9 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (!do_queue_late && video_queue_all_buffers(&dev, fill_mode)) {
+	/* Paced buffers are queued by the capture loop, one per frame period. */
+	if (!do_queue_late && !dev.pace_period.denominator &&
+	    video_queue_all_buffers(&dev, fill_mode)) {
 		video_close(&dev);
 		return 1;
 	}